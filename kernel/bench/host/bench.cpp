@@ -0,0 +1,295 @@
+// Allocator microbenchmarks run against the real pmm.cpp and heap.cpp.
+// Every run uses the same seeds so two builds can be compared directly.
+// Results go to stdout as one JSON object per line, anything the
+// allocators log goes to stderr. If BENCH_COMMIT is set in the
+// environment every line carries it, so results can be kept per commit.
+//
+//   allocbench [filter]    runs the benchmarks whose name contains filter
+
+#include "fake.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+
+#include <mem/mem.hpp>
+#include <arch/arch.hpp>
+
+#define FAKE_MEMORY_MB 1024
+
+static const char* commit = nullptr;
+
+struct xorshift {
+	uint64_t state;
+
+	uint64_t next() {
+		state ^= state << 13;
+		state ^= state >> 7;
+		state ^= state << 17;
+		return state;
+	}
+
+	uint64_t below(uint64_t n) {
+		return next() % n;
+	}
+};
+
+struct timer {
+	timespec start_time;
+	uint64_t start_cycles;
+
+	void start() {
+		clock_gettime(CLOCK_MONOTONIC, &start_time);
+		start_cycles = arch::x86_64::misc::rdtsc();
+	}
+
+	void stop(uint64_t* ns, uint64_t* cycles) {
+		timespec end;
+		*cycles = arch::x86_64::misc::rdtsc() - start_cycles;
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		*ns = (end.tv_sec - start_time.tv_sec) * 1000000000ULL + end.tv_nsec - start_time.tv_nsec;
+	}
+};
+
+// extra is appended as is, either empty or starting with a comma
+static void report(const char* name, uint64_t ops, uint64_t ns, uint64_t cycles, const char* extra = "") {
+	printf("{");
+	if (commit) printf("\"commit\":\"%s\",", commit);
+	printf("\"bench\":\"%s\",\"ops\":%llu,\"ns_per_op\":%.2f,\"cycles_per_op\":%.2f%s}\n",
+	       name, (unsigned long long)ops, (double)ns / ops, (double)cycles / ops, extra);
+	fflush(stdout);
+}
+
+static void* touch(void* ptr, size_t n) {
+	if (ptr && n) {
+		((volatile uint8_t*)ptr)[0] = 1;
+		((volatile uint8_t*)ptr)[n - 1] = 1;
+	}
+	return ptr;
+}
+
+// fills a batch of single pages and frees it again, the per-CPU page cache path
+static void pmm_single_page() {
+	const int batch = 64, rounds = 20000;
+	void* pages[batch];
+	uint64_t ns, cycles;
+	timer t;
+
+	t.start();
+	for (int round = 0; round < rounds; round++) {
+		for (int i = 0; i < batch; i++) pages[i] = mem::pmm::palloc(1);
+		for (int i = batch - 1; i >= 0; i--) mem::pmm::free(pages[i], 1);
+	}
+	t.stop(&ns, &cycles);
+
+	report("pmm_single_page", (uint64_t)rounds * batch * 2, ns, cycles);
+}
+
+// runs of 2 to 512 pages with up to 64 held at once, freed in random order
+static void pmm_multi_page() {
+	const int live = 64, ops = 200000;
+	void* runs[live] = {};
+	size_t sizes[live] = {};
+	xorshift rng = {0x243F6A8885A308D3ULL};
+	uint64_t ns, cycles, failed = 0;
+	timer t;
+
+	t.start();
+	for (int op = 0; op < ops; op++) {
+		int i = rng.below(live);
+		if (runs[i]) {
+			mem::pmm::free(runs[i], sizes[i]);
+			runs[i] = nullptr;
+		} else {
+			sizes[i] = 2 + rng.below(511);
+			runs[i] = mem::pmm::palloc(sizes[i]);
+			if (!runs[i]) failed++;
+		}
+	}
+	t.stop(&ns, &cycles);
+
+	for (int i = 0; i < live; i++) {
+		if (runs[i]) mem::pmm::free(runs[i], sizes[i]);
+	}
+
+	char extra[64];
+	snprintf(extra, sizeof(extra), ",\"failed\":%llu", (unsigned long long)failed);
+	report("pmm_multi_page", ops, ns, cycles, extra);
+}
+
+// 16 to 512 byte objects in a window of 4096, the size class path
+static void heap_small_churn() {
+	const int window = 4096, ops = 2000000;
+	static void* objects[window];
+	xorshift rng = {0x13198A2E03707344ULL};
+	uint64_t ns, cycles;
+	timer t;
+
+	t.start();
+	for (int op = 0; op < ops; op++) {
+		int i = rng.below(window);
+		if (objects[i]) {
+			mem::heap::free(objects[i]);
+			objects[i] = nullptr;
+		} else {
+			size_t n = 16 + rng.below(497);
+			objects[i] = touch(mem::heap::malloc(n), n);
+		}
+	}
+	t.stop(&ns, &cycles);
+
+	for (int i = 0; i < window; i++) {
+		mem::heap::free(objects[i]);
+		objects[i] = nullptr;
+	}
+
+	report("heap_small_churn", ops, ns, cycles);
+}
+
+// 64 buffers appended to round robin up to 256 KiB each, like ramfs writes
+static void heap_realloc_growth() {
+	const int buffers = 64;
+	const size_t limit = 256 * 1024;
+	void* data[buffers] = {};
+	size_t sizes[buffers] = {};
+	xorshift rng = {0xA4093822299F31D0ULL};
+	uint64_t ns, cycles, ops = 0, moves = 0;
+	timer t;
+
+	t.start();
+	for (bool growing = true; growing;) {
+		growing = false;
+		for (int i = 0; i < buffers; i++) {
+			if (sizes[i] >= limit) continue;
+			growing = true;
+
+			size_t n = sizes[i] + 64 + rng.below(193);
+			void* grown = touch(mem::heap::realloc(data[i], n), n);
+			if (data[i] && grown != data[i]) moves++;
+			data[i] = grown;
+			sizes[i] = n;
+			ops++;
+		}
+	}
+	t.stop(&ns, &cycles);
+
+	for (int i = 0; i < buffers; i++) mem::heap::free(data[i]);
+
+	char extra[64];
+	snprintf(extra, sizeof(extra), ",\"moves\":%llu", (unsigned long long)moves);
+	report("heap_realloc_growth", ops, ns, cycles, extra);
+}
+
+// a long mixed workload, then how much the heap maps for what is still live and how fast it still is
+static void heap_fragmentation() {
+	const int window = 16384, epochs = 16, ops_per_epoch = 250000;
+	static void* objects[window];
+	static size_t sizes[window];
+	xorshift rng = {0x082EFA98EC4E6C89ULL};
+	uint64_t ns, cycles, live = 0, peak_pages = 0;
+	timer t;
+
+	t.start();
+	for (int epoch = 0; epoch < epochs; epoch++) {
+		for (int op = 0; op < ops_per_epoch; op++) {
+			int i = rng.below(window);
+			if (objects[i]) {
+				mem::heap::free(objects[i]);
+				live -= sizes[i];
+				objects[i] = nullptr;
+			} else {
+				// log-uniform from 16 bytes to 64 KiB, mostly small with a long tail
+				size_t n = (16ULL << rng.below(13)) + rng.below(16);
+				objects[i] = touch(mem::heap::malloc(n), n);
+				sizes[i] = n;
+				live += n;
+			}
+			if (fake_mapped_pages > peak_pages) peak_pages = fake_mapped_pages;
+		}
+	}
+	t.stop(&ns, &cycles);
+
+	uint64_t mapped = fake_mapped_pages * 0x1000;
+	for (int i = 0; i < window; i++) {
+		mem::heap::free(objects[i]);
+		objects[i] = nullptr;
+	}
+
+	char extra[160];
+	snprintf(extra, sizeof(extra), ",\"live_bytes\":%llu,\"mapped_bytes\":%llu,\"peak_mapped_bytes\":%llu,\"overhead\":%.3f",
+	         (unsigned long long)live, (unsigned long long)mapped, (unsigned long long)peak_pages * 0x1000,
+	         live ? (double)mapped / live : 0.0);
+	report("heap_fragmentation", (uint64_t)epochs * ops_per_epoch, ns, cycles, extra);
+}
+
+// 64 byte to 64 KiB alignments in a window of 4096, mostly small like DMA descriptors with some page buffers.
+// Mapped bytes are counted from where the earlier benchmarks left the heap, base_mapped_bytes is that level
+static void heap_aligned() {
+	const int window = 4096, ops = 1000000;
+	static void* objects[window];
+	static size_t sizes[window];
+	xorshift rng = {0x452821E638D01377ULL};
+	uint64_t ns, cycles, live = 0, peak_live = 0, peak_pages = 0;
+	uint64_t base_pages = fake_mapped_pages;
+	timer t;
+
+	t.start();
+	for (int op = 0; op < ops; op++) {
+		int i = rng.below(window);
+		if (objects[i]) {
+			mem::heap::free(objects[i]);
+			live -= sizes[i];
+			objects[i] = nullptr;
+		} else {
+			size_t alignment = rng.below(8) ? 64ULL << rng.below(4) : 0x1000ULL << rng.below(5);
+			size_t n = alignment <= 512 ? alignment : 0x1000 * (1 + rng.below(4));
+			objects[i] = touch(mem::heap::malloc_aligned(n, alignment), n);
+			sizes[i] = n;
+			live += n;
+			if (live > peak_live) peak_live = live;
+		}
+		if (fake_mapped_pages - base_pages > peak_pages) peak_pages = fake_mapped_pages - base_pages;
+	}
+	t.stop(&ns, &cycles);
+
+	for (int i = 0; i < window; i++) {
+		mem::heap::free(objects[i]);
+		objects[i] = nullptr;
+	}
+
+	char extra[160];
+	snprintf(extra, sizeof(extra), ",\"peak_live_bytes\":%llu,\"peak_mapped_bytes\":%llu,\"base_mapped_bytes\":%llu,\"overhead\":%.3f",
+	         (unsigned long long)peak_live, (unsigned long long)peak_pages * 0x1000, (unsigned long long)base_pages * 0x1000,
+	         peak_live ? (double)peak_pages * 0x1000 / peak_live : 0.0);
+	report("heap_aligned", ops, ns, cycles, extra);
+}
+
+struct benchmark {
+	const char* name;
+	void (*run)();
+};
+
+static const benchmark benchmarks[] = {
+	{"pmm_single_page", pmm_single_page},
+	{"pmm_multi_page", pmm_multi_page},
+	{"heap_small_churn", heap_small_churn},
+	{"heap_realloc_growth", heap_realloc_growth},
+	{"heap_fragmentation", heap_fragmentation},
+	{"heap_aligned", heap_aligned},
+};
+
+int main(int argc, char** argv) {
+	const char* filter = argc > 1 ? argv[1] : "";
+	commit = getenv("BENCH_COMMIT");
+
+	fake_setup(FAKE_MEMORY_MB);
+	mem::pmm::initialise();
+	mem::heap::initialise();
+
+	for (const benchmark& b : benchmarks) {
+		if (strstr(b.name, filter)) b.run();
+	}
+
+	return 0;
+}
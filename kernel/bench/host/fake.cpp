@@ -0,0 +1,203 @@
+// The pieces of the kernel the PMM and heap lean on, faked for a normal
+// process: a Limine memory map over a memfd that plays physical memory,
+// pa_to_va into a mapping of it, and mmap_anonymous/munmap_anonymous that
+// take real frames from the PMM and map them at the heap's address with
+// the host's mmap, so both allocators run unmodified.
+
+#include "fake.hpp"
+
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <limine.h>
+#include <mem/mem.hpp>
+#include <arch/x86_64/apic/apic.hpp>
+
+extern "C" {
+#include <proc/spinlocks.h>
+}
+
+#define PAGE_SIZE 0x1000ULL
+#define RUN_PAGES 512
+
+extern volatile limine_memmap_request memmap_request;
+
+static int phys_fd = -1;
+static uint8_t* phys_base = nullptr;
+static uint64_t phys_size = 0;
+
+static limine_memmap_entry entries[4];
+static limine_memmap_entry* entry_ptrs[4];
+static limine_memmap_response memmap;
+
+// what mmap_anonymous put where, so munmap_anonymous can give the frames back
+struct fake_mapping {
+	uint64_t phys;
+	uint64_t npages;
+};
+static std::map<uint64_t, fake_mapping> mappings;
+
+uint64_t fake_mapped_pages = 0;
+
+void fake_setup(uint64_t megabytes) {
+	phys_size = megabytes << 20;
+	phys_fd = memfd_create("fake-phys", 0);
+	if (phys_fd < 0 || ftruncate(phys_fd, phys_size) < 0) {
+		perror("memfd");
+		exit(1);
+	}
+
+	phys_base = (uint8_t*)mmap(nullptr, phys_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_NORESERVE, phys_fd, 0);
+	if (phys_base == MAP_FAILED) {
+		perror("mmap");
+		exit(1);
+	}
+
+	// low memory, a hole for the firmware, then two usable ranges split by a reserved one like a real PC
+	entries[0] = {0x1000, 0x9F000, LIMINE_MEMMAP_USABLE};
+	entries[1] = {0x9F000, 0x61000, LIMINE_MEMMAP_RESERVED};
+	entries[2] = {0x100000, phys_size / 2 - 0x100000, LIMINE_MEMMAP_USABLE};
+	entries[3] = {phys_size / 2 + 0x10000, phys_size / 2 - 0x10000, LIMINE_MEMMAP_USABLE};
+	for (int i = 0; i < 4; i++) entry_ptrs[i] = &entries[i];
+
+	memmap.entry_count = 4;
+	memmap.entries = entry_ptrs;
+	memmap_request.response = &memmap;
+}
+
+static cpu_unit boot_cpu;
+
+namespace arch::x86_64::apic {
+
+cpu_unit* get_current_cpu() {
+	boot_cpu.is_bsp = true;
+	boot_cpu.online = true;
+	return &boot_cpu;
+}
+
+cpu_registry* get_cpu_registry() {
+	return nullptr;
+}
+
+}
+
+extern "C" void c_acquire_spinlock(struct spinlock* lock) {
+	while (__atomic_exchange_n(&lock->locked, 1, __ATOMIC_ACQUIRE)) asm volatile("pause");
+}
+
+extern "C" void c_release_spinlock(struct spinlock* lock) {
+	__atomic_store_n(&lock->locked, 0, __ATOMIC_RELEASE);
+}
+
+// the heap profiler names call sites with the kernel's symbol table, there's none here
+const char* find_symbol(uint64_t addr, uint64_t* offset) {
+	if (offset) *offset = addr;
+	return "??";
+}
+
+namespace Log {
+
+void errf(const char* fmt, ...) {
+	va_list args;
+	va_start(args, fmt);
+	fprintf(stderr, "error: ");
+	vfprintf(stderr, fmt, args);
+	fprintf(stderr, "\n");
+	va_end(args);
+}
+
+void warnf(const char* fmt, ...) {
+	va_list args;
+	va_start(args, fmt);
+	fprintf(stderr, "warning: ");
+	vfprintf(stderr, fmt, args);
+	fprintf(stderr, "\n");
+	va_end(args);
+}
+
+void infof(const char* fmt, ...) {
+	va_list args;
+	va_start(args, fmt);
+	vfprintf(stderr, fmt, args);
+	fprintf(stderr, "\n");
+	va_end(args);
+}
+
+}
+
+namespace mem {
+
+void* memset(void* dest, int value, size_t count) {
+	return ::memset(dest, value, count);
+}
+
+void* memcpy(void* dest, const void* src, size_t count) {
+	return ::memcpy(dest, src, count);
+}
+
+// the host's stores go through the cache either way
+void* memset_nt(void* dest, int value, size_t count) {
+	return ::memset(dest, value, count);
+}
+
+namespace vmm {
+
+uint64_t pa_to_va(uint64_t pa) {
+	return (uint64_t)(phys_base + pa);
+}
+
+uint64_t va_to_pa(uint64_t va) {
+	return va - (uint64_t)phys_base;
+}
+
+uint64_t mmap_anonymous(void* vaddr, size_t npages, uint64_t) {
+	uint64_t va = (uint64_t)vaddr;
+	uint64_t end = va + npages * PAGE_SIZE;
+
+	while (va < end) {
+		uint64_t chunk = 1;
+		void* frames = nullptr;
+		if ((va & (RUN_PAGES * PAGE_SIZE - 1)) == 0 && end - va >= RUN_PAGES * PAGE_SIZE) {
+			frames = mem::pmm::palloc_zeroed(RUN_PAGES);
+			if (frames) chunk = RUN_PAGES;
+		}
+		if (!frames) frames = mem::pmm::palloc_zeroed(1);
+		if (!frames) {
+			munmap_anonymous(vaddr, (va - (uint64_t)vaddr) / PAGE_SIZE);
+			return 0;
+		}
+
+		void* at = ::mmap((void*)va, chunk * PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, phys_fd, (uint64_t)frames);
+		if (at == MAP_FAILED) {
+			perror("mmap");
+			exit(1);
+		}
+
+		mappings[va] = {(uint64_t)frames, chunk};
+		fake_mapped_pages += chunk;
+		va += chunk * PAGE_SIZE;
+	}
+
+	return 1;
+}
+
+void munmap_anonymous(void* vaddr, size_t npages) {
+	uint64_t va = (uint64_t)vaddr;
+	uint64_t end = va + npages * PAGE_SIZE;
+
+	auto it = mappings.lower_bound(va);
+	while (it != mappings.end() && it->first < end) {
+		::munmap((void*)it->first, it->second.npages * PAGE_SIZE);
+		mem::pmm::free((void*)it->second.phys, it->second.npages);
+		fake_mapped_pages -= it->second.npages;
+		it = mappings.erase(it);
+	}
+}
+
+}
+}
@@ -0,0 +1,12 @@
+#ifndef FAKE_HPP
+#define FAKE_HPP 1
+
+#include <cstdint>
+
+// hands the PMM a memory map over megabytes of fake physical memory, call before mem::pmm::initialise
+void fake_setup(uint64_t megabytes);
+
+// pages currently mapped through mem::vmm::mmap_anonymous, i.e. what the heap holds
+extern uint64_t fake_mapped_pages;
+
+#endif
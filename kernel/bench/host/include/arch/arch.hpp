@@ -0,0 +1,52 @@
+#ifndef ARCH_HPP
+#define ARCH_HPP 1
+
+// Stands in for src/arch/arch.hpp in the hosted benchmark. Only the
+// misc helpers the allocators use are provided, and irq_save can't cli
+// in ring 3, so it does nothing.
+
+#include <cstdint>
+
+namespace arch {
+namespace x86_64 {
+namespace misc {
+	struct cpuid_ret {
+	    uint32_t eax;
+	    uint32_t ebx;
+	    uint32_t ecx;
+	    uint32_t edx;
+	};
+
+	static inline cpuid_ret cpuid(uint32_t func, uint32_t subleaf) {
+		cpuid_ret ret;
+		asm volatile (
+			"cpuid"
+			: "=a"(ret.eax),
+			  "=b"(ret.ebx),
+			  "=c"(ret.ecx),
+			  "=d"(ret.edx)
+			: "a"(func), "c"(subleaf)
+		);
+
+		return ret;
+	}
+
+	static inline uint64_t rdtsc() {
+		uint32_t l, h;
+		asm volatile (
+			"rdtsc"
+			: "=a"(l), "=d"(h)
+		);
+		return (uint64_t)(((uint64_t)h << 32) | l);
+	}
+
+	static inline uint64_t irq_save() {
+		return 0;
+	}
+
+	static inline void irq_restore(uint64_t) {}
+}
+}
+}
+
+#endif
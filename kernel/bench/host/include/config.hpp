@@ -0,0 +1,7 @@
+#ifndef CONFIG_HPP
+#define CONFIG_HPP 1
+
+// The hosted benchmark doesn't go through Kconfig, pass CONFIG_* options
+// with BENCH_CPPFLAGS instead, e.g. make BENCH_CPPFLAGS=-DCONFIG_HEAP_STATS
+
+#endif
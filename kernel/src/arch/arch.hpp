@@ -102,8 +102,10 @@ namespace cpu {
 		void load_tss();
 		void load_gdt();
 		void initialise();
+		bool initialise_ap(uint64_t stack_top, void** gdt_base, void** tss_base);
 
 		void update_stack(uint64_t new_rsp = 0);
+		uint64_t get_stack();
 
 		void* get_base();
 		void* get_tss_base();
@@ -112,7 +114,7 @@ namespace cpu {
 	namespace idt {
 		void load_idt();
 		void initialise();
-		void set_descriptor(uint8_t vector, uint64_t isr, uint8_t flags);
+		void set_descriptor(uint8_t vector, uint64_t isr, uint8_t flags, uint8_t ist = 1);
 		void clear_descriptor(uint8_t vector);
 		void irq_clear_mask(uint8_t irq);
 		void irq_set_mask(uint8_t irq);
@@ -178,6 +180,33 @@ namespace misc {
 			: "a"(func), "c"(subleaf)
 		);
 	}
+
+	static inline uint64_t rdtsc() {
+		uint32_t l, h;
+		asm volatile (
+			"rdtsc"
+			: "=a"(l), "=d"(h)
+		);
+		return (uint64_t)(((uint64_t)h << 32) | l);
+	}
+
+	// disables interrupts and returns the previous RFLAGS for irq_restore
+	static inline uint64_t irq_save() {
+		uint64_t flags;
+		asm volatile (
+			"pushfq\n"
+			"pop %0\n"
+			"cli"
+			: "=r"(flags)
+			:
+			: "memory"
+		);
+		return flags;
+	}
+
+	static inline void irq_restore(uint64_t flags) {
+		if (flags & (1 << 9)) asm volatile ("sti" ::: "memory");
+	}
 }
 }
 }
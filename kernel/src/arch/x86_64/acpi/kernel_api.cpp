@@ -4,9 +4,13 @@
 #include <cstdio>
 #include <cstdarg>
 #include <arch/arch.hpp>
+#include <arch/x86_64/apic/apic.hpp>
 #include <drivers/timers/pit/pit.hpp>
 #include <panic.hpp>
 #include <cstdint>
+#include <proc/sched.hpp>
+#include <proc/workqueue.hpp>
+#include <proc/waitqueue.hpp>
 
 extern "C" {
 
@@ -31,7 +35,7 @@ void* uacpi_kernel_map(uacpi_phys_addr addr, uacpi_size len) {
         void* phys_aligned = (void*)((uint64_t)addr & ~(0xFFF));
         void* virt_aligned = (void*)(virt_addr & ~(0xFFF));
         uint64_t pages = (len + 0xFFF) / 0x1000;
-        mem::vmm::mmap(phys_aligned, virt_aligned, pages, PAGE_PRESENT | PAGE_RW);
+        mem::vmm::mmap(phys_aligned, virt_aligned, pages, PAGE_PRESENT | PAGE_RW | PAGE_NX);
     }
     
     return (void*)virt_addr;
@@ -324,105 +328,115 @@ void uacpi_kernel_sleep(uacpi_u64 msec) {
     drivers::timers::pit::sleep_ms(msec);
 }
 
+/*
+ * the handle wrappers below are tiny and churned by the interpreter, each kind gets its own slab cache.
+ * Workers on several CPUs may create the first handle of a kind at once, the loser drops its cache
+ */
+static mem::slab::cache* handle_cache(mem::slab::cache** c, const char* name, size_t size) {
+    mem::slab::cache* cur = __atomic_load_n(c, __ATOMIC_ACQUIRE);
+    if (cur) return cur;
+
+    mem::slab::cache* fresh = mem::slab::create(name, size);
+    if (!fresh) return nullptr;
+    if (!__atomic_compare_exchange_n(c, &cur, fresh, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        mem::slab::destroy(fresh);
+        return cur;
+    }
+    return fresh;
+}
+
 struct mutex {
     bool locked;
+    wait_queue waiters;
 };
 
+static mem::slab::cache* mutex_cache = nullptr;
+
 uacpi_handle uacpi_kernel_create_mutex(void) {
-    mutex* m = (mutex*)mem::heap::malloc(sizeof(mutex));
+    mem::slab::cache* c = handle_cache(&mutex_cache, "uacpi_mutex", sizeof(mutex));
+    mutex* m = c ? (mutex*)mem::slab::alloc(c) : nullptr;
     if (!m) return nullptr;
     m->locked = false;
+    proc::wait::initialise(&m->waiters, "uacpi_mutex");
 
     return m;
 }
 
 void uacpi_kernel_free_mutex(uacpi_handle handle) {
-    mem::heap::free(handle);
+    mem::slab::free(mutex_cache, handle);
 }
 
+/* counts signals, every successful wait takes one */
 struct event {
-    bool signaled;
+    uint64_t signaled;
+    wait_queue waiters;
 };
 
+static mem::slab::cache* event_cache = nullptr;
+
 uacpi_handle uacpi_kernel_create_event(void) {
-    event* e = (event*)mem::heap::malloc(sizeof(event));
+    mem::slab::cache* c = handle_cache(&event_cache, "uacpi_event", sizeof(event));
+    event* e = c ? (event*)mem::slab::alloc(c) : nullptr;
     if (!e) return nullptr;
-    e->signaled = false;
+    e->signaled = 0;
+    proc::wait::initialise(&e->waiters, "uacpi_event");
 
     return e;
 }
 
 void uacpi_kernel_free_event(uacpi_handle handle) {
-    mem::heap::free(handle);
+    mem::slab::free(event_cache, handle);
 }
 
+/* uACPI takes a matching id for a recursive acquire, so it has to tell the worker threads apart. Null is the boot context before the scheduler */
 uacpi_thread_id uacpi_kernel_get_thread_id(void) {
-    return (uacpi_thread_id)1;
+    return (uacpi_thread_id)proc::sched::current();
+}
+
+/* uACPI's timeouts are in milliseconds, 0xFFFF waits forever and 0 only tries */
+static uint64_t wait_timeout(uacpi_u16 timeout) {
+    return timeout == 0xFFFF ? WAIT_FOREVER : timeout;
 }
 
 uacpi_status uacpi_kernel_acquire_mutex(uacpi_handle handle, uacpi_u16 timeout) {
-    uint64_t current_nsec = drivers::timers::pit::ns_elapsed_time();
-    uint64_t target_nsec = current_nsec + (timeout * 1000);
-    bool op_successful = false;
-    if (timeout == 0x0000) {
-        mutex* e = (mutex*)handle;
-        if (e->locked == true) return UACPI_STATUS_TIMEOUT;
-        else return UACPI_STATUS_OK;
-    } else if (timeout == 0xFFFF) {
-        target_nsec = (uint64_t)-1;
-    }
-    while (drivers::timers::pit::ns_elapsed_time() < target_nsec) {
-        mutex* e = (mutex*)handle;
-        if (e->locked == true) continue;
-        else {
-            op_successful = true;
-            break;
-        }
-    }
+    mutex* m = (mutex*)handle;
+    auto take = [m] { return !__atomic_exchange_n(&m->locked, true, __ATOMIC_ACQUIRE); };
 
-    if (!op_successful) return UACPI_STATUS_TIMEOUT;
+    if (timeout == 0) return take() ? UACPI_STATUS_OK : UACPI_STATUS_TIMEOUT;
+    if (!proc::wait::wait_until(&m->waiters, take, wait_timeout(timeout))) return UACPI_STATUS_TIMEOUT;
 
     return UACPI_STATUS_OK;
 }
 
 void uacpi_kernel_release_mutex(uacpi_handle handle) {
     mutex* m = (mutex*)handle;
-    m->locked = false;
+    __atomic_store_n(&m->locked, false, __ATOMIC_RELEASE);
+    proc::wait::wake_one(&m->waiters);
 }
 
 uacpi_bool uacpi_kernel_wait_for_event(uacpi_handle handle, uacpi_u16 timeout) {
-    uint64_t current_nsec = drivers::timers::pit::ns_elapsed_time();
-    uint64_t target_nsec = current_nsec + (timeout * 1000);
-    bool op_successful = false;
-    if (timeout == 0x0000) {
-        event* e = (event*)handle;
-        if (e->signaled == true) return false;
-        else return true;
-    } else if (timeout == 0xFFFF) {
-        target_nsec = (uint64_t)-1;
-    }
-    while (drivers::timers::pit::ns_elapsed_time() < target_nsec) {
-        event* e = (event*)handle;
-        if (e->signaled == false) continue;
-        else {
-            op_successful = true;
-            break;
+    event* e = (event*)handle;
+    auto take = [e] {
+        uint64_t n = __atomic_load_n(&e->signaled, __ATOMIC_ACQUIRE);
+        while (n) {
+            if (__atomic_compare_exchange_n(&e->signaled, &n, n - 1, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) return true;
         }
-    }
-
-    if (!op_successful) return false;
+        return false;
+    };
 
-    return true;
+    if (timeout == 0) return take();
+    return proc::wait::wait_until(&e->waiters, take, wait_timeout(timeout));
 }
 
 void uacpi_kernel_signal_event(uacpi_handle handle) {
     event* e = (event*)handle;
-    e->signaled = true;
+    __atomic_add_fetch(&e->signaled, 1, __ATOMIC_RELEASE);
+    proc::wait::wake_one(&e->waiters);
 }
 
 void uacpi_kernel_reset_event(uacpi_handle handle) {
     event* e = (event*)handle;
-    e->signaled = false;
+    __atomic_store_n(&e->signaled, 0, __ATOMIC_RELEASE);
 }
 
 uacpi_status uacpi_kernel_handle_firmware_request(uacpi_firmware_request* request) {
@@ -434,13 +448,52 @@ struct interrupt {
     uint8_t vector;
     uint8_t irq;
     bool is_irq;
+    uacpi_interrupt_handler handler;
     uacpi_handle ctx;
+    work_item work;
 };
 
+/* uACPI only ever installs the SCI, so a single stub does */
+static interrupt* installed_interrupt = nullptr;
+static uint32_t interrupts_in_flight = 0;
+
+/* woken whenever interrupts_in_flight or work_in_flight drops to zero */
+static wait_queue in_flight_drained = {{"UACPI_DRAINED", 0}, nullptr, nullptr};
+
+static void in_flight_done(uint32_t* counter) {
+    if (__atomic_sub_fetch(counter, 1, __ATOMIC_RELEASE) == 0) proc::wait::wake_all(&in_flight_drained);
+}
+
+static void wait_in_flight(uint32_t* counter) {
+    proc::wait::wait_until(&in_flight_drained, [counter] { return __atomic_load_n(counter, __ATOMIC_ACQUIRE) == 0; }, WAIT_FOREVER);
+}
+
+static void acpi_interrupt_work(void* arg) {
+    interrupt* i = (interrupt*)arg;
+    i->handler(i->ctx);
+
+    arch::x86_64::cpu::idt::irq_clear_mask(i->irq);
+    in_flight_done(&interrupts_in_flight);
+}
+
+/* the SCI is level triggered, so it stays masked until the handler has run on a worker and quietened it */
+__attribute__((interrupt))
+static void acpi_interrupt_handler(void*) {
+    interrupt* i = installed_interrupt;
+    if (i) {
+        arch::x86_64::cpu::idt::irq_set_mask(i->irq);
+        __atomic_add_fetch(&interrupts_in_flight, 1, __ATOMIC_RELAXED);
+        if (!proc::work::schedule(&i->work)) in_flight_done(&interrupts_in_flight);
+    }
+
+    arch::x86_64::cpu::idt::send_eoi(i ? i->irq : 0);
+}
+
 uacpi_status uacpi_kernel_install_interrupt_handler(
     uacpi_u32 irq, uacpi_interrupt_handler handler, uacpi_handle ctx,
     uacpi_handle *out_irq_handle
 ) {
+    if (installed_interrupt) return UACPI_STATUS_ALREADY_EXISTS;
     uint8_t vector = irq + 0x20;
 
     interrupt *i = (interrupt*)mem::heap::malloc(sizeof(interrupt));
@@ -448,11 +501,14 @@ uacpi_status uacpi_kernel_install_interrupt_handler(
     i->vector = vector;
     i->irq = irq;
     i->is_irq = true;
+    i->handler = handler;
     i->ctx = ctx;
+    i->work = {acpi_interrupt_work, i, nullptr, false};
 
     *out_irq_handle = i;
+    installed_interrupt = i;
 
-    arch::x86_64::cpu::idt::set_descriptor(vector, (uint64_t)handler, 0x8E);
+    arch::x86_64::cpu::idt::set_descriptor(vector, (uint64_t)acpi_interrupt_handler, 0x8E);
     return UACPI_STATUS_OK;
 }
 
@@ -462,17 +518,25 @@ uacpi_status uacpi_kernel_uninstall_interrupt_handler(
     (void)unused;
     interrupt* i = (interrupt*)irq_handle;
     arch::x86_64::cpu::idt::clear_descriptor(i->vector);
+    installed_interrupt = nullptr;
+
+    /* a deferred run may still be queued or running */
+    wait_in_flight(&interrupts_in_flight);
 
     mem::heap::free(irq_handle);
     return UACPI_STATUS_OK;
 }
 
-struct spinlock {
+/* uACPI's own, not the kernel's struct spinlock */
+struct acpi_spinlock {
     bool locked;
 };
 
+static mem::slab::cache* spinlock_cache = nullptr;
+
 uacpi_handle uacpi_kernel_create_spinlock(void) {
-    spinlock* s = (spinlock*)mem::heap::malloc(sizeof(spinlock));
+    mem::slab::cache* c = handle_cache(&spinlock_cache, "uacpi_spinlock", sizeof(acpi_spinlock));
+    acpi_spinlock* s = c ? (acpi_spinlock*)mem::slab::alloc(c) : nullptr;
     if (!s) return nullptr;
     s->locked = false;
 
@@ -480,43 +544,65 @@ uacpi_handle uacpi_kernel_create_spinlock(void) {
 }
 
 void uacpi_kernel_free_spinlock(uacpi_handle handle) {
-    mem::heap::free(handle);
+    mem::slab::free(spinlock_cache, handle);
 }
 
+/* the SCI handler takes these too, so interrupts stay off while one is held */
 uacpi_cpu_flags uacpi_kernel_lock_spinlock(uacpi_handle handle) {
-    spinlock* s = (spinlock*)handle;
-    while (s->locked == true);
-    s->locked = true;
+    acpi_spinlock* s = (acpi_spinlock*)handle;
+    uint64_t flags = arch::x86_64::misc::irq_save();
+    while (__atomic_exchange_n(&s->locked, true, __ATOMIC_ACQUIRE)) asm volatile ("pause");
 
-    return 0;
+    return flags;
 }
 
 void uacpi_kernel_unlock_spinlock(uacpi_handle handle, uacpi_cpu_flags flags) {
-    (void)flags;
-    spinlock* s = (spinlock*)handle;
-    s->locked = false;
+    acpi_spinlock* s = (acpi_spinlock*)handle;
+    __atomic_store_n(&s->locked, false, __ATOMIC_RELEASE);
+    arch::x86_64::misc::irq_restore(flags);
 }
 
 struct work {
-    bool signaled;
-    uacpi_work_type type;
+    work_item item;
     uacpi_work_handler handler;
+    uacpi_handle ctx;
 };
 
+static mem::slab::cache* work_cache = nullptr;
+static uint32_t work_in_flight = 0;
+
+static void run_work(void* arg) {
+    work* w = (work*)arg;
+    w->handler(w->ctx);
+
+    mem::slab::free(work_cache, w);
+    in_flight_done(&work_in_flight);
+}
+
 uacpi_status uacpi_kernel_schedule_work(
     uacpi_work_type type, uacpi_work_handler handler, uacpi_handle ctx
 ) {
-    (void)ctx;
-    work* w = (work*)mem::heap::malloc(sizeof(work));
+    mem::slab::cache* c = handle_cache(&work_cache, "uacpi_work", sizeof(work));
+    work* w = c ? (work*)mem::slab::alloc(c) : nullptr;
     if (!w) return UACPI_STATUS_OUT_OF_MEMORY;
-    w->signaled = false;
-    w->type = type;
+    w->item = {run_work, w, nullptr, false};
     w->handler = handler;
+    w->ctx = ctx;
+
+    __atomic_add_fetch(&work_in_flight, 1, __ATOMIC_RELAXED);
+
+    /* GPE methods stay on the BSP, some firmware's SMI handlers misbehave elsewhere */
+    if (type == UACPI_WORK_GPE_EXECUTION) proc::work::schedule_on(arch::x86_64::apic::get_bsp(), &w->item);
+    else proc::work::schedule(&w->item);
 
     return UACPI_STATUS_OK;
 }
 
 uacpi_status uacpi_kernel_wait_for_work_completion(void) {
+    /* interrupts first, their handlers may schedule more work */
+    wait_in_flight(&interrupts_in_flight);
+    wait_in_flight(&work_in_flight);
+
     return UACPI_STATUS_OK;
 }
 
@@ -9,6 +9,8 @@
 #include <drivers/timers/pit/pit.hpp>
 #include <drivers/timers/apic/apic.hpp>
 #include <config.hpp>
+#include <limine.h>
+#include <proc/sched.hpp>
 
 #define MADT_ENTRY_LAPIC    0x0
 #define MADT_ENTRY_IOAPIC   0x1
@@ -43,6 +45,11 @@
 #define APIC_LVT_INT_MASKED 		0x10000
 #define APIC_LVT_TIMER_MODE_PERIODIC 0x20000
 
+#define APIC_SPURIOUS_ENABLE    0x100
+
+/* how long the BSP waits for the APs to check in, seconds on anything this runs on */
+#define AP_TIMEOUT_CYCLES 4000000000ULL
+
 struct madt_lapic_entry {
     uint8_t type;
     uint8_t length;
@@ -79,6 +86,14 @@ struct madt_table {
     uint8_t entries[];
 } __attribute__((packed));
 
+__attribute__((section(".limine_requests")))
+volatile limine_mp_request mp_request = {
+    .id = LIMINE_MP_REQUEST_ID,
+    .revision = 0,
+    .response = nullptr,
+    .flags = 0,
+};
+
 namespace arch::x86_64::apic {
 
 static uacpi_table madt_handle;
@@ -90,17 +105,29 @@ static cpu_unit* tail_unit = nullptr;
 static bool x2apic_enabled = false;
 static bool enabled = false;
 static cpu_unit* bsp;
+static cpu_unit* apic_id_map[256];
+static mem::slab::cache* cpu_unit_cache = nullptr;
+static uint32_t spurious_reg = 0;
+static uint32_t aps_online = 0;
+static bool aps_released = false;
+static uint64_t ap_cr3 = 0;
 
 static bool is_bsp(uint32_t apic_id) {
 	if (!bsp) return true;
     return bsp->apic_id == apic_id;
 }
 
+/* process page tables only share the kernel half, so MMIO is mapped up there rather than identity mapped */
+static volatile uint32_t* map_mmio(uint64_t phys) {
+    uint64_t page = phys & ~0xFFFULL;
+    mem::vmm::mmap((void*)page, (void*)mem::vmm::pa_to_va(page), 1, PAGE_PRESENT | PAGE_RW | PAGE_PCD | PAGE_NX);
+    return (volatile uint32_t*)mem::vmm::pa_to_va(phys);
+}
+
 static bool check_x2apic_support() {
     bool is_enabled = (arch::x86_64::misc::cpuid(1, 0).ecx & CPUID_FEAT_X2APIC) != 0;
     if (!is_enabled) {
-        mem::vmm::mmap((void*)lapic_base, (void*)lapic_base, 1, PAGE_PRESENT | PAGE_RW);
-        mem::vmm::mmap((void*)ioapic_base, (void*)ioapic_base, 1, PAGE_PRESENT | PAGE_RW);
+        lapic_base = map_mmio((uint64_t)lapic_base);
     }
     return is_enabled;
 }
@@ -118,10 +145,10 @@ uint32_t apic_read_reg(cpu_unit* cpu, uint32_t reg) {
             uint32_t msr = 0x800 + (reg >> 4);
             return (uint32_t)arch::x86_64::misc::rdmsr(msr);
         } else {
-            return ((volatile uint8_t*)cpu->lapic_base)[reg >> 2];
+            return ((volatile uint32_t*)cpu->lapic_base)[reg >> 2];
         }
     } else {
-        return ((volatile uint8_t*)lapic_base)[reg >> 2];
+        return lapic_base[reg >> 2];
     }
 }
 
@@ -131,15 +158,16 @@ void apic_write_reg(cpu_unit* cpu, uint32_t reg, uint32_t value) {
             uint32_t msr = 0x800 + (reg >> 4);
             arch::x86_64::misc::wrmsr(msr, value);
         } else {
-            ((volatile uint8_t*)cpu->lapic_base)[reg >> 2] = value;
+            ((volatile uint32_t*)cpu->lapic_base)[reg >> 2] = value;
         }
     } else {
-        ((volatile uint8_t*)lapic_base)[reg >> 2] = value;
+        lapic_base[reg >> 2] = value;
     }
 }
 
 static void register_new_cpu_unit(madt_lapic_entry* lapic, uint32_t index) {
-    cpu_unit* new_unit = (cpu_unit*)mem::heap::malloc(sizeof(cpu_unit));
+    if (!cpu_unit_cache) cpu_unit_cache = mem::slab::create("cpu_unit", sizeof(cpu_unit), alignof(cpu_unit));
+    cpu_unit* new_unit = (cpu_unit*)mem::slab::alloc(cpu_unit_cache);
     
     new_unit->registry_id = index;
     new_unit->apic_id = lapic->apic_id;
@@ -150,6 +178,13 @@ static void register_new_cpu_unit(madt_lapic_entry* lapic, uint32_t index) {
     new_unit->kernel_stack = stack_manager_get_new_stack(2, false);
     new_unit->interrupt_stack = stack_manager_get_new_stack(2, false);
     new_unit->current_thread_id = 0;
+    new_unit->current_thread = nullptr;
+    new_unit->idle_thread = nullptr;
+    new_unit->prev_thread = nullptr;
+    new_unit->run_queue = nullptr;
+    new_unit->work_queue = nullptr;
+    new_unit->page_cache = nullptr;
+    new_unit->active_pml4 = is_bsp(lapic->apic_id) ? mem::vmm::get_cr3() : 0;
     new_unit->gdt_base = get_gdt_base();
     new_unit->idt_base = get_idt_base();
     new_unit->tss_base = get_tss_base();
@@ -158,6 +193,8 @@ static void register_new_cpu_unit(madt_lapic_entry* lapic, uint32_t index) {
     new_unit->read_reg = apic_read_reg;
     new_unit->write_reg = apic_write_reg;
     
+    if (new_unit->apic_id < 256) apic_id_map[new_unit->apic_id] = new_unit;
+
     if (registry->first_unit == nullptr) {
         registry->first_unit = new_unit;
         tail_unit = new_unit;
@@ -199,7 +236,7 @@ static void parse_madt_entries() {
             }
             case MADT_ENTRY_IOAPIC: {
                 madt_ioapic_entry* ioapic = (madt_ioapic_entry*)ptr;
-                ioapic_base = (volatile uint32_t*)(uintptr_t)ioapic->ioapic_addr;
+                ioapic_base = map_mmio(ioapic->ioapic_addr);
 #ifdef APIC_VERBOSE
                 printf("I/O APIC: ID=%02X, Address=0x%08X\n",
                        ioapic->ioapic_id, ioapic->ioapic_addr);
@@ -254,14 +291,18 @@ void initialise() {
 
     enabled = true;
 
+    /* the APs enable their LAPIC with the same spurious vector the firmware gave the BSP */
+    spurious_reg = apic_read_reg(nullptr, APIC_REG_SPURIOUS);
+
 	arch::x86_64::cpu::idt::set_descriptor(IPI_VECTOR, (uint64_t)ipi_handle, 0x8E);
+	arch::x86_64::cpu::idt::set_descriptor(TLB_SHOOTDOWN_VECTOR, (uint64_t)mem::vmm::tlb_shootdown_handler, 0x8E);
 }
 
 void cleanup() {
     cpu_unit* curr = registry->first_unit;
     while (curr != nullptr) {
         cpu_unit* next = curr->next_unit;
-        mem::heap::free(curr);
+        mem::slab::free(cpu_unit_cache, curr);
         curr = next;
     }
     mem::heap::free(registry);
@@ -292,8 +333,8 @@ static uint32_t get_local_apic_id() {
     }
 }
 
-cpu_unit* get_current_cpu() {
-    uint32_t apic_id = get_local_apic_id();
+static cpu_unit* unit_by_apic_id(uint32_t apic_id) {
+    if (apic_id < 256 && apic_id_map[apic_id]) return apic_id_map[apic_id];
 
     cpu_unit* curr = registry->first_unit;
     while (curr != nullptr) {
@@ -302,10 +343,18 @@ cpu_unit* get_current_cpu() {
         }
         curr = curr->next_unit;
     }
+    return nullptr;
+}
+
+cpu_unit* get_current_cpu() {
+    if (!registry) return nullptr;
+
+    uint32_t apic_id = get_local_apic_id();
+    cpu_unit* cpu = unit_by_apic_id(apic_id);
 #ifdef APIC_VERBOSE
-    printf("Didn't find a CPU with APIC ID %u\n", apic_id);
+    if (!cpu) printf("Didn't find a CPU with APIC ID %u\n", apic_id);
 #endif
-    return nullptr;
+    return cpu;
 }
 
 void* get_ioapic_base() {
@@ -316,13 +365,99 @@ cpu_registry* get_cpu_registry() {
 	return registry;
 }
 
-void wake_up_cpus() {
-	
+/* the rest of an AP's bring-up, on its own kernel stack */
+__attribute__((noreturn))
+static void ap_main(cpu_unit* cpu) {
+    /* before anything asks for the current CPU, in x2APIC mode that reads an MSR that needs it */
+    if (cpu->x2apic_enabled) enable_x2apic();
+
+    arch::x86_64::cpu::idt::load_idt();
+    cpu->idt_base = get_idt_base();
+
+    mem::vmm::initialise_ap();
+
+    if (!arch::x86_64::cpu::gdt::initialise_ap((uint64_t)cpu->interrupt_stack, &cpu->gdt_base, &cpu->tss_base)) {
+        Log::errf("APIC: CPU %u couldn't allocate its GDT", cpu->registry_id);
+        for (;;) asm volatile ("cli; hlt");
+    }
+
+    cpu->write_reg(cpu, APIC_REG_TPR, 0);
+    cpu->write_reg(cpu, APIC_REG_SPURIOUS, spurious_reg | APIC_SPURIOUS_ENABLE);
+    drivers::timers::apic::initialise_ap(cpu);
+
+    /* interrupts go on right away, TLB shootdowns from the CPUs already up have to get through */
+    __atomic_store_n(&cpu->online, true, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&aps_online, 1, __ATOMIC_RELEASE);
+    asm volatile ("sti");
+
+    while (!__atomic_load_n(&aps_released, __ATOMIC_ACQUIRE)) asm volatile ("pause");
+
+#ifdef CONFIG_HEAP_BENCHMARK
+    mem::heap::benchmark();
+#endif
+
+    proc::sched::initialise_ap();
+    proc::sched::idle();
+}
+
+/* where Limine lets an AP go, still on the bootloader's stack and page tables */
+static void ap_entry(limine_mp_info* info) {
+    cpu_unit* cpu = (cpu_unit*)info->extra_argument;
+    /* the kernel's tables before touching the unit, its stack only exists in those */
+    asm volatile (
+        "mov %0, %%cr3\n"
+        "mov %c1(%2), %%rsp\n"
+        "xor %%ebp, %%ebp\n"
+        "call *%3"
+        :
+        : "r"(ap_cr3), "i"(__builtin_offsetof(cpu_unit, kernel_stack)), "D"(cpu), "r"(ap_main)
+        : "memory"
+    );
+    __builtin_unreachable();
+}
+
+uint32_t wake_up_cpus() {
+    limine_mp_response* mp = mp_request.response;
+    if (!registry || !mp) return 1;
+
+    ap_cr3 = mem::vmm::va_to_pa(mem::vmm::fetch_default_pagetable());
+
+    uint32_t woken = 0;
+    for (uint64_t i = 0; i < mp->cpu_count; i++) {
+        limine_mp_info* info = mp->cpus[i];
+        if (info->lapic_id == mp->bsp_lapic_id) continue;
+
+        cpu_unit* cpu = unit_by_apic_id(info->lapic_id);
+        if (!cpu || cpu->online) continue;
+
+        info->extra_argument = (uint64_t)cpu;
+        __atomic_store_n(&info->goto_address, &ap_entry, __ATOMIC_RELEASE);
+        woken++;
+    }
+
+    uint64_t start = arch::x86_64::misc::rdtsc();
+    while (__atomic_load_n(&aps_online, __ATOMIC_ACQUIRE) < woken) {
+        if (arch::x86_64::misc::rdtsc() - start > AP_TIMEOUT_CYCLES) {
+            Log::warnf("APIC: Only %u of %u APs came online", aps_online, woken);
+            break;
+        }
+        asm volatile ("pause");
+    }
+
+    /* the APs wait for this so that they all see the same set of online CPUs */
+    __atomic_store_n(&aps_released, true, __ATOMIC_RELEASE);
+    return __atomic_load_n(&aps_online, __ATOMIC_ACQUIRE) + 1;
 }
 
 void ipi_send(cpu_unit* unit, uint8_t vector) {
     if (!unit) return;
 
+    /* x2APIC has one 64 bit ICR with the destination in the top half and no delivery status */
+    if (unit->x2apic_enabled) {
+        arch::x86_64::misc::wrmsr(0x800 + (APIC_REG_ICR_LOW >> 4), ((uint64_t)unit->apic_id << 32) | vector | (1 << 14));
+        return;
+    }
+
     while (unit->read_reg(unit, APIC_REG_ICR_LOW) & (1 << 12))
         ;
 
@@ -340,7 +475,7 @@ void ipi_send(cpu_unit* unit, uint8_t vector) {
 
 __attribute__((interrupt))
 void ipi_handle(void*) {
-#ifndef APIC_VERBOSE
+#ifdef APIC_VERBOSE
 	printf("got an IPI\n\r");
 #endif
 
@@ -359,12 +494,15 @@ void apic_send_eoi() {
 
 namespace drivers::timers::apic {
 
+static uint32_t timer_ticks_1ms = 0;
+
 uint64_t calibrate_pit() {
 	arch::x86_64::apic::bsp->write_reg(arch::x86_64::apic::bsp, APIC_REG_TIMER_INITIAL, 0xFFFFFFFF);
 	drivers::timers::pit::sleep_ms(1);
 	arch::x86_64::apic::bsp->write_reg(arch::x86_64::apic::bsp, APIC_REG_LVT_TIMER, APIC_LVT_INT_MASKED);
 
 	uint32_t ticks_in_1ms = 0xFFFFFFFF - arch::x86_64::apic::bsp->read_reg(arch::x86_64::apic::bsp, APIC_REG_TIMER_CURRENT);
+	timer_ticks_1ms = ticks_in_1ms;
 
 	drivers::timers::pit::disable();
 
@@ -387,4 +525,11 @@ void initialise() {
 	give_timer_ticks(calibrate_pit());
 }
 
+/* the LAPIC timers all run off the same bus clock, so the BSP's calibration holds for every AP */
+void initialise_ap(cpu_unit* cpu) {
+	cpu->write_reg(cpu, APIC_REG_TIMER_DIVIDE, 0x3);
+	cpu->write_reg(cpu, APIC_REG_LVT_TIMER, TIMER_VECTOR | APIC_LVT_TIMER_MODE_PERIODIC);
+	cpu->write_reg(cpu, APIC_REG_TIMER_INITIAL, timer_ticks_1ms);
+}
+
 }
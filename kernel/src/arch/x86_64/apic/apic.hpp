@@ -3,6 +3,14 @@
 
 #include <cstdint>
 
+struct pmm_cpu_cache;
+struct Thread;
+struct sched_queue;
+struct workqueue;
+
+#define TLB_SHOOTDOWN_VECTOR 0xF2
+#define SCHED_YIELD_VECTOR 0xF3
+
 struct cpu_unit {
 	uint32_t registry_id;
 
@@ -20,6 +28,14 @@ struct cpu_unit {
     void* interrupt_stack;
     
     uint32_t current_thread_id;
+    Thread* current_thread;
+    Thread* idle_thread;
+    Thread* prev_thread; /* switched away from, still on its stack until the switch finishes */
+    sched_queue* run_queue;
+    workqueue* work_queue;
+
+    pmm_cpu_cache* page_cache;
+    uint64_t active_pml4;
     
     void* gdt_base;
     void* idt_base;
@@ -43,6 +59,11 @@ cpu_unit* get_cpu(uint32_t index);
 cpu_unit* get_current_cpu();
 cpu_unit* get_bsp();
 
+void ipi_send(cpu_unit* unit, uint8_t vector);
+
+// starts every AP Limine found and waits for them to come online, returns how many CPUs are up counting the BSP
+uint32_t wake_up_cpus();
+
 void* get_ioapic_base();
 
 }
@@ -67,6 +88,8 @@ void init_cores();
 namespace drivers::timers::apic {
 
 void initialise();
+// starts the calling AP's timer at the rate the BSP's was calibrated to
+void initialise_ap(cpu_unit* cpu);
 
 }
 
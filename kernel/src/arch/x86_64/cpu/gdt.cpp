@@ -1,5 +1,7 @@
 #include <arch/arch.hpp>
 #include <arch/x86_64/cpu/gdt.hpp>
+#include <mem/mem.hpp>
+#include <arch/x86_64/apic/apic.hpp>
 
 uint64_t _tss_rsp, _tss_rbp;
 
@@ -27,6 +29,20 @@ void load_tss() {
     tss_load();
 }
 
+static void set_tss_descriptor(gdt_t* g, tss_t* t) {
+    uint64_t base = (uint64_t)t;
+    uint16_t limit = sizeof(tss_t) - 1;
+
+    g->tss.limit_low = limit & 0xFFFF;
+    g->tss.base_low = base & 0xFFFF;
+    g->tss.base_middle1 = (base >> 16) & 0xFF;
+    g->tss.access = 0x89;
+    g->tss.granularity = 0x00;
+    g->tss.base_middle2 = (base >> 24) & 0xFF;
+    g->tss.base_high = (base >> 32) & 0xFFFFFFFF;
+    g->tss.reserved = 0;
+}
+
 void initialise() {
     gdt = default_gdt;
 
@@ -34,17 +50,7 @@ void initialise() {
     tss.ist1 = (uint64_t)(kernel_stack + sizeof(kernel_stack));
     tss.iopb_offset = sizeof(tss_t);
 
-    uint64_t base = (uint64_t)&tss;
-    uint16_t limit = sizeof(tss_t) - 1;
-
-    gdt.tss.limit_low = limit & 0xFFFF;
-    gdt.tss.base_low = base & 0xFFFF;
-    gdt.tss.base_middle1 = (base >> 16) & 0xFF;
-    gdt.tss.access = 0x89;
-    gdt.tss.granularity = 0x00;
-    gdt.tss.base_middle2 = (base >> 24) & 0xFF;
-    gdt.tss.base_high = (base >> 32) & 0xFFFFFFFF;
-    gdt.tss.reserved = 0;
+    set_tss_descriptor(&gdt, &tss);
 
     gdtr.limit = sizeof(gdt) - 1;
     gdtr.base  = (uint64_t)&gdt;
@@ -56,13 +62,52 @@ void initialise() {
     _tss_rbp = tss.rsp0;
 }
 
+bool initialise_ap(uint64_t stack_top, void** gdt_base, void** tss_base) {
+    /* a TSS descriptor goes busy once it's loaded, so every CPU needs its own GDT as well as its own TSS */
+    gdt_t* ap_gdt = (gdt_t*)mem::heap::malloc_aligned(sizeof(gdt_t), 16);
+    tss_t* ap_tss = (tss_t*)mem::heap::malloc_aligned(sizeof(tss_t), 16);
+    if (!ap_gdt || !ap_tss) {
+        mem::heap::free(ap_gdt);
+        mem::heap::free(ap_tss);
+        return false;
+    }
+
+    *ap_gdt = default_gdt;
+    mem::memset(ap_tss, 0, sizeof(tss_t));
+    ap_tss->rsp0 = ap_tss->ist1 = stack_top;
+    ap_tss->iopb_offset = sizeof(tss_t);
+    set_tss_descriptor(ap_gdt, ap_tss);
+
+    gdtr_t ap_gdtr;
+    ap_gdtr.limit = sizeof(gdt_t) - 1;
+    ap_gdtr.base = (uint64_t)ap_gdt;
+
+    gdt_load(&ap_gdtr);
+    tss_load();
+
+    *gdt_base = ap_gdt;
+    *tss_base = ap_tss;
+    return true;
+}
+
+/* the BSP's TSS is the static one until the CPUs are registered */
+static tss_t* current_tss() {
+	cpu_unit* cpu = arch::x86_64::apic::get_current_cpu();
+	return cpu && cpu->tss_base ? (tss_t*)cpu->tss_base : &tss;
+}
+
 void update_stack(uint64_t new_rsp) {
 	uint64_t rsp = new_rsp;
 	if (new_rsp == 0) {
 		asm volatile ("mov %%rsp, %0" : "=r"(rsp));
 	}
 
-	tss.rsp0 = tss.ist1 = rsp;
+	/* IST1 stays where it is, an IRQ on it mustn't land on top of a preempted thread's frame */
+	current_tss()->rsp0 = rsp;
+}
+
+uint64_t get_stack() {
+	return current_tss()->rsp0;
 }
 
 void* get_base() {
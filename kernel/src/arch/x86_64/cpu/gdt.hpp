@@ -64,7 +64,12 @@ void initialise();
 void load_gdt();
 void load_tss();
 
+// gives the calling AP its own GDT and a TSS with rsp0 and ist1 at stack_top, then loads both
+bool initialise_ap(uint64_t stack_top, void** gdt_base, void** tss_base);
+
+// sets rsp0 in the calling CPU's TSS, where interrupts from ring 3 put their frame
 void update_stack(uint64_t new_rsp);
+uint64_t get_stack();
 
 void* get_base();
 void* get_tss_base();
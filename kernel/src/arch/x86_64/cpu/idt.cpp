@@ -5,6 +5,7 @@
 #include <dbg/dbg.hpp>
 #include <config.hpp>
 #include <arch/x86_64/apic/apic.hpp>
+#include <proc/vma.hpp>
 
 bool idt_set_vectors[256] = {false};
 
@@ -68,16 +69,9 @@ void fix_exceptions(
 				Log::infof("Page fault caused by protection violation");
 				asm volatile ("cli;hlt;");
 			} else {
-				Log::infof("Page fault caused by non-present page");
-				mem::vmm::mmap(
-					(void*)(cr2 & ~0xFFF),
-					(void*)(cr2 & ~0xFFF),
-					1,
-					PAGE_PRESENT |
-					PAGE_RW |
-					PAGE_USER
-				);
-				Log::infof("Mapped page for address 0x%llX", cr2);
+				/* proc::handle_page_fault already had its chance, nothing reserved this address */
+				Log::errf("Page fault caused by non-present page outside any reserved area");
+				asm volatile ("cli;hlt;");
 			}
 
 			break;
@@ -197,6 +191,12 @@ void debugger_event_handler(key_event& ev, exception_frame* frame) {
 			clr();
 			dbg::stacktrace::stacktrace(frame->rip, 5, 0);
 			break;
+#ifdef CONFIG_HEAP_PROFILER
+		case KEY_F5:
+			clr();
+			mem::heap::profile_dump();
+			break;
+#endif
 		default:
 			clr();
 			dbg::disasm::disasm_at_memory(frame->rip, 100, 0);
@@ -217,6 +217,16 @@ void debugger(exception_frame* frame) {
 uint64_t nesting_table[31] = {0};
 
 extern "C" void exception_handler(exception_frame* frame) {
+	/* demand paging, a fault inside one of the current process' areas just gets a page */
+	if (frame->exception_vector == 14) {
+		uint64_t fault_addr;
+		asm volatile("mov %%cr2, %0" : "=r"(fault_addr));
+		if (proc::handle_page_fault(fault_addr, frame->error_code)) return;
+#ifdef CONFIG_VMA_SELFTEST
+		if (proc::probe_fixup(&frame->rip)) return;
+#endif
+	}
+
     asm volatile("mov %%cr0, %0" : "=r"(cr0));
     asm volatile("mov %%cr2, %0" : "=r"(cr2));
     asm volatile("mov %%cr3, %0" : "=r"(cr3));
@@ -391,11 +401,11 @@ void initialise() {
 	load_idt();
 }	
 
-void set_descriptor(uint8_t vector, uint64_t isr, uint8_t flags) {
+void set_descriptor(uint8_t vector, uint64_t isr, uint8_t flags, uint8_t ist) {
 	idt_entry_t *e = &idt.entries[vector];
 	e->isr_offset_low = (isr & 0xFFFF);
 	e->gdt_selector = 0x08;
-	e->ist = 1;
+	e->ist = ist;
 	e->flags = flags;
 	e->isr_offset_middle = (isr >> 16) & 0xFFFF;
 	e->isr_offset_high = (isr >> 32) & 0xFFFFFFFF;
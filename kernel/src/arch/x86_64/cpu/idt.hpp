@@ -43,7 +43,8 @@ namespace arch::x86_64::cpu::idt {
 
 void load_idt();
 void initialise();
-void set_descriptor(uint8_t vector, uint64_t isr, uint8_t flags);
+// ist 0 keeps the interrupted stack so the scheduler can leave a frame on it, arch.hpp gives the default of 1
+void set_descriptor(uint8_t vector, uint64_t isr, uint8_t flags, uint8_t ist);
 void clear_descriptor(uint8_t vector);
 
 void irq_clear_mask(uint8_t irq);
@@ -1,5 +1,8 @@
 #include <arch/arch.hpp>
+#include <proc/sched.hpp>
 
 extern "C" void exec_ring3_helper(uint64_t rsp) {
-	arch::x86_64::cpu::gdt::update_stack(rsp);
+	/* execve runs on the user stack, a thread with a kernel stack of its own keeps taking interrupts there */
+	Thread* t = proc::sched::current();
+	arch::x86_64::cpu::gdt::update_stack(t && t->stack_top ? (uint64_t)t->stack_top : rsp);
 }
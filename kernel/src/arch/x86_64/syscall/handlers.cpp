@@ -62,7 +62,7 @@ uint64_t handle_syscall(uint64_t rax, uint64_t rdi, uint64_t rsi,
 
     uint8_t argc = syscall_table.entry[rax].num_args;
 
-    return call_syscall(argc, rax, rdi, rsi, rdx, r10, r9, r8);
+    return call_syscall(argc, rax, rdi, rsi, rdx, r10, r8, r9);
 }
 
 void register_syscall(uint64_t vector, void* handler, uint64_t num_args,
@@ -5,6 +5,25 @@
 #include <types.hpp>
 #include <cstdint>
 
+/* what syscall_func pushes on the caller's stack, lowest address first */
+struct syscall_regs {
+    uint64_t r15;
+    uint64_t r14;
+    uint64_t r13;
+    uint64_t r12;
+    uint64_t rbp;
+    uint64_t rbx;
+    uint64_t r9;
+    uint64_t r8;
+    uint64_t r10;
+    uint64_t rdx;
+    uint64_t rsi;
+    uint64_t rdi;
+    uint64_t rax;
+    uint64_t r11; /* the caller's rflags */
+    uint64_t rcx; /* the caller's rip, its rsp is right above this */
+};
+
 struct syscall_entry {
     int num;
     uint64_t* func;
@@ -16,7 +16,7 @@ volatile limine_executable_file_request executable_file_request = {
 	.response = nullptr // shut up gcc
 };
 
-const char* find_symbol(uint64_t addr, uint64_t* offset = nullptr) {
+const char* find_symbol(uint64_t addr, uint64_t* offset) {
     limine_file* exe = executable_file_request.response->executable_file;
     if (!exe) {
         return "??";
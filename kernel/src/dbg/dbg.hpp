@@ -5,6 +5,9 @@
 #include <mem/mem.hpp>
 #include <drivers/tty/ldisc/ldisc.hpp>
 
+// the function addr falls in, from the kernel's own symbol table, "??" if there's none
+const char* find_symbol(uint64_t addr, uint64_t* offset = nullptr);
+
 namespace dbg {
 
 namespace memview {
@@ -7,6 +7,7 @@
 #include "ps2k_scancode_map.hpp"
 #include <errno.hpp>
 #include <drivers/timers/pit/pit.hpp>
+#include <proc/workqueue.hpp>
 #include <types.hpp>
 
 namespace drivers::input::ps2k {
@@ -117,24 +118,26 @@ enum class scan_state {
 
 static scan_state current_scan_state = scan_state::NORMAL;
 
-__attribute__((interrupt))
-static void ps2k_interrupt_handler(void*) {
-	if (!(arch::x86_64::io::inb(PS2_STATUS_PORT) & 0x01)) {
-		arch::x86_64::cpu::idt::send_eoi(1);
-		return;
-	}
+/* scancodes the interrupt handler took off the controller, decoded later on a worker */
+#define SCANCODE_RING_SIZE 64
 
-    uint8_t scancode = arch::x86_64::io::inb(PS2_DATA_PORT);
-    
+struct raw_scancode {
+    uint8_t scancode;
+    uint64_t timestamp;
+};
+
+static raw_scancode scancode_ring[SCANCODE_RING_SIZE];
+static volatile uint32_t scancode_head = 0;
+static volatile uint32_t scancode_tail = 0;
+
+static void decode_scancode(uint8_t scancode, uint64_t timestamp) {
     if (scancode == 0xE0) {
         current_scan_state = scan_state::EXTENDED_E0;
-        arch::x86_64::cpu::idt::send_eoi(1);
         return;
     }
     
     if (scancode == 0xE1) {
         current_scan_state = scan_state::EXTENDED_E1;
-        arch::x86_64::cpu::idt::send_eoi(1);
         return;
     }
     
@@ -147,17 +150,24 @@ static void ps2k_interrupt_handler(void*) {
         current_scan_state = scan_state::NORMAL;
     } else if (current_scan_state == scan_state::EXTENDED_E1) {
         current_scan_state = scan_state::NORMAL;
-        arch::x86_64::cpu::idt::send_eoi(1);
         return;
     } else {
         kc = scancode_to_keycode[scancode];
     }
     
+#ifdef CONFIG_HEAP_PROFILER
+    /* this runs on a worker, so the dump can take as long as it likes */
+    if (kc == KEY_F12) {
+        if (pressed) mem::heap::profile_dump();
+        return;
+    }
+#endif
+
     if (kc != KEY_NONE) {
         key_event ev;
         ev.keycode = kc;
         ev.state = pressed ? key_state::PRESSED : key_state::RELEASED;
-        ev.timestamp = drivers::timers::pit::ns_elapsed_time();
+        ev.timestamp = timestamp;
         
         buffer_push(evbuf, ev);
         
@@ -166,8 +176,39 @@ static void ps2k_interrupt_handler(void*) {
                kc, pressed ? "PRESSED" : "RELEASED");
 #endif
     }
-    
+}
+
+/* the callback echoes to the terminal, far too slow for an interrupt handler */
+static void ps2k_drain(void*) {
+    uint32_t head = __atomic_load_n(&scancode_head, __ATOMIC_RELAXED);
+    while (head != __atomic_load_n(&scancode_tail, __ATOMIC_ACQUIRE)) {
+        raw_scancode raw = scancode_ring[head % SCANCODE_RING_SIZE];
+        head++;
+        __atomic_store_n(&scancode_head, head, __ATOMIC_RELEASE);
+        decode_scancode(raw.scancode, raw.timestamp);
+    }
+}
+
+static work_item ps2k_work = {ps2k_drain, nullptr, nullptr, false};
+
+__attribute__((interrupt))
+static void ps2k_interrupt_handler(void*) {
+	if (!(arch::x86_64::io::inb(PS2_STATUS_PORT) & 0x01)) {
+		arch::x86_64::cpu::idt::send_eoi(1);
+		return;
+	}
+
+    uint8_t scancode = arch::x86_64::io::inb(PS2_DATA_PORT);
+
+    /* a full ring drops the newest, the worker is far behind already */
+    uint32_t tail = scancode_tail;
+    if (tail - __atomic_load_n(&scancode_head, __ATOMIC_ACQUIRE) < SCANCODE_RING_SIZE) {
+        scancode_ring[tail % SCANCODE_RING_SIZE] = {scancode, drivers::timers::pit::ns_elapsed_time()};
+        __atomic_store_n(&scancode_tail, tail + 1, __ATOMIC_RELEASE);
+    }
+
     arch::x86_64::cpu::idt::send_eoi(1);
+    proc::work::schedule(&ps2k_work);
 }
 
 void user_ps2k_poll() {
@@ -1,5 +1,6 @@
 #include "ps2m.hpp"
 #include <arch/arch.hpp>
+#include <proc/workqueue.hpp>
 #include <cstdio>
 #include <lib/Flanterm/gfx.h>
 
@@ -44,19 +45,41 @@ uint8_t mouse_read() {
 }
 
 uint8_t mouse_cycle = 0;
-uint8_t mouse_packet[4];
-bool mouse_packet_ready = false;
+uint8_t mouse_bytes[3];
 struct {
     int x, y;
 } mouse_pos, mouse_pos_old;
 
-void process_mouse();
+/* whole packets the interrupt handler assembled, decoded later on a worker */
+#define PACKET_RING_SIZE 64
+
+struct raw_packet {
+    uint8_t bytes[3];
+};
+
+static raw_packet packet_ring[PACKET_RING_SIZE];
+static volatile uint32_t packet_head = 0;
+static volatile uint32_t packet_tail = 0;
+
+void process_mouse(raw_packet packet);
+
+static void mouse_work_fn(void*) {
+    uint32_t head = __atomic_load_n(&packet_head, __ATOMIC_RELAXED);
+    while (head != __atomic_load_n(&packet_tail, __ATOMIC_ACQUIRE)) {
+        raw_packet packet = packet_ring[head % PACKET_RING_SIZE];
+        head++;
+        __atomic_store_n(&packet_head, head, __ATOMIC_RELEASE);
+        process_mouse(packet);
+    }
+}
+
+/* redrawing the pointer is far too slow for an interrupt handler */
+static work_item mouse_work = {mouse_work_fn, nullptr, nullptr, false};
 
 __attribute__((interrupt, hot))
 void ps2m_interrupt_handler(void*) {
     uint8_t data = arch::x86_64::io::inb(0x60);
 
-    process_mouse();
     static bool skip = true;
     if (skip) { skip = false; goto end; }
 
@@ -64,19 +87,26 @@ void ps2m_interrupt_handler(void*) {
         case 0:
            
             if ((data & 0b00001000) == 0) break;
-            mouse_packet[0] = data;
+            mouse_bytes[0] = data;
             mouse_cycle++;
             break;
         case 1:
            
-            mouse_packet[1] = data;
+            mouse_bytes[1] = data;
             mouse_cycle++;
             break;
         case 2:
             
-            mouse_packet[2] = data;
-            mouse_packet_ready = true;
+            /* only whole packets reach the worker, a full ring drops the newest */
             mouse_cycle = 0;
+            {
+                uint32_t tail = packet_tail;
+                if (tail - __atomic_load_n(&packet_head, __ATOMIC_ACQUIRE) < PACKET_RING_SIZE) {
+                    packet_ring[tail % PACKET_RING_SIZE] = {{mouse_bytes[0], mouse_bytes[1], data}};
+                    __atomic_store_n(&packet_tail, tail + 1, __ATOMIC_RELEASE);
+                }
+            }
+            proc::work::schedule(&mouse_work);
             break;
     }
 
@@ -85,9 +115,8 @@ end:
     arch::x86_64::cpu::idt::send_eoi(12);
 }
 
-void process_mouse() {
-    if (!mouse_packet_ready) return;
-
+void process_mouse(raw_packet packet) {
+    uint8_t* mouse_packet = packet.bytes;
     bool xNegative, yNegative, xOverflow, yOverflow;
 
     if (mouse_packet[0] & PS2XSign) {
@@ -141,7 +170,6 @@ void process_mouse() {
     
     draw_mouse_pointer(mouse_pos_old.x, mouse_pos_old.y, mouse_pos.x, mouse_pos.y, mouse_packet[0] & PS2Leftbutton, mouse_packet[0] & PS2Middlebutton, mouse_packet[0] & PS2Rightbutton);
 
-    mouse_packet_ready = false;
     mouse_pos_old = mouse_pos;
 }
             
@@ -1,17 +1,29 @@
 #include "apic.hpp"
 #include <arch/arch.hpp>
+#include <proc/sched.hpp>
+#include <proc/waitqueue.hpp>
 
 uint64_t ticks = 0;
 
-__attribute__((interrupt))
-void apic_interrupt_handler(void*) {
-	ticks++;
+extern "C" void apic_timer_interrupt_handler();
+
+/* called from inthandler.asm, returns the frame of the thread to switch to or 0 to resume this one */
+extern "C" uint64_t apic_c_timer_interrupt_handler(ThreadContext* context) {
+	// every CPU's timer lands here, only the BSP's keeps time but each times out its own sleepers
+	cpu_unit* cpu = arch::x86_64::apic::get_current_cpu();
+	if (cpu == nullptr || cpu->is_bsp) {
+		ticks++;
+		proc::wait::clock_tick(ticks);
+	}
+	proc::wait::timer_tick(cpu);
 
 	arch::x86_64::cpu::idt::send_eoi(0);
+	return proc::sched::timer_tick(cpu, context);
 }
 
 void initialise_timer() {
-	arch::x86_64::cpu::idt::set_descriptor(0xF1, (uint64_t)apic_interrupt_handler, 0x8E);
+	// no IST, a preempted thread's frame has to stay on its own stack
+	arch::x86_64::cpu::idt::set_descriptor(0xF1, (uint64_t)apic_timer_interrupt_handler, 0x8E, 0);
 	arch::x86_64::cpu::idt::send_eoi(0);
 }
 
@@ -22,9 +34,7 @@ void give_timer_ticks(uint64_t taken_ticks) {
 namespace drivers::timers::apic {
 
 void sleep_ms(uint64_t ms) {
-	uint64_t curr = ticks;
-	uint64_t target = curr + ms;
-	while (ticks < target);
+	proc::wait::sleep_ms(ms);
 }
 
 uint64_t ns_elapsed_time() {
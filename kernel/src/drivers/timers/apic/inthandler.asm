@@ -1,14 +1,21 @@
 bits 64
 section .text
 global apic_timer_interrupt_handler
+global sched_yield_interrupt_handler
 extern apic_c_timer_interrupt_handler
+extern sched_c_yield_handler
+extern sched_c_finish_switch
 
-apic_timer_interrupt_handler:
+; both entries push the same frame, so a thread preempted by the timer can
+; be resumed from a yield and the other way round, see proc/sched.hpp
+%macro push_frame 0
     push rsp
     push rax
     push rbx
     push rcx
     push rdx
+    push rsi
+    push rdi
     push r8
     push r9
     push r10
@@ -20,16 +27,36 @@ apic_timer_interrupt_handler:
     mov rax, cr3
     push rax
     push rbp
+%endmacro
+
+apic_timer_interrupt_handler:
+    push_frame
 
     mov rdi, rsp
     call apic_c_timer_interrupt_handler
+    jmp frame_return
+
+sched_yield_interrupt_handler:
+    push_frame
+
+    mov rdi, rsp
+    call sched_c_yield_handler
+
+frame_return:
     test rax, rax
     je .no_reset_rsp
     mov rsp, rax
+    ; on the new stack now, the old thread can be let go of
+    call sched_c_finish_switch
 .no_reset_rsp:
     pop rbp
     pop rax
+    ; rewriting the same CR3 would throw away this PCID's TLB entries
+    mov rbx, cr3
+    cmp rax, rbx
+    je .same_cr3
     mov cr3, rax
+.same_cr3:
 
     pop r15
     pop r14
@@ -39,6 +66,8 @@ apic_timer_interrupt_handler:
     pop r10
     pop r9
     pop r8
+    pop rdi
+    pop rsi
     pop rdx
     pop rcx
     pop rbx
@@ -3,6 +3,7 @@
 #include <drivers/input/ps2k/ps2k.hpp>
 #include <drivers/input/ps2k/ps2k_key_event.hpp>
 #include <drivers/input/ps2k/ps2k_keycodes.hpp>
+#include <proc/waitqueue.hpp>
 #include <cstdio>
 
 enum line_discipline_mode : int {
@@ -53,6 +54,10 @@ size_t read_buf_size;
 size_t read_n = 0;
 bool reading = false;
 bool echo = false;
+bool claimed = false; /* a reader owns the buffer from set() until it has taken its count */
+
+wait_queue line_done;  /* the reader, until a newline ends its line */
+wait_queue readers;    /* everyone else who wants to read */
 
 void reset();
 
@@ -75,10 +80,12 @@ void reset() {
 	read_buf = 0;
 	read_buf_size = 0;
 	echo = false;
+	proc::wait::wake_all(&line_done);
 }
 
 void set(bool __echo, char* __read_buf, size_t __read_buf_size) {
-	while (reading); /* prevent it from reading while another procedure is reading */
+	/* one reader at a time, the rest sleep until it's done */
+	proc::wait::wait_until(&readers, [] { return !__atomic_exchange_n(&claimed, true, __ATOMIC_ACQUIRE); }, WAIT_FOREVER);
 	read_buf = __read_buf;
 	read_buf_size = __read_buf_size;
 	read_n = 0;
@@ -142,10 +149,12 @@ ssize_t builtin_ldisc_read(bool echo, void* buf, size_t n) {
 
     set(echo, (char*)buf, n);
 
-    while (!read_done());
+    proc::wait::wait_until(&line_done, [] { return read_done(); }, WAIT_FOREVER);
 
     size_t count = read_count();
     reset();
+    __atomic_store_n(&claimed, false, __ATOMIC_RELEASE);
+    proc::wait::wake_one(&readers);
     return count;
 }
 
@@ -167,6 +176,8 @@ uint16_t builtin_num_to_fn_key(int num) {
 namespace drivers::tty::ldisc {
 
 void initialise() {
+	proc::wait::initialise(&line_done, "LDISC_LINE");
+	proc::wait::initialise(&readers, "LDISC_READERS");
 	drivers::input::ps2k::set_event_callback((event_callback_fn)ldisc_ps2k_event_handler, nullptr);
 }
 
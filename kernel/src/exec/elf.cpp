@@ -4,6 +4,7 @@
 #include <cstring>
 #include <mem/vmm.hpp>
 #include <mem/pmm.hpp>
+#include <mem/slab.hpp>
 #include <arch/arch.hpp>
 #include <cstdio>
 
@@ -53,6 +54,10 @@ static inline uint64_t convert_flags_to_page_flags(uint32_t elf_flags, bool user
         flags |= PAGE_RW;
     }
     
+    if (!(elf_flags & PF_X)) {
+        flags |= PAGE_NX;
+    }
+    
     if (user_mode) {
         flags |= PAGE_USER;
     }
@@ -118,15 +123,12 @@ static bool map_segment_pages(uint64_t segment_base, size_t segment_size, uint64
     for (size_t i = 0; i < num_pages; i++) {
         void* virtual_addr = reinterpret_cast<void*>(page_start + i * PAGE_SIZE);
         
-        void* physical_page = mem::pmm::palloc(1);
+        void* physical_page = mem::pmm::palloc_zeroed(1);
         if (!physical_page) {
             Log::errf("Failed to allocate physical memory for segment");
             return false;
         }
         
-        uint64_t phys_as_va = mem::vmm::pa_to_va(reinterpret_cast<uint64_t>(physical_page));
-        mem::memset(reinterpret_cast<void*>(phys_as_va), 0, PAGE_SIZE);
-        
         uint64_t result = mem::vmm::mmap(physical_page, virtual_addr, 1, page_flags);
         if (result == 0) {
             Log::errf("Failed to map page at virtual address %p", virtual_addr);
@@ -144,7 +146,8 @@ static bool load_elf_segment(const Elf64_Phdr* phdr, uint64_t load_base,
                             ? load_base + phdr->p_vaddr 
                             : phdr->p_vaddr;
     
-    uint64_t page_flags = convert_flags_to_page_flags(phdr->p_flags, user_mode);
+    // writable until protect_segments, the copy below and relocations still have to land
+    uint64_t page_flags = convert_flags_to_page_flags(phdr->p_flags, user_mode) | PAGE_RW;
     
     if (!map_segment_pages(segment_vaddr, phdr->p_memsz, page_flags)) {
         Log::errf("Failed to map segment pages");
@@ -166,7 +169,26 @@ static bool load_elf_segment(const Elf64_Phdr* phdr, uint64_t load_base,
     return true;
 }
 
+// remaps every loaded segment with the permissions its program header asks for
+static void protect_segments(uint64_t load_base, const Elf64_Phdr* phdrs, uint16_t phnum, bool user_mode) {
+    for (uint16_t i = 0; i < phnum; i++) {
+        if (phdrs[i].p_type != PT_LOAD) continue;
+
+        uint64_t segment_vaddr = load_base + phdrs[i].p_vaddr;
+        uint64_t page_flags = convert_flags_to_page_flags(phdrs[i].p_flags, user_mode);
+        uint64_t page_start = align_down(segment_vaddr, PAGE_SIZE);
+        uint64_t page_end = align_up(segment_vaddr + phdrs[i].p_memsz, PAGE_SIZE);
+
+        for (uint64_t va = page_start; va < page_end; va += PAGE_SIZE) {
+            uint64_t phys = mem::vmm::translate(reinterpret_cast<void*>(va));
+            if (phys) mem::vmm::mmap(reinterpret_cast<void*>(phys), reinterpret_cast<void*>(va), 1, page_flags);
+        }
+    }
+}
+
 constexpr uint64_t STACK_START = 0x7FFFFFFF0000ULL;
+// kernel stacks have to be reachable from every process' page table, so they live in the shared kernel half
+constexpr uint64_t KERNEL_STACK_START = 0xFFFFE00000000000ULL;
 
 struct stack_entry {
     void* bottom;
@@ -183,7 +205,10 @@ struct stack_table {
     stack_entry* first_stack;
     stack_entry* free_stacks;
     uint64_t current_top;
-} stable = {0, nullptr, nullptr, STACK_START};
+    uint64_t kernel_top;
+} stable = {0, nullptr, nullptr, STACK_START, KERNEL_STACK_START};
+
+static mem::slab::cache* stack_entry_cache = nullptr;
 
 stack_entry* allocate_stack_entry(size_t num_pages, bool user) {
     stack_entry* e = nullptr;
@@ -201,34 +226,40 @@ stack_entry* allocate_stack_entry(size_t num_pages, bool user) {
     }
 
     if (!e) {
-        e = (stack_entry*)mem::heap::malloc(sizeof(stack_entry));
+        if (!stack_entry_cache) stack_entry_cache = mem::slab::create("stack_entry", sizeof(stack_entry));
+        e = stack_entry_cache ? (stack_entry*)mem::slab::alloc(stack_entry_cache) : nullptr;
         if (!e) return nullptr;
-        e->npages = num_pages;
-        e->nbytes = num_pages * PAGE_SIZE;
-        e->user = true;
     }
 
+    e->npages = num_pages;
+    e->nbytes = num_pages * PAGE_SIZE;
+    e->user = user;
+
     e->next = nullptr;
     e->free_next = nullptr;
 
-    uint64_t top = stable.current_top;
+    uint64_t& next_top = user ? stable.current_top : stable.kernel_top;
+    uint64_t top = next_top;
     uint64_t bottom = top - num_pages * PAGE_SIZE;
 
-    for (size_t i = 0; i < num_pages; i++) {
-        void* phys = mem::pmm::palloc(1);
+    // user stacks only get their top page now, the owner faults the rest in on demand
+    size_t eager_pages = user ? 1 : num_pages;
+    uint64_t flags = PAGE_PRESENT | PAGE_RW | PAGE_NX;
+    if (user) flags |= PAGE_USER;
+    for (size_t i = num_pages - eager_pages; i < num_pages; i++) {
+        void* phys = mem::pmm::palloc_zeroed(1);
         if (!phys) {
-            if (!curr) mem::heap::free(e);
+            if (!curr) mem::slab::free(stack_entry_cache, e);
             return nullptr;
         }
         void* va = reinterpret_cast<void*>(bottom + i * PAGE_SIZE);
-        mem::vmm::mmap(phys, va, 1, PAGE_PRESENT | PAGE_RW | (user ? PAGE_USER : 0));
-        mem::memset(va, 0, PAGE_SIZE);
+        mem::vmm::mmap(phys, va, 1, flags);
     }
 
     e->bottom = reinterpret_cast<void*>(bottom);
     e->top = reinterpret_cast<void*>(top);
 
-    stable.current_top = bottom;
+    next_top = bottom;
 
     if (!stable.first_stack) stable.first_stack = e;
     else {
@@ -252,11 +283,8 @@ bool destroy_stack(void* stack_top) {
 
     while (curr) {
         if (curr->top == stack_top) {
-            for (size_t i = 0; i < curr->npages; i++) {
-                void* va = reinterpret_cast<void*>(reinterpret_cast<uint64_t>(curr->bottom) + i * PAGE_SIZE);
-                uint64_t pa = mem::vmm::va_to_pa((uint64_t)va);
-                mem::vmm::munmap(va, 1);
-            }
+            // gives the frames back too, pages that were never touched are skipped
+            mem::vmm::munmap_anonymous(curr->bottom, curr->npages);
 
             if (prev) prev->next = curr->next;
             else stable.first_stack = curr->next;
@@ -308,6 +336,7 @@ void run_elf(void* elf_base, size_t elf_file_size, bool user_mode) {
     if (is_pie) {
         process_relocations(load_base, phdrs, ehdr->e_phnum);
     }
+    protect_segments(load_base, phdrs, ehdr->e_phnum, user_mode);
     
     uint64_t entry_point = is_pie ? (load_base + ehdr->e_entry) : ehdr->e_entry;
     
@@ -373,6 +402,7 @@ void* get_elf_entry_point_user(void* elf_base, size_t elf_file_size, void* stack
     if (is_pie) {
         process_relocations(load_base, phdrs, ehdr->e_phnum);
     }
+    protect_segments(load_base, phdrs, ehdr->e_phnum, true);
     
     uint64_t entry_point = is_pie ? (load_base + ehdr->e_entry) : ehdr->e_entry;
 
@@ -23,6 +23,8 @@
 #include <arch/x86_64/apic/apic.hpp>
 #include <drivers/timers/apic/apic.hpp>
 #include <proc/proc.hpp>
+#include <proc/workqueue.hpp>
+#include <config.hpp>
 
 #define UACPI_ERROR(name, isinit) \
 if (uacpi_unlikely_error(uacpi_result)) { \
@@ -48,10 +50,12 @@ extern "C" void init() {
         asm volatile ("cli;hlt");
     }
 
+    const char* string_ops = mem::select_string_ops(); // first, so everything from flanterm on gets the fast copies
     flanterm_initialise();
     serial::serial_enable();
     Log::printf_status("OK", "Flanterm Initialised"); // late
     Log::printf_status("OK", "Serial Initialised");
+    Log::printf_status("OK", "String ops: %s", string_ops);
     
     arch::x86_64::cpu::gdt::initialise();
     Log::printf_status("OK", "GDT Initialised");
@@ -61,12 +65,18 @@ extern "C" void init() {
 
     mem::pmm::initialise();
     Log::printf_status("OK", "PMM Initialised");
+#ifdef CONFIG_PMM_BENCHMARK
+    mem::pmm::benchmark();
+#endif
 
     mem::vmm::initialise();
     Log::printf_status("OK", "VMM Initialised");
 
     mem::heap::initialise();
     Log::printf_status("OK", "Heap Initialised");
+#ifdef CONFIG_STRING_BENCHMARK
+    mem::benchmark_string_ops();
+#endif
     
     drivers::timers::pit::initialise();
     Log::printf_status("OK", "PIT Initialised (FREQ=300)");
@@ -105,6 +115,11 @@ extern "C" void init() {
 	asm ("sti");
 	drivers::timers::apic::initialise();
 	Log::printf_status("OK", "APIC Timer Initialised");
+	uint32_t ncpus = arch::x86_64::apic::wake_up_cpus();
+	Log::printf_status("OK", "%u CPUs online", ncpus);
+#ifdef CONFIG_HEAP_BENCHMARK
+	mem::heap::benchmark(); // with interrupts on, the APs run it too and send this CPU shootdowns
+#endif
 	asm ("cli");
 
 	ramfs::initialise();
@@ -137,8 +152,19 @@ extern "C" void init() {
 	Log::printf_status("OK", "Syscall handlers Initialised, there are %zu valid syscalls", nsc);
 
 	proc::initialise();
+#ifdef CONFIG_VMA_SELFTEST
+	if (proc::selftest()) Log::printf_status("OK", "VMA protections enforced");
+	else Log::printf_status("FAIL", "VMA protections not enforced");
+#endif
+	proc::sched::initialise();
+	Log::printf_status("OK", "Scheduler Initialised, %u ms quantum", CONFIG_SCHED_QUANTUM_MS);
+	uint32_t nworkers = proc::work::initialise();
+	Log::printf_status("OK", "Work queues Initialised, %u workers", nworkers);
 
 	asm ("sti");
+#ifdef CONFIG_SCHED_BENCHMARK
+	proc::sched::benchmark();
+#endif
 
 	proc::execve("/initrd/init", 0, 0, 0);
 
@@ -149,7 +175,8 @@ extern "C" void init() {
     	//if (read > 0) printf("Read %zu characters: %s\n\r", read, buf);
     	//else printf("Read 0 characters...\n\r");
     	//printf("Timer report: %zu\n\r", drivers::timers::apic::ns_elapsed_time());
-        asm volatile("hlt");
+        // zero frames for palloc_zeroed while there's nothing else to do, sleep once the pool is full
+        if (mem::pmm::refill_zero_pool(16) == 0) asm volatile("hlt");
     }
     
     __builtin_unreachable();
@@ -1,245 +1,1200 @@
 #include <mem/mem.hpp>
 #include <mem/heap.hpp>
+#include <mem/pmm.hpp>
+#include <arch/arch.hpp>
+#include <arch/x86_64/apic/apic.hpp>
+#include <config.hpp>
 #include <cstdio>
 
-void* heap_base = nullptr;
-size_t heap_size = 0;
+extern "C" {
+#include <proc/spinlocks.h>
+}
+
+#ifdef CONFIG_HEAP_PROFILER
+/* from dbg/dbg.hpp, which drags the tty headers in with it */
+const char* find_symbol(uint64_t addr, uint64_t* offset);
+#endif
+
+/*
+ * The heap lives in its own stretch of kernel address space and grows a
+ * region at a time, each region is a whole number of 2 MiB slots mapped
+ * on demand. Blocks never cross regions, the sentinels see to that.
+ */
+#ifndef HEAP_VIRT_BASE /* the hosted benchmark moves it somewhere a process can map */
+#define HEAP_VIRT_BASE 0xFFFFD00000000000ULL
+#endif
+#define HEAP_VIRT_SIZE 0x1000000000ULL
+#define HEAP_SLOT_SIZE 0x200000ULL
+#define HEAP_SLOTS (HEAP_VIRT_SIZE / HEAP_SLOT_SIZE)
 
+#define HEAP_ALIGN 16
+#define BLOCK_USED 0x1
+
+/*
+ * The header sits right in front of the pointer handed out and carries the
+ * size of the block before it as a boundary tag, so free can reach both
+ * neighbours and coalesce without walking the heap.
+ */
 struct heap_block {
-    void* base;
-    size_t length;
-    bool is_free;
-    heap_block* prev;
-    heap_block* next;
+    size_t prev_size;
+    size_t size; /* whole block including the header, BLOCK_USED while allocated */
+
+    /* only valid while the block is free or waiting on a remote free queue, they live where the payload would */
+    heap_block* prev_free;
+    heap_block* next_free;
 };
 
-namespace mem::heap {
+#define HEADER_SIZE (2 * sizeof(size_t))
+#define MIN_BLOCK sizeof(heap_block)
 
-void initialise() {
-    const size_t initial_size = 0x100000000;
-    const size_t min_heap_size = 0x100000;
-    size_t divisor = 1;
-    heap_base = nullptr;
+struct heap_region {
+    heap_region* prev;
+    heap_region* next;
+    size_t size; /* bytes of address space, a multiple of HEAP_SLOT_SIZE */
+    size_t pad; /* keeps the blocks after it 16 byte aligned */
+};
+
+/* region header plus the allocated sentinels at both ends */
+#define REGION_OVERHEAD (sizeof(heap_region) + 2 * HEADER_SIZE)
+
+/*
+ * Aligned requests don't go through blocks. They come from run slots,
+ * 2 MiB slots cut into pages with a descriptor per page at the front.
+ * A page either holds objects of one power of two size, each naturally
+ * aligned and without a header, or starts a run of whole pages.
+ */
+#define RUN_PAGE_SIZE 0x1000ULL
+#define RUN_SLOT_PAGES (HEAP_SLOT_SIZE / RUN_PAGE_SIZE)
+#define RUN_MIN_SHIFT 5
+#define RUN_MAX_SHIFT 11
+#define RUN_CLASSES (RUN_MAX_SHIFT - RUN_MIN_SHIFT + 1)
+#define RUN_MAX_PAGES 256
+#define RUN_MAX_ALIGN 0x10000ULL /* past this the runs leave too much of a slot unused */
+
+enum run_page_kind : uint8_t {
+    RUN_PAGE_FREE,
+    RUN_PAGE_OBJECTS,
+    RUN_PAGE_HEAD, /* first page of a page run */
+    RUN_PAGE_TAIL,
+};
+
+#define RUN_PAGE_OBJECTS_MAX (RUN_PAGE_SIZE >> RUN_MIN_SHIFT)
+
+struct run_page {
+    run_page* prev; /* on the arena's list of pages with free objects of this size */
+    run_page* next;
+    uint64_t free_objects[RUN_PAGE_OBJECTS_MAX / 64]; /* set bits are free objects, a clear one being freed is a double free */
+    run_page_kind kind;
+    uint8_t shift; /* objects are 1 << shift bytes */
+    uint16_t used;
+    uint32_t pages; /* length of the run on a head page */
+};
+
+struct run_slot {
+    run_slot* prev;
+    run_slot* next;
+    uint64_t free_pages;
+    uint64_t free_map[RUN_SLOT_PAGES / 64]; /* set bits are free pages */
+    run_page pages[RUN_SLOT_PAGES]; /* the ones covering this header are never used */
+};
+
+#define RUN_META_PAGES ((sizeof(run_slot) + RUN_PAGE_SIZE - 1) / RUN_PAGE_SIZE)
+#define RUN_DATA_PAGES (RUN_SLOT_PAGES - RUN_META_PAGES)
+
+/* slot_owner bit for slots holding runs instead of blocks */
+#define SLOT_RUNS 0x80
+
+/* payload size classes for small requests, four steps per power of two */
+#define SMALL_MAX 2048
+#define NUM_CLASSES 24
+
+static constexpr uint16_t class_size[NUM_CLASSES] = {
+    16, 32, 48, 64, 80, 96, 112, 128,
+    160, 192, 224, 256, 320, 384, 448, 512,
+    640, 768, 896, 1024, 1280, 1536, 1792, 2048,
+};
+
+/* indexed by payload / 16: the class a request rounds up to, and the bin a free block of that payload goes in */
+struct class_tables {
+    uint8_t up[SMALL_MAX / 16 + 1];
+    uint8_t down[SMALL_MAX / 16 + 1];
+};
+
+static constexpr class_tables make_class_tables() {
+    class_tables t = {};
+    for (int i = 0; i <= SMALL_MAX / 16; i++) {
+        int c = 0;
+        while (class_size[c] < i * 16) c++;
+        t.up[i] = c;
+
+        c = NUM_CLASSES - 1;
+        while (c > 0 && class_size[c] > i * 16) c--;
+        t.down[i] = c;
+    }
+    return t;
+}
+
+static constexpr class_tables classes = make_class_tables();
+
+#ifdef CONFIG_HEAP_STATS
+struct heap_path_stats {
+    uint64_t count;
+    uint64_t cycles;
+    uint64_t max_cycles;
+};
+
+static inline void account(heap_path_stats* st, uint64_t start) {
+    uint64_t spent = arch::x86_64::misc::rdtsc() - start;
+    st->count++;
+    st->cycles += spent;
+    if (spent > st->max_cycles) st->max_cycles = spent;
+}
+#endif
+
+/* one per CPU plus the boot arena, which the BSP keeps using once the APIC is up */
+#define HEAP_MAX_ARENAS 65
+
+/*
+ * Each CPU allocates from its own arena and only ever touches its own
+ * lists, with interrupts off instead of a lock. Free blocks of up to
+ * SMALL_MAX payload sit in the bin of the largest class they can hold,
+ * so any block in bin c or above serves class c. Everything bigger goes
+ * on the large list and is found best-fit.
+ *
+ * A block freed by another CPU can't be put on the owner's lists, so it
+ * is pushed onto remote_frees instead, a lock-free stack that only the
+ * owner empties, all at once, on its next allocation.
+ */
+struct heap_arena {
+    heap_block* bins[NUM_CLASSES];
+    uint32_t bin_mask;
+    heap_block* large_list;
+
+    heap_region* regions;
+    uint64_t num_regions;
+    uint64_t mapped_bytes;
+
+    heap_block* remote_frees;
+    uint64_t remote_free_count;
+    volatile bool trim; /* set by the reclaimer running on another CPU */
+
+    run_page* object_pages[RUN_CLASSES];
+    run_slot* run_slots;
+    uint64_t num_run_slots;
+    void* remote_runs; /* same as remote_frees for aligned objects and page runs */
+
+#ifdef CONFIG_HEAP_STATS
+    heap_path_stats small_stats;
+    heap_path_stats large_stats;
+#endif
+} __attribute__((aligned(64)));
+
+static heap_arena arenas[HEAP_MAX_ARENAS];
+
+/* which arena owns each slot, plus one so that 0 means unmapped, with SLOT_RUNS for run slots */
+static uint8_t slot_owner[HEAP_SLOTS];
+static spinlock slot_lock = {"heap_slots", 0};
+
+
+static inline size_t block_size(heap_block* b) { return b->size & ~(size_t)BLOCK_USED; }
+static inline bool block_used(heap_block* b) { return b->size & BLOCK_USED; }
+static inline heap_block* next_block(heap_block* b) { return (heap_block*)((uint8_t*)b + block_size(b)); }
+static inline heap_block* prev_block(heap_block* b) { return (heap_block*)((uint8_t*)b - b->prev_size); }
+static inline void* payload(heap_block* b) { return (uint8_t*)b + HEADER_SIZE; }
+static inline heap_block* header_of(void* ptr) { return (heap_block*)((uint8_t*)ptr - HEADER_SIZE); }
+
+/* block size needed to hand out n bytes, 0 if it can't fit in the heap at all */
+static inline size_t block_for(size_t n) {
+    if (n > HEAP_VIRT_SIZE) return 0;
+    size_t size = (n + HEADER_SIZE + HEAP_ALIGN - 1) & ~(size_t)(HEAP_ALIGN - 1);
+    return size < MIN_BLOCK ? MIN_BLOCK : size;
+}
+
+static inline uint64_t slot_of(void* p) {
+    return ((uint64_t)p - HEAP_VIRT_BASE) / HEAP_SLOT_SIZE;
+}
+
+static inline bool is_heap_pointer(void* ptr) {
+    uint64_t p = (uint64_t)ptr;
+    if (p < HEAP_VIRT_BASE || p >= HEAP_VIRT_BASE + HEAP_VIRT_SIZE || (p & (HEAP_ALIGN - 1))) return false;
+
+    uint8_t owner = slot_owner[slot_of(ptr)];
+    if (!owner || (owner & SLOT_RUNS)) return false;
+
+    heap_block* b = header_of(ptr);
+    return block_used(b) && block_size(b) >= MIN_BLOCK;
+}
+
+static inline run_slot* run_slot_of(void* p) {
+    return (run_slot*)(HEAP_VIRT_BASE + slot_of(p) * HEAP_SLOT_SIZE);
+}
+
+static inline run_page* run_page_of(void* p) {
+    run_slot* s = run_slot_of(p);
+    return &s->pages[((uint64_t)p - (uint64_t)s) / RUN_PAGE_SIZE];
+}
+
+static inline void* page_address(run_slot* s, uint64_t index) {
+    return (uint8_t*)s + index * RUN_PAGE_SIZE;
+}
+
+static inline bool is_run_pointer(void* ptr) {
+    uint64_t p = (uint64_t)ptr;
+    if (p < HEAP_VIRT_BASE || p >= HEAP_VIRT_BASE + HEAP_VIRT_SIZE) return false;
+    if (!(slot_owner[slot_of(ptr)] & SLOT_RUNS)) return false;
+
+    run_page* page = run_page_of(ptr);
+    if (page->kind == RUN_PAGE_OBJECTS) return !(p & ((1ULL << page->shift) - 1));
+    return page->kind == RUN_PAGE_HEAD && !(p & (RUN_PAGE_SIZE - 1));
+}
+
+static inline size_t run_usable(void* ptr) {
+    run_page* page = run_page_of(ptr);
+    return page->kind == RUN_PAGE_OBJECTS ? 1ULL << page->shift : page->pages * RUN_PAGE_SIZE;
+}
+
+/* works for both blocks and runs */
+static inline heap_arena* owner_of(void* p) {
+    return &arenas[(slot_owner[slot_of(p)] & ~SLOT_RUNS) - 1];
+}
+
+static inline heap_arena* local_arena() {
+    cpu_unit* cpu = arch::x86_64::apic::get_current_cpu();
+    if (!cpu || cpu->is_bsp || cpu->registry_id >= HEAP_MAX_ARENAS - 1) return &arenas[0];
+    return &arenas[cpu->registry_id + 1];
+}
+
+/* the start sentinel is the only block HEADER_SIZE long, the end sentinel the only one of size 0 */
+static inline bool spans_region(heap_block* b) {
+    return block_size(prev_block(b)) == HEADER_SIZE && block_size(next_block(b)) == 0;
+}
+
+static inline heap_region* region_of(heap_block* first) {
+    return (heap_region*)((uint8_t*)first - HEADER_SIZE - sizeof(heap_region));
+}
+
+static heap_block** list_of(heap_arena* a, heap_block* b) {
+    size_t payload_size = block_size(b) - HEADER_SIZE;
+    if (payload_size > SMALL_MAX) return &a->large_list;
+    return &a->bins[classes.down[payload_size / 16]];
+}
+
+static void list_push(heap_arena* a, heap_block* b) {
+    heap_block** list = list_of(a, b);
+    b->prev_free = nullptr;
+    b->next_free = *list;
+    if (*list) (*list)->prev_free = b;
+    *list = b;
+
+    if (list != &a->large_list) a->bin_mask |= 1u << (list - a->bins);
+}
+
+static void list_remove(heap_arena* a, heap_block* b) {
+    heap_block** list = list_of(a, b);
+    if (b->prev_free) b->prev_free->next_free = b->next_free;
+    else *list = b->next_free;
+    if (b->next_free) b->next_free->prev_free = b->prev_free;
 
-    while (heap_base == nullptr && initial_size / divisor >= min_heap_size) {
-        heap_size = initial_size / divisor;
-        size_t num_pages = heap_size / 0x1000;
+    if (list != &a->large_list && !*list) a->bin_mask &= ~(1u << (list - a->bins));
+}
+
+static void set_size(heap_block* b, size_t size, bool used) {
+    b->size = size | (used ? BLOCK_USED : 0);
+    next_block(b)->prev_size = size;
+}
+
+/* merges a free block that isn't on the list yet with its free neighbours */
+static heap_block* coalesce(heap_arena* a, heap_block* b) {
+    heap_block* next = next_block(b);
+    if (!block_used(next)) {
+        list_remove(a, next);
+        set_size(b, block_size(b) + block_size(next), false);
+    }
+
+    heap_block* prev = prev_block(b);
+    if (!block_used(prev)) {
+        list_remove(a, prev);
+        set_size(prev, block_size(prev) + block_size(b), false);
+        b = prev;
+    }
+
+    return b;
+}
+
+/* trims a block to size and frees whatever is left over behind it */
+static void split(heap_arena* a, heap_block* b, size_t size) {
+    size_t total = block_size(b);
+    if (total - size < MIN_BLOCK) return;
 
-        heap_base = mem::pmm::reserve_heap(num_pages);
+    set_size(b, size, block_used(b));
 
-        if (heap_base != nullptr) {
-        } else {
+    heap_block* rest = next_block(b);
+    set_size(rest, total - size, false);
+    list_push(a, coalesce(a, rest));
+}
+
+static void* take(heap_arena* a, heap_block* b, size_t size) {
+    list_remove(a, b);
+    b->size |= BLOCK_USED;
+    split(a, b, size);
+    return payload(b);
+}
+
+/* first run of n free slots, or -1, called with slot_lock held */
+static int64_t find_slots(uint64_t n) {
+    uint64_t run = 0;
+    for (uint64_t slot = 0; slot < HEAP_SLOTS; slot++) {
+        if (slot_owner[slot]) {
+            run = 0;
+            continue;
         }
+        if (++run == n) return slot + 1 - n;
+    }
+    return -1;
+}
+
+static void mark_slots(uint64_t first, uint64_t n, uint8_t owner) {
+    for (uint64_t slot = first; slot < first + n; slot++) slot_owner[slot] = owner;
+}
+
+/* maps a new region big enough for a block of need bytes into a's address space and returns its one free block */
+static heap_block* grow(heap_arena* a, size_t need) {
+    uint64_t bytes = (need + REGION_OVERHEAD + HEAP_SLOT_SIZE - 1) & ~(HEAP_SLOT_SIZE - 1);
+    uint64_t nslots = bytes / HEAP_SLOT_SIZE;
 
-        divisor *= 2;
+    /* the slots are claimed before mapping so the lock isn't held while the PMM might call back into us */
+    c_acquire_spinlock(&slot_lock);
+    int64_t first = find_slots(nslots);
+    if (first >= 0) mark_slots(first, nslots, (uint8_t)(a - arenas + 1));
+    c_release_spinlock(&slot_lock);
+    if (first < 0) return nullptr;
+
+    heap_region* r = (heap_region*)(HEAP_VIRT_BASE + first * HEAP_SLOT_SIZE);
+    if (!mem::vmm::mmap_anonymous(r, bytes / 0x1000, PAGE_PRESENT | PAGE_RW | PAGE_NX)) {
+        c_acquire_spinlock(&slot_lock);
+        mark_slots(first, nslots, 0);
+        c_release_spinlock(&slot_lock);
+        return nullptr;
     }
 
-    if (heap_base == nullptr) {
-    } else {
+    r->size = bytes;
+    r->prev = nullptr;
+    r->next = a->regions;
+    if (a->regions) a->regions->prev = r;
+    a->regions = r;
+    a->num_regions++;
+    a->mapped_bytes += bytes;
+
+    heap_block* start = (heap_block*)(r + 1);
+    start->prev_size = 0;
+    start->size = HEADER_SIZE | BLOCK_USED;
+
+    heap_block* end = (heap_block*)((uint8_t*)r + bytes - HEADER_SIZE);
+    end->size = BLOCK_USED;
+
+    heap_block* block = next_block(start);
+    block->prev_size = HEADER_SIZE;
+    set_size(block, bytes - REGION_OVERHEAD, false);
+    list_push(a, block);
+    return block;
+}
+
+/* gives a region whose only block is free back to the PMM */
+static void release_region(heap_arena* a, heap_block* block) {
+    heap_region* r = region_of(block);
+    list_remove(a, block);
+
+    if (r->prev) r->prev->next = r->next;
+    else a->regions = r->next;
+    if (r->next) r->next->prev = r->prev;
+    a->num_regions--;
+    a->mapped_bytes -= r->size;
+
+    uint64_t size = r->size;
+    mem::vmm::munmap_anonymous(r, size / 0x1000);
+
+    c_acquire_spinlock(&slot_lock);
+    mark_slots(slot_of(r), size / HEAP_SLOT_SIZE, 0);
+    c_release_spinlock(&slot_lock);
+}
+
+static size_t release_empty_regions(heap_arena* a) {
+    size_t pages = 0;
+    heap_region* r = a->regions;
+    while (r) {
+        heap_region* next = r->next;
+        heap_block* block = next_block((heap_block*)(r + 1));
+        if (!block_used(block) && spans_region(block)) {
+            pages += r->size / 0x1000;
+            release_region(a, block);
+        }
+        r = next;
+    }
+    return pages;
+}
+
+static inline bool page_free(run_slot* s, uint64_t i) {
+    return s->free_map[i / 64] & (1ULL << (i % 64));
+}
+
+static void mark_pages(run_slot* s, uint64_t first, uint64_t n, bool free) {
+    for (uint64_t i = first; i < first + n; i++) {
+        if (free) s->free_map[i / 64] |= 1ULL << (i % 64);
+        else s->free_map[i / 64] &= ~(1ULL << (i % 64));
+        s->pages[i].kind = free ? RUN_PAGE_FREE : RUN_PAGE_TAIL;
     }
+    s->free_pages += free ? n : -n;
+}
+
+/* first fit for n pages starting on a multiple of align pages, -1 if the slot has no such hole */
+static int64_t find_pages(run_slot* s, uint64_t n, uint64_t align) {
+    uint64_t i = (RUN_META_PAGES + align - 1) & ~(align - 1);
+    while (i + n <= RUN_SLOT_PAGES) {
+        uint64_t run = 0;
+        while (run < n && page_free(s, i + run)) run++;
+        if (run == n) return i;
+        i = ((i + run) & ~(align - 1)) + align;
+    }
+    return -1;
+}
+
+static run_slot* new_run_slot(heap_arena* a) {
+    c_acquire_spinlock(&slot_lock);
+    int64_t slot = find_slots(1);
+    if (slot >= 0) mark_slots(slot, 1, (uint8_t)((a - arenas + 1) | SLOT_RUNS));
+    c_release_spinlock(&slot_lock);
+    if (slot < 0) return nullptr;
+
+    run_slot* s = (run_slot*)(HEAP_VIRT_BASE + slot * HEAP_SLOT_SIZE);
+    if (!mem::vmm::mmap_anonymous(s, HEAP_SLOT_SIZE / 0x1000, PAGE_PRESENT | PAGE_RW | PAGE_NX)) {
+        c_acquire_spinlock(&slot_lock);
+        mark_slots(slot, 1, 0);
+        c_release_spinlock(&slot_lock);
+        return nullptr;
+    }
+
+    mem::memset(s, 0, sizeof(run_slot));
+    mark_pages(s, RUN_META_PAGES, RUN_DATA_PAGES, true);
+
+    s->prev = nullptr;
+    s->next = a->run_slots;
+    if (a->run_slots) a->run_slots->prev = s;
+    a->run_slots = s;
+    a->num_run_slots++;
+    a->mapped_bytes += HEAP_SLOT_SIZE;
+    return s;
+}
+
+static void release_run_slot(heap_arena* a, run_slot* s) {
+    if (s->prev) s->prev->next = s->next;
+    else a->run_slots = s->next;
+    if (s->next) s->next->prev = s->prev;
+    a->num_run_slots--;
+    a->mapped_bytes -= HEAP_SLOT_SIZE;
+
+    mem::vmm::munmap_anonymous(s, HEAP_SLOT_SIZE / 0x1000);
+
+    c_acquire_spinlock(&slot_lock);
+    mark_slots(slot_of(s), 1, 0);
+    c_release_spinlock(&slot_lock);
+}
+
+static size_t release_empty_run_slots(heap_arena* a) {
+    size_t pages = 0;
+    run_slot* s = a->run_slots;
+    while (s) {
+        run_slot* next = s->next;
+        if (s->free_pages == RUN_DATA_PAGES) {
+            pages += HEAP_SLOT_SIZE / 0x1000;
+            release_run_slot(a, s);
+        }
+        s = next;
+    }
+    return pages;
+}
 
-    heap_base = (void*)mem::vmm::pa_to_va((uint64_t)heap_base);
+static void* alloc_pages(heap_arena* a, uint64_t n, uint64_t align) {
+    run_slot* s = a->run_slots;
+    int64_t first = -1;
+    for (; s; s = s->next) {
+        if (s->free_pages >= n && (first = find_pages(s, n, align)) >= 0) break;
+    }
+
+    if (!s) {
+        s = new_run_slot(a);
+        if (!s || (first = find_pages(s, n, align)) < 0) return nullptr;
+    }
+
+    mark_pages(s, first, n, false);
+    s->pages[first].kind = RUN_PAGE_HEAD;
+    s->pages[first].pages = n;
+    return page_address(s, first);
+}
 
-    heap_block* first_block = (heap_block*)heap_base;
-    first_block->base = (void*)((uint8_t*)first_block + sizeof(heap_block));
-    first_block->length = heap_size - sizeof(heap_block);
-    first_block->is_free = true;
-    first_block->prev = nullptr;
-    first_block->next = nullptr;
+static void free_pages(heap_arena* a, void* ptr, uint64_t n) {
+    run_slot* s = run_slot_of(ptr);
+    mark_pages(s, run_page_of(ptr) - s->pages, n, true);
+
+    /* one empty slot is kept so a steady workload doesn't map and unmap 2 MiB over and over, the rest go at once */
+    if (s->free_pages == RUN_DATA_PAGES && a->num_run_slots > 1)
+        release_run_slot(a, s);
 }
 
-void defragment() {
-    if (heap_base == nullptr) {
-        Log::errf("Heap not initialized, cannot defragment");
+static void* alloc_object(heap_arena* a, int shift) {
+    run_page** list = &a->object_pages[shift - RUN_MIN_SHIFT];
+    run_page* page = *list;
+
+    if (!page) {
+        void* base = alloc_pages(a, 1, 1);
+        if (!base) return nullptr;
+
+        page = run_page_of(base);
+        page->kind = RUN_PAGE_OBJECTS;
+        page->shift = shift;
+        page->used = 0;
+
+        uint64_t objects = RUN_PAGE_SIZE >> shift;
+        for (uint64_t w = 0; w < RUN_PAGE_OBJECTS_MAX / 64; w++) {
+            uint64_t n = objects > w * 64 ? objects - w * 64 : 0;
+            page->free_objects[w] = n >= 64 ? ~0ULL : (1ULL << n) - 1;
+        }
+
+        page->prev = nullptr;
+        page->next = nullptr;
+        *list = page;
+    }
+
+    /* lowest free object first, so a page fills in address order */
+    uint64_t w = page->free_objects[0] ? 0 : 1;
+    uint64_t bit = __builtin_ctzll(page->free_objects[w]);
+    page->free_objects[w] &= ~(1ULL << bit);
+    page->used++;
+
+    run_slot* s = run_slot_of(page);
+    void* obj = (uint8_t*)page_address(s, page - s->pages) + ((w * 64 + bit) << page->shift);
+
+    /* full pages drop off the list until something on them is freed */
+    if (!page->free_objects[0] && !page->free_objects[1]) {
+        *list = page->next;
+        if (page->next) page->next->prev = nullptr;
+    }
+    return obj;
+}
+
+static void free_run(heap_arena* a, void* ptr) {
+    run_page* page = run_page_of(ptr);
+    if (page->kind == RUN_PAGE_HEAD) {
+        free_pages(a, ptr, page->pages);
         return;
     }
 
-    heap_block* current = (heap_block*)heap_base;
-    while (current != nullptr) {
-        if (current->is_free && current->next != nullptr && current->next->is_free) {
-            current->length += current->next->length + sizeof(heap_block);
-            current->next = current->next->next;
+    uint64_t index = ((uint64_t)ptr & (RUN_PAGE_SIZE - 1)) >> page->shift;
+    uint64_t mask = 1ULL << (index % 64);
+    if (page->free_objects[index / 64] & mask) {
+        Log::errf("Free: Attempted to free a run object twice: %p", ptr);
+        return;
+    }
 
-            if (current->next != nullptr) {
-                current->next->prev = current;
-            }
-        } else {
-            current = current->next;
+    run_page** list = &a->object_pages[page->shift - RUN_MIN_SHIFT];
+    bool was_full = !page->free_objects[0] && !page->free_objects[1];
+    page->free_objects[index / 64] |= mask;
+    page->used--;
+
+    if (was_full && page->used) {
+        page->prev = nullptr;
+        page->next = *list;
+        if (*list) (*list)->prev = page;
+        *list = page;
+    } else if (!was_full && !page->used) {
+        if (page->prev) page->prev->next = page->next;
+        else *list = page->next;
+        if (page->next) page->next->prev = page->prev;
+    }
+
+    if (!page->used) {
+        page->kind = RUN_PAGE_HEAD;
+        page->pages = 1;
+        free_pages(a, (void*)((uint64_t)ptr & ~(RUN_PAGE_SIZE - 1)), 1);
+    }
+}
+
+static void remote_push_run(heap_arena* a, void* ptr) {
+    void* head = __atomic_load_n(&a->remote_runs, __ATOMIC_RELAXED);
+    do {
+        *(void**)ptr = head;
+    } while (!__atomic_compare_exchange_n(&a->remote_runs, &head, ptr, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/* puts a block the owning CPU is done with back on its lists */
+static void release_block(heap_arena* a, heap_block* b) {
+    b->size &= ~(size_t)BLOCK_USED;
+    b = coalesce(a, b);
+    list_push(a, b);
+
+    /* an empty region is kept for the next allocation unless memory is running low */
+    if (spans_region(b) && a->num_regions > 1 && mem::pmm::stat_free() < mem::pmm::stat_total_mem() / 16)
+        release_region(a, b);
+}
+
+static void remote_push(heap_arena* a, heap_block* b) {
+    heap_block* head = __atomic_load_n(&a->remote_frees, __ATOMIC_RELAXED);
+    do {
+        b->next_free = head;
+    } while (!__atomic_compare_exchange_n(&a->remote_frees, &head, b, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/* takes the whole remote free queue in one exchange, so pushes racing with it just land in the next batch */
+static void drain_remote(heap_arena* a) {
+    if (a->trim) {
+        a->trim = false;
+        release_empty_regions(a);
+        release_empty_run_slots(a);
+    }
+
+    if (__atomic_load_n(&a->remote_runs, __ATOMIC_RELAXED)) {
+        void* ptr = __atomic_exchange_n(&a->remote_runs, nullptr, __ATOMIC_ACQUIRE);
+        while (ptr) {
+            void* next = *(void**)ptr;
+            free_run(a, ptr);
+            a->remote_free_count++;
+            ptr = next;
         }
     }
+
+    if (!__atomic_load_n(&a->remote_frees, __ATOMIC_RELAXED)) return;
+
+    heap_block* b = __atomic_exchange_n(&a->remote_frees, nullptr, __ATOMIC_ACQUIRE);
+    while (b) {
+        heap_block* next = b->next_free;
+        release_block(a, b);
+        a->remote_free_count++;
+        b = next;
+    }
 }
 
-void* malloc(size_t n) {
-    heap_block* current = (heap_block*)heap_base;
+/* registered with the PMM, runs when it can't satisfy an allocation */
+static size_t reclaim() {
+    uint64_t flags = arch::x86_64::misc::irq_save();
+    heap_arena* local = local_arena();
+
+    /* other arenas can only be trimmed by their own CPU, ask them to on their next allocation */
+    for (int i = 0; i < HEAP_MAX_ARENAS; i++) {
+        if (&arenas[i] != local && (arenas[i].num_regions || arenas[i].num_run_slots)) arenas[i].trim = true;
+    }
+
+    size_t pages = release_empty_regions(local) + release_empty_run_slots(local);
+    arch::x86_64::misc::irq_restore(flags);
+    return pages;
+}
+
+static void* arena_malloc(heap_arena* a, size_t n) {
+#ifdef CONFIG_HEAP_STATS
+    uint64_t start = arch::x86_64::misc::rdtsc();
+#endif
+    drain_remote(a);
+
+    size_t size = block_for(n);
     heap_block* best_fit = nullptr;
 
-    while (current != nullptr) {
-        if (current->is_free && current->length >= n) {
-            if (best_fit == nullptr || current->length < best_fit->length) {
-                best_fit = current;
+    if (size && n <= SMALL_MAX) {
+        /* round up to the class, then the first non-empty bin from there on fits */
+        int c = classes.up[(n + 15) / 16];
+        size = class_size[c] + HEADER_SIZE;
+
+        uint32_t usable = a->bin_mask & ~((1u << c) - 1);
+        if (usable) {
+            void* ptr = take(a, a->bins[__builtin_ctz(usable)], size);
+#ifdef CONFIG_HEAP_STATS
+            account(&a->small_stats, start);
+#endif
+            return ptr;
+        }
+    }
+
+    if (size) {
+        for (heap_block* b = a->large_list; b; b = b->next_free) {
+            if (block_size(b) < size) continue;
+            if (best_fit == nullptr || block_size(b) < block_size(best_fit)) {
+                best_fit = b;
+                if (block_size(b) == size) break;
             }
         }
-        current = current->next;
     }
 
+    if (best_fit == nullptr && size) best_fit = grow(a, size);
+
     if (best_fit == nullptr) {
         Log::errf("Malloc: No suitable free block found for %zu bytes", n);
         return nullptr;
     }
 
-    if (best_fit->length > n + sizeof(heap_block)) {
-        heap_block* new_block = (heap_block*)((uint8_t*)best_fit + sizeof(heap_block) + n);
-        new_block->base = (void*)((uint8_t*)new_block + sizeof(heap_block));
-        new_block->length = best_fit->length - n - sizeof(heap_block);
-        new_block->is_free = true;
-        new_block->next = best_fit->next;
-        if (best_fit->next) {
-            best_fit->next->prev = new_block;
+    void* ptr = take(a, best_fit, size);
+#ifdef CONFIG_HEAP_STATS
+    account(&a->large_stats, start);
+#endif
+    return ptr;
+}
+
+#ifdef CONFIG_HEAP_PROFILER
+#define PROFILE_SITES 512
+#define PROFILE_BUCKETS 16
+
+/* everything allocated from one return address */
+struct profile_site {
+    uint64_t caller;
+    uint64_t allocs;
+    uint64_t frees;
+    uint64_t live_bytes;
+    uint64_t peak_bytes;
+    uint64_t histogram[PROFILE_BUCKETS]; /* by power of two, 16 bytes and under up to 256 KiB and over */
+};
+
+/* kept in the last bytes of every block so free knows which site to charge */
+struct profile_tag {
+    uint32_t site; /* index into profile_sites plus one, 0 if the table was full */
+    uint32_t reserved;
+    uint64_t size;
+};
+
+#define PROFILE_TAG sizeof(profile_tag)
+
+static profile_site profile_sites[PROFILE_SITES];
+static uint64_t profile_untracked = 0;
+static spinlock profile_lock = {"heap_profile", 0};
+
+static inline profile_tag* tag_of(void* ptr) {
+    size_t usable = is_run_pointer(ptr) ? run_usable(ptr) : block_size(header_of(ptr)) - HEADER_SIZE;
+    return (profile_tag*)((uint8_t*)ptr + usable - PROFILE_TAG);
+}
+
+static inline int size_bucket(size_t n) {
+    if (n <= 16) return 0;
+    int bucket = 64 - __builtin_clzll(n - 1) - 4;
+    return bucket < PROFILE_BUCKETS ? bucket : PROFILE_BUCKETS - 1;
+}
+
+/* open addressing on the return address, 0 once every slot belongs to someone else */
+static uint32_t find_site(uint64_t caller) {
+    uint32_t i = (uint32_t)(((caller >> 4) * 0x9E3779B97F4A7C15ULL) >> 55) % PROFILE_SITES;
+    for (int probe = 0; probe < PROFILE_SITES; probe++, i = (i + 1) % PROFILE_SITES) {
+        if (profile_sites[i].caller == caller) return i + 1;
+        if (profile_sites[i].caller == 0) {
+            profile_sites[i].caller = caller;
+            return i + 1;
         }
-        best_fit->next = new_block;
-        new_block->prev = best_fit;
-        best_fit->length = n;
     }
+    return 0;
+}
+
+static void profile_alloc(void* ptr, size_t n, void* caller) {
+    if (!ptr) return;
 
-    best_fit->is_free = false;
-    return best_fit->base;
+    uint64_t flags = arch::x86_64::misc::irq_save();
+    c_acquire_spinlock(&profile_lock);
+
+    profile_tag* tag = tag_of(ptr);
+    tag->site = find_site((uint64_t)caller);
+    tag->size = n;
+
+    if (tag->site) {
+        profile_site* site = &profile_sites[tag->site - 1];
+        site->allocs++;
+        site->histogram[size_bucket(n)]++;
+        site->live_bytes += n;
+        if (site->live_bytes > site->peak_bytes) site->peak_bytes = site->live_bytes;
+    } else {
+        profile_untracked++;
+    }
+
+    c_release_spinlock(&profile_lock);
+    arch::x86_64::misc::irq_restore(flags);
 }
 
-void* malloc_aligned(size_t n, size_t alignment) {
+static void profile_forget(profile_tag* tag) {
+    if (!tag->site) return;
+
+    uint64_t flags = arch::x86_64::misc::irq_save();
+    c_acquire_spinlock(&profile_lock);
+
+    profile_site* site = &profile_sites[tag->site - 1];
+    site->frees++;
+    site->live_bytes -= tag->size;
+
+    c_release_spinlock(&profile_lock);
+    arch::x86_64::misc::irq_restore(flags);
+}
+#else
+#define PROFILE_TAG 0
+#endif
+
+/* room for the profiler's tag on top of n, without wrapping requests that are too big anyway */
+static inline size_t with_tag(size_t n) {
+    return n > HEAP_VIRT_SIZE ? n : n + PROFILE_TAG;
+}
+
+namespace mem::heap {
+
+void initialise() {
+    /* start with a single slot for the boot arena, the rest is mapped as it's needed */
+    if (!grow(&arenas[0], HEAP_SLOT_SIZE - REGION_OVERHEAD)) {
+        Log::errf("Heap: Failed to map the first region");
+        return;
+    }
+
+    mem::pmm::register_reclaimer(reclaim);
+}
+
+static void* alloc(size_t n) {
+    uint64_t flags = arch::x86_64::misc::irq_save();
+    void* ptr = arena_malloc(local_arena(), n);
+    arch::x86_64::misc::irq_restore(flags);
+    return ptr;
+}
+
+static void* alloc_aligned(size_t n, size_t alignment) {
     if ((alignment & (alignment - 1)) != 0) return nullptr;
+    if (alignment <= HEAP_ALIGN) return alloc(n);
+    /* like block_for, nothing this big fits and rounding it up below would wrap */
+    if (n > HEAP_VIRT_SIZE || alignment > HEAP_VIRT_SIZE) return nullptr;
 
-    heap_block* current = (heap_block*)heap_base;
-    heap_block* best_fit = nullptr;
+    uint64_t flags = arch::x86_64::misc::irq_save();
+    heap_arena* a = local_arena();
+    drain_remote(a);
 
-    while (current != nullptr) {
-        if (current->is_free && current->length >= n + alignment) {
-            if (best_fit == nullptr || current->length < best_fit->length) {
-                best_fit = current;
-            }
-        }
-        current = current->next;
+    /* small requests take a naturally aligned object of the next power of two up */
+    size_t object = n > alignment ? n : alignment;
+    if (object <= (1ULL << RUN_MAX_SHIFT)) {
+        int shift = object <= (1ULL << RUN_MIN_SHIFT) ? RUN_MIN_SHIFT : 64 - __builtin_clzll(object - 1);
+        void* ptr = alloc_object(a, shift);
+        arch::x86_64::misc::irq_restore(flags);
+        if (ptr == nullptr) Log::errf("malloc_aligned: No suitable free block found for %zu bytes", n);
+        return ptr;
     }
 
-    if (best_fit == nullptr) {
+    /* page granular ones a run of whole pages */
+    uint64_t npages = n ? (n + RUN_PAGE_SIZE - 1) / RUN_PAGE_SIZE : 1;
+    if (npages <= RUN_MAX_PAGES && alignment <= RUN_MAX_ALIGN) {
+        void* ptr = alloc_pages(a, npages, alignment > RUN_PAGE_SIZE ? alignment / RUN_PAGE_SIZE : 1);
+        arch::x86_64::misc::irq_restore(flags);
+        if (ptr == nullptr) Log::errf("malloc_aligned: No suitable free block found for %zu bytes", n);
+        return ptr;
+    }
+
+    /* enough slack to slide the block up to the boundary and free what's in front */
+    uint8_t* raw = (uint8_t*)arena_malloc(a, n + alignment + MIN_BLOCK);
+    if (raw == nullptr) {
+        arch::x86_64::misc::irq_restore(flags);
         Log::errf("malloc_aligned: No suitable free block found for %zu bytes", n);
         return nullptr;
     }
 
-    uintptr_t raw_addr = (uintptr_t)best_fit->base;
-    uintptr_t aligned_addr = (raw_addr + alignment - 1) & ~(alignment - 1);
-    size_t padding = aligned_addr - raw_addr;
+    if (((uintptr_t)raw & (alignment - 1)) == 0) {
+        split(a, header_of(raw), block_for(n));
+        arch::x86_64::misc::irq_restore(flags);
+        return raw;
+    }
 
-    if (padding > 0) {
-        if (best_fit->length <= padding + sizeof(heap_block)) {
-            return nullptr;
-        }
+    uint8_t* aligned = (uint8_t*)(((uintptr_t)raw + MIN_BLOCK + alignment - 1) & ~(uintptr_t)(alignment - 1));
+    heap_block* lead = header_of(raw);
+    heap_block* block = header_of(aligned);
+    size_t total = block_size(lead);
+    size_t gap = aligned - raw;
+
+    set_size(lead, gap, false);
+    set_size(block, total - gap, true);
+    list_push(a, coalesce(a, lead));
 
-        heap_block* pad_block = (heap_block*)((uint8_t*)best_fit + sizeof(heap_block) + padding);
-        pad_block->base = (void*)((uint8_t*)pad_block + sizeof(heap_block));
-        pad_block->length = best_fit->length - padding - sizeof(heap_block);
-        pad_block->is_free = true;
-        pad_block->next = best_fit->next;
-        if (best_fit->next) best_fit->next->prev = pad_block;
-        pad_block->prev = best_fit;
+    split(a, block, block_for(n));
+    arch::x86_64::misc::irq_restore(flags);
+    return aligned;
+}
 
-        best_fit->length = padding;
-        best_fit->next = pad_block;
-        best_fit = pad_block;
+static void release(void* ptr) {
+    if (ptr == nullptr) {
+        return;
     }
 
-    if (best_fit->length > n + sizeof(heap_block)) {
-        heap_block* new_block = (heap_block*)((uint8_t*)best_fit + sizeof(heap_block) + n);
-        new_block->base = (void*)((uint8_t*)new_block + sizeof(heap_block));
-        new_block->length = best_fit->length - n - sizeof(heap_block);
-        new_block->is_free = true;
-        new_block->next = best_fit->next;
-        if (best_fit->next) new_block->next->prev = new_block;
-        new_block->prev = best_fit;
-        best_fit->next = new_block;
-        best_fit->length = n;
+    if (is_run_pointer(ptr)) {
+        uint64_t flags = arch::x86_64::misc::irq_save();
+        heap_arena* owner = owner_of(ptr);
+
+        if (owner == local_arena()) free_run(owner, ptr);
+        else remote_push_run(owner, ptr);
+
+        arch::x86_64::misc::irq_restore(flags);
+        return;
     }
 
-    best_fit->is_free = false;
-    return best_fit->base;
+    if (!is_heap_pointer(ptr)) {
+        Log::errf("Free: Attempted to free a block that wasn't allocated: %p", ptr);
+        return;
+    }
+
+    heap_block* b = header_of(ptr);
+    uint64_t flags = arch::x86_64::misc::irq_save();
+    heap_arena* owner = owner_of(b);
+
+    if (owner == local_arena()) release_block(owner, b);
+    else remote_push(owner, b); /* stays marked used until the owner drains it, so nothing coalesces into it early */
+
+    arch::x86_64::misc::irq_restore(flags);
 }
 
-void* realloc(void* ptr, size_t n) {
+static void* resize(void* ptr, size_t n) {
     if (ptr == nullptr) {
-        return malloc(n);
+        return alloc(n);
     }
 
     if (n == 0) {
-        free(ptr);
+        release(ptr);
         return nullptr;
     }
 
-    heap_block* current = (heap_block*)heap_base;
-    while (current != nullptr) {
-        if (current->base == ptr) {
-            if (current->length >= n) {
-                current->length = n;
-                return current->base;
-            }
+    if (is_run_pointer(ptr)) {
+        /* aligned objects and runs keep their size, growing past it moves to an ordinary block */
+        size_t usable = run_usable(ptr);
+        if (usable >= n) return ptr;
 
-            void* new_ptr = malloc(n);
-            if (new_ptr) {
-                memcpy(new_ptr, ptr, current->length);
-                free(ptr);
-                return new_ptr;
-            }
+        void* new_ptr = alloc(n);
+        if (new_ptr) {
+            memcpy(new_ptr, ptr, usable);
+            release(ptr);
+            return new_ptr;
+        }
+
+        Log::errf("Realloc: Failed to allocate %zu bytes", n);
+        return nullptr;
+    }
+
+    if (!is_heap_pointer(ptr)) {
+        Log::errf("Realloc: Failed to find memory block for %p", ptr);
+        return nullptr;
+    }
+
+    heap_block* b = header_of(ptr);
+    size_t size = block_for(n);
+    size_t usable = block_size(b) - HEADER_SIZE;
+
+    /* only the owning CPU may resize in place, anyone else's block just keeps its size or moves */
+    uint64_t flags = arch::x86_64::misc::irq_save();
+    heap_arena* a = local_arena();
+    if (size && owner_of(b) == a) {
+        heap_block* next = next_block(b);
+        if (block_size(b) < size && !block_used(next) && block_size(b) + block_size(next) >= size) {
+            list_remove(a, next);
+            set_size(b, block_size(b) + block_size(next), true);
+        }
 
-            Log::errf("Realloc: Failed to allocate %zu bytes", n);
-            return nullptr;
+        /* shrinking, or grown into the neighbour: whatever is past size goes back on the lists */
+        if (block_size(b) >= size) {
+            split(a, b, size);
+            arch::x86_64::misc::irq_restore(flags);
+            return ptr;
         }
-        current = current->next;
     }
+    arch::x86_64::misc::irq_restore(flags);
 
-    Log::errf("Realloc: Failed to find memory block for %p", ptr);
+    if (usable >= n) {
+        return ptr;
+    }
+
+    void* new_ptr = alloc(n);
+    if (new_ptr) {
+        memcpy(new_ptr, ptr, usable);
+        release(ptr);
+        return new_ptr;
+    }
+
+    Log::errf("Realloc: Failed to allocate %zu bytes", n);
     return nullptr;
 }
 
+/* the public entry points only add the profiler's bookkeeping, which compiles away without CONFIG_HEAP_PROFILER */
+void* malloc(size_t n) {
+    void* ptr = alloc(with_tag(n));
+#ifdef CONFIG_HEAP_PROFILER
+    profile_alloc(ptr, n, __builtin_return_address(0));
+#endif
+    return ptr;
+}
+
+void* malloc_aligned(size_t n, size_t alignment) {
+    void* ptr = alloc_aligned(with_tag(n), alignment);
+#ifdef CONFIG_HEAP_PROFILER
+    profile_alloc(ptr, n, __builtin_return_address(0));
+#endif
+    return ptr;
+}
+
+void* realloc(void* ptr, size_t n) {
+#ifdef CONFIG_HEAP_PROFILER
+    /* the tag moves with the end of the block, so take a copy before it's resized */
+    profile_tag old = {};
+    if (ptr && (is_heap_pointer(ptr) || is_run_pointer(ptr))) old = *tag_of(ptr);
+#endif
+    void* new_ptr = resize(ptr, n ? with_tag(n) : 0);
+#ifdef CONFIG_HEAP_PROFILER
+    if (new_ptr || n == 0) profile_forget(&old);
+    profile_alloc(new_ptr, n, __builtin_return_address(0));
+#endif
+    return new_ptr;
+}
+
 void* calloc(size_t n, size_t size) {
     size_t total_size = n * size;
 
-    void* ptr = malloc(total_size);
+    void* ptr = alloc(with_tag(total_size));
     if (ptr) {
         memset(ptr, 0, total_size);
     }
+#ifdef CONFIG_HEAP_PROFILER
+    profile_alloc(ptr, total_size, __builtin_return_address(0));
+#endif
 
     return ptr;
 }
 
 void free(void* ptr) {
-    if (ptr == nullptr) {
-        return;
+#ifdef CONFIG_HEAP_PROFILER
+    if (ptr && (is_heap_pointer(ptr) || is_run_pointer(ptr))) profile_forget(tag_of(ptr));
+#endif
+    release(ptr);
+}
+
+void stat_print() {
+    for (int i = 0; i < HEAP_MAX_ARENAS; i++) {
+        heap_arena* a = &arenas[i];
+        if (!a->num_regions && !a->num_run_slots) continue;
+
+        Log::infof("Heap: arena %d: %llu regions, %llu run slots, %llu bytes mapped, %llu remote frees",
+                   i, a->num_regions, a->num_run_slots, a->mapped_bytes, a->remote_free_count);
+#ifdef CONFIG_HEAP_STATS
+        uint64_t small_avg = a->small_stats.count ? a->small_stats.cycles / a->small_stats.count : 0;
+        uint64_t large_avg = a->large_stats.count ? a->large_stats.cycles / a->large_stats.count : 0;
+        Log::infof("Heap: arena %d: size class path: %llu allocations, avg %llu cycles, max %llu", i, a->small_stats.count, small_avg, a->small_stats.max_cycles);
+        Log::infof("Heap: arena %d: best-fit path: %llu allocations, avg %llu cycles, max %llu", i, a->large_stats.count, large_avg, a->large_stats.max_cycles);
+#endif
     }
+}
 
-    heap_block* current = (heap_block*)heap_base;
-    while (current != nullptr) {
-        if (current->base == ptr) {
-            current->is_free = true;
-            if (current->next && current->next->is_free) {
-                current->length += current->next->length + sizeof(heap_block);
-                current->next = current->next->next;
-                if (current->next) {
-                    current->next->prev = current;
-                }
-            }
+#ifdef CONFIG_HEAP_PROFILER
+void profile_dump() {
+    /* a snapshot so the lock isn't held across the symbol lookups and printing */
+    static profile_site sites[PROFILE_SITES];
+    uint64_t flags = arch::x86_64::misc::irq_save();
+    c_acquire_spinlock(&profile_lock);
+    memcpy(sites, profile_sites, sizeof(sites));
+    uint64_t untracked = profile_untracked;
+    c_release_spinlock(&profile_lock);
+    arch::x86_64::misc::irq_restore(flags);
 
-            if (current->prev && current->prev->is_free) {
-                current->prev->length += current->length + sizeof(heap_block);
-                current->prev->next = current->next;
-                if (current->next) {
-                    current->next->prev = current->prev;
-                }
-            }
+    printf("----==== HEAP PROFILE ====---- by live bytes, %llu allocations untracked\n\r", (unsigned long long)untracked);
 
-            return;
+    /* selection by live bytes, the table is small and this only runs on demand */
+    for (int shown = 0; shown < PROFILE_SITES; shown++) {
+        profile_site* top = nullptr;
+        for (int i = 0; i < PROFILE_SITES; i++) {
+            if (!sites[i].caller) continue;
+            if (!top || sites[i].live_bytes > top->live_bytes) top = &sites[i];
         }
-        current = current->next;
+        if (!top) break;
+
+        uint64_t offset = 0;
+        const char* func = find_symbol(top->caller, &offset);
+        printf("<%s+0x%llX> allocs %llu frees %llu live %llu peak %llu\n\r",
+               func, (unsigned long long)offset, (unsigned long long)top->allocs, (unsigned long long)top->frees,
+               (unsigned long long)top->live_bytes, (unsigned long long)top->peak_bytes);
+
+        printf("   ");
+        for (int b = 0; b < PROFILE_BUCKETS; b++) {
+            if (!top->histogram[b]) continue;
+            if (b == PROFILE_BUCKETS - 1) printf(" >%llu:%llu", 16ULL << (b - 1), (unsigned long long)top->histogram[b]);
+            else printf(" <=%llu:%llu", 16ULL << b, (unsigned long long)top->histogram[b]);
+        }
+        printf("\n\r");
+
+        top->caller = 0;
     }
+}
+#endif
 
-    Log::errf("Free: Attempted to free a block that wasn't allocated: %p", ptr);
+#ifdef CONFIG_HEAP_BENCHMARK
+#define BENCH_OBJECTS 1024
+#define BENCH_ROUNDS 64
+
+static void* bench_objects[HEAP_MAX_ARENAS][BENCH_OBJECTS];
+static uint32_t bench_joined = 0;
+static uint32_t bench_arrived = 0;
+static uint32_t bench_generation = 0;
+static uint64_t bench_local_cycles = 0;
+static uint64_t bench_remote_cycles = 0;
+
+static void bench_barrier(uint32_t participants) {
+    uint32_t generation = __atomic_load_n(&bench_generation, __ATOMIC_ACQUIRE);
+    if (__atomic_add_fetch(&bench_arrived, 1, __ATOMIC_ACQ_REL) == participants) {
+        __atomic_store_n(&bench_arrived, 0, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&bench_generation, 1, __ATOMIC_RELEASE);
+        return;
+    }
+    while (__atomic_load_n(&bench_generation, __ATOMIC_ACQUIRE) == generation) asm volatile("pause");
+}
+
+static inline size_t bench_size(uint64_t* seed) {
+    *seed ^= *seed << 13;
+    *seed ^= *seed >> 7;
+    *seed ^= *seed << 17;
+    return 16 + *seed % 1008;
+}
+
+void benchmark() {
+    uint32_t participants = 0;
+    cpu_registry* registry = arch::x86_64::apic::get_cpu_registry();
+    for (cpu_unit* cpu = registry ? registry->first_unit : nullptr; cpu; cpu = cpu->next_unit) {
+        if (cpu->online) participants++;
+    }
+    if (participants == 0) participants = 1;
+    if (participants > HEAP_MAX_ARENAS) participants = HEAP_MAX_ARENAS;
+
+    uint32_t rank = __atomic_fetch_add(&bench_joined, 1, __ATOMIC_ACQ_REL);
+    if (rank >= participants) return;
+
+    void** mine = bench_objects[rank];
+    void** neighbour = bench_objects[(rank + 1) % participants];
+    uint64_t seed = 0x9E3779B97F4A7C15ULL ^ rank;
+    uint64_t local_cycles = 0, remote_cycles = 0;
+
+    bench_barrier(participants);
+    for (int round = 0; round < BENCH_ROUNDS; round++) {
+        /* churn on the local arena: fill, free every other object, refill the holes */
+        uint64_t start = arch::x86_64::misc::rdtsc();
+        for (int i = 0; i < BENCH_OBJECTS; i++) mine[i] = malloc(bench_size(&seed));
+        for (int i = 0; i < BENCH_OBJECTS; i += 2) free(mine[i]);
+        for (int i = 0; i < BENCH_OBJECTS; i += 2) mine[i] = malloc(bench_size(&seed));
+        local_cycles += arch::x86_64::misc::rdtsc() - start;
+
+        /* then everyone frees the next CPU's objects, which the owner picks up on its next round */
+        bench_barrier(participants);
+        start = arch::x86_64::misc::rdtsc();
+        for (int i = 0; i < BENCH_OBJECTS; i++) free(neighbour[i]);
+        remote_cycles += arch::x86_64::misc::rdtsc() - start;
+        bench_barrier(participants);
+    }
+
+    uint64_t local_ops = (uint64_t)BENCH_ROUNDS * BENCH_OBJECTS * 2;
+    uint64_t remote_ops = (uint64_t)BENCH_ROUNDS * BENCH_OBJECTS;
+    Log::infof("Heap benchmark: CPU rank %u: %llu cycles per local op, %llu cycles per remote free",
+               rank, local_cycles / local_ops, remote_cycles / remote_ops);
+
+    __atomic_add_fetch(&bench_local_cycles, local_cycles, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&bench_remote_cycles, remote_cycles, __ATOMIC_RELAXED);
+    bench_barrier(participants);
+
+    if (rank == 0) {
+        Log::infof("Heap benchmark: %u CPUs, %llu cycles per local op, %llu cycles per remote free on average",
+                   participants, bench_local_cycles / (local_ops * participants), bench_remote_cycles / (remote_ops * participants));
+        stat_print();
+    }
 }
+#endif
 
 }
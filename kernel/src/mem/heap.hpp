@@ -10,6 +10,15 @@ namespace mem::heap {
 	void* calloc(size_t n, size_t size);
 
 	void free(void* ptr);
+
+	// logs each CPU arena's footprint and remote frees, and the per-path allocation latency with CONFIG_HEAP_STATS
+	void stat_print();
+
+	// prints allocation counts, live/peak bytes and a size histogram per call site, only built with CONFIG_HEAP_PROFILER
+	void profile_dump();
+
+	// every online CPU calls this at once, each churns its own arena then frees its neighbour's objects, only built with CONFIG_HEAP_BENCHMARK
+	void benchmark();
 }
 
 #endif /* HEAP_HPP */
\ No newline at end of file
@@ -7,6 +7,7 @@
 #include <mem/pmm.hpp>
 #include <mem/vmm.hpp>
 #include <mem/heap.hpp>
+#include <mem/slab.hpp>
 
 enum PageAttributes {
 	PAGE_PRESENT = 0x1,
@@ -14,6 +15,7 @@ enum PageAttributes {
 	PAGE_USER = 0x4,
 	PAGE_PCD = 0x10,
 	PAGE_SIZE_2MB = 0x80,
+	PAGE_NX = 0x8000000000000000ULL,
 };
 
 namespace mem {
@@ -32,6 +34,9 @@ namespace mem {
 		void free(void* ptr, size_t npages);
 		uint64_t mmap(void* paddr, void* vaddr, size_t npages, uint64_t attributes);
 		void munmap(void* vaddr, size_t npages);
+		uint64_t mmap_anonymous(void* vaddr, size_t npages, uint64_t attributes);
+		void munmap_anonymous(void* vaddr, size_t npages);
+		uint64_t translate(void* vaddr);
 
 		void* create_pagetable();
 		void destroy_pagetable(void* pml4_ptr);
@@ -46,19 +51,27 @@ namespace mem {
 		void initialise();
 
 		void* malloc(size_t n);
-		void* malloc_aligned(size_t n, size_t alignment); // preffered to use vmm::valloc instead
+		void* malloc_aligned(size_t n, size_t alignment); // no per-allocation header for alignments up to 64 KiB
 		void* realloc(void* ptr, size_t n);
 		void* calloc(size_t n, size_t size);
 
 		void free(void* ptr);
-
-		void* reserve_heap(size_t npages);
 	}
 
 	void* memset(void* dest, int value, size_t count);
 	void* memcpy(void* dest, const void* src, size_t count);	
 	void* memmove(void* dest, const void* src, size_t count);
 	int memcmp(const void* ptr1, const void* ptr2, size_t count);
+
+	// picks how the functions above copy and fill from CPUID, returns a name for the boot log
+	const char* select_string_ops();
+
+	// bypass the cache, for bulk writes nothing will read back soon
+	void* memset_nt(void* dest, int value, size_t count);
+	void* memcpy_nt(void* dest, const void* src, size_t count);
+
+	// times each strategy per size bucket against the old byte loop, only built with CONFIG_STRING_BENCHMARK
+	void benchmark_string_ops();
 }
 
 #endif
@@ -1,53 +1,182 @@
 #include <mem/mem.hpp>
 #include <cstddef>
 #include <cstdio>
+#include <arch/arch.hpp>
+#include <config.hpp>
+
+typedef uint64_t __attribute__((may_alias, aligned(1))) unaligned_u64;
+typedef uint32_t __attribute__((may_alias, aligned(1))) unaligned_u32;
+
+/* hides a value from the optimiser so it can't turn a loop back into a call to the function it's in */
+#define OPAQUE(x) asm ("" : "+r"(x))
+
+#define CPUID_7_EBX_ERMS (1 << 9)
+#define CPUID_7_EDX_FSRM (1 << 4)
+
+/* below this the qword loops beat the startup cost of a rep string instruction */
+#define REP_MIN 512
+
+/* below this the non-temporal variants aren't worth the sfence */
+#define NT_MIN 4096
+
+/*
+ * How bulk copies and fills are done, picked by mem::select_string_ops.
+ * The kernel doesn't save SSE state, so everything stays in general
+ * purpose registers; wide copies come from the rep string instructions.
+ */
+enum string_strategy {
+    STRING_QWORDS, /* qword loops, rep movsq/stosq for the bulk */
+    STRING_ERMS,   /* rep movsb/stosb for the bulk */
+    STRING_FSRM,   /* rep movsb for every copy past the overlapping moves */
+};
+
+static string_strategy strategy = STRING_QWORDS;
+
+/* up to 16 bytes with two possibly overlapping moves, everything is loaded before anything is stored */
+static inline void copy_small(uint8_t* d, const uint8_t* s, size_t count) {
+    if (count >= 8) {
+        uint64_t head = *(const unaligned_u64*)s, tail = *(const unaligned_u64*)(s + count - 8);
+        *(unaligned_u64*)d = head;
+        *(unaligned_u64*)(d + count - 8) = tail;
+    } else if (count >= 4) {
+        uint32_t head = *(const unaligned_u32*)s, tail = *(const unaligned_u32*)(s + count - 4);
+        *(unaligned_u32*)d = head;
+        *(unaligned_u32*)(d + count - 4) = tail;
+    } else if (count) {
+        uint8_t first = s[0], middle = s[count / 2], last = s[count - 1];
+        d[0] = first;
+        d[count / 2] = middle;
+        d[count - 1] = last;
+    }
+}
+
+/* forwards, so it's also right for memmove when dest is below src */
+static inline void copy_forward(uint8_t* d, const uint8_t* s, size_t count) {
+    if (count <= 16) {
+        copy_small(d, s, count);
+        return;
+    }
+
+    if (strategy == STRING_FSRM || (strategy == STRING_ERMS && count >= REP_MIN)) {
+        asm volatile ("rep movsb" : "+D"(d), "+S"(s), "+c"(count) :: "memory");
+        return;
+    }
+
+    uint64_t tail = *(const unaligned_u64*)(s + count - 8);
+    uint8_t* tail_dest = d + count - 8;
+
+    if (count >= REP_MIN) {
+        size_t qwords = count / 8;
+        asm volatile ("rep movsq" : "+D"(d), "+S"(s), "+c"(qwords) :: "memory");
+    } else {
+        for (size_t i = 0; i + 8 <= count; i += 8) {
+            OPAQUE(i);
+            *(unaligned_u64*)(d + i) = *(const unaligned_u64*)(s + i);
+        }
+    }
+
+    *(unaligned_u64*)tail_dest = tail;
+}
+
+/* for memmove when dest overlaps the end of src, the head is loaded first and stored last */
+static inline void copy_backward(uint8_t* d, const uint8_t* s, size_t count) {
+    if (count <= 16) {
+        copy_small(d, s, count);
+        return;
+    }
+
+    /* four qwords loaded before any is stored, the next four come from below what was just written */
+    uint64_t head = *(const unaligned_u64*)s;
+    size_t i = count;
+    for (; i >= 32; i -= 32) {
+        OPAQUE(i);
+        uint64_t w3 = *(const unaligned_u64*)(s + i - 8), w2 = *(const unaligned_u64*)(s + i - 16);
+        uint64_t w1 = *(const unaligned_u64*)(s + i - 24), w0 = *(const unaligned_u64*)(s + i - 32);
+        *(unaligned_u64*)(d + i - 8) = w3;
+        *(unaligned_u64*)(d + i - 16) = w2;
+        *(unaligned_u64*)(d + i - 24) = w1;
+        *(unaligned_u64*)(d + i - 32) = w0;
+    }
+    for (; i >= 8; i -= 8) *(unaligned_u64*)(d + i - 8) = *(const unaligned_u64*)(s + i - 8);
+    *(unaligned_u64*)d = head;
+}
 
 extern "C" {
 
 void* memset(void* dest, int value, size_t count) {
-    unsigned char* d = static_cast<unsigned char*>(dest);
-    for (size_t i = 0; i < count; i++) {
-        d[i] = static_cast<unsigned char>(value);
+    uint8_t* d = static_cast<uint8_t*>(dest);
+    uint64_t pattern = 0x0101010101010101ULL * static_cast<uint8_t>(value);
+
+    if (count < 8) {
+        for (size_t i = 0; i < count; i++) {
+            OPAQUE(i);
+            d[i] = static_cast<uint8_t>(value);
+        }
+        return dest;
+    }
+
+    if (strategy != STRING_QWORDS && count >= REP_MIN) {
+        asm volatile ("rep stosb" : "+D"(d), "+c"(count) : "a"(value) : "memory");
+        return dest;
+    }
+
+    *(unaligned_u64*)(d + count - 8) = pattern;
+
+    if (count >= REP_MIN) {
+        size_t qwords = count / 8;
+        asm volatile ("rep stosq" : "+D"(d), "+c"(qwords) : "a"(pattern) : "memory");
+    } else {
+        for (size_t i = 0; i + 8 <= count; i += 8) {
+            OPAQUE(i);
+            *(unaligned_u64*)(d + i) = pattern;
+        }
     }
+
     return dest;
 }
 
 void* memcpy(void* dest, const void* src, size_t count) {
-    const unsigned char* s = static_cast<const unsigned char*>(src);
-    unsigned char* d = static_cast<unsigned char*>(dest);
     if (src == nullptr) return nullptr;
     if (dest == nullptr) return nullptr;
-    for (size_t i = 0; i < count; i++) {
-        d[i] = s[i];
-    }
+    copy_forward(static_cast<uint8_t*>(dest), static_cast<const uint8_t*>(src), count);
     return dest;
 }
 
 void* memmove(void* dest, const void* src, size_t count) {
-    const unsigned char* s = static_cast<const unsigned char*>(src);
-    unsigned char* d = static_cast<unsigned char*>(dest);
+    const uint8_t* s = static_cast<const uint8_t*>(src);
+    uint8_t* d = static_cast<uint8_t*>(dest);
 
     if (d == s || count == 0)
         return dest;
 
-    if (d < s) {
-        for (size_t i = 0; i < count; i++) {
-            d[i] = s[i];
-        }
-    } else {
-        for (size_t i = count; i > 0; i--) {
-            d[i - 1] = s[i - 1];
-        }
-    }
+    if (d < s || d >= s + count) copy_forward(d, s, count);
+    else copy_backward(d, s, count);
 
     return dest;
 }
 
 int memcmp(const void* ptr1, const void* ptr2, size_t count) {
-    const unsigned char* a = static_cast<const unsigned char*>(ptr1);
-    const unsigned char* b = static_cast<const unsigned char*>(ptr2);
+    const uint8_t* a = static_cast<const uint8_t*>(ptr1);
+    const uint8_t* b = static_cast<const uint8_t*>(ptr2);
     if (!a || !b) return -1;
-    for (size_t i = 0; i < count; i++) {
+
+    /* 32 bytes per check while they're equal, the qword loop below finds where they differ */
+    size_t i = 0;
+    for (; i + 32 <= count; i += 32) {
+        const unaligned_u64* x = (const unaligned_u64*)(a + i);
+        const unaligned_u64* y = (const unaligned_u64*)(b + i);
+        if ((x[0] ^ y[0]) | (x[1] ^ y[1]) | (x[2] ^ y[2]) | (x[3] ^ y[3])) break;
+    }
+
+    for (; i + 8 <= count; i += 8) {
+        uint64_t x = *(const unaligned_u64*)(a + i), y = *(const unaligned_u64*)(b + i);
+        if (x != y) {
+            /* byte swapped the first differing byte is the most significant one */
+            return __builtin_bswap64(x) < __builtin_bswap64(y) ? -1 : 1;
+        }
+    }
+
+    for (; i < count; i++) {
         if (a[i] != b[i])
             return (a[i] < b[i]) ? -1 : 1;
     }
@@ -58,6 +187,21 @@ int memcmp(const void* ptr1, const void* ptr2, size_t count) {
 
 namespace mem {
 
+const char* select_string_ops() {
+    strategy = STRING_QWORDS;
+    if (arch::x86_64::misc::cpuid(0, 0).eax >= 7) {
+        arch::x86_64::misc::cpuid_ret ret = arch::x86_64::misc::cpuid(7, 0);
+        if (ret.edx & CPUID_7_EDX_FSRM) strategy = STRING_FSRM;
+        else if (ret.ebx & CPUID_7_EBX_ERMS) strategy = STRING_ERMS;
+    }
+
+    switch (strategy) {
+    case STRING_FSRM: return "fast short rep movsb";
+    case STRING_ERMS: return "rep movsb/stosb";
+    default: return "qword loops";
+    }
+}
+
 void* memset(void* dest, int value, size_t count) {
     return ::memset(dest, value, count);
 }
@@ -74,6 +218,142 @@ int memcmp(const void* ptr1, const void* ptr2, size_t count) {
     return ::memcmp(ptr1, ptr2, count);
 }
 
+void* memset_nt(void* dest, int value, size_t count) {
+    if (count < NT_MIN) return ::memset(dest, value, count);
+
+    /* movnti only takes whole qwords, the ragged ends go through the cache */
+    uint8_t* d = static_cast<uint8_t*>(dest);
+    uint8_t* end = d + count;
+    uint8_t* first = reinterpret_cast<uint8_t*>((reinterpret_cast<uint64_t>(d) + 7) & ~7ULL);
+    uint8_t* last = reinterpret_cast<uint8_t*>(reinterpret_cast<uint64_t>(end) & ~7ULL);
+    uint64_t pattern = 0x0101010101010101ULL * static_cast<uint8_t>(value);
+
+    ::memset(d, value, first - d);
+    for (uint64_t* p = reinterpret_cast<uint64_t*>(first); p < reinterpret_cast<uint64_t*>(last); p++) {
+        asm volatile ("movnti %1, %0" : "=m"(*p) : "r"(pattern));
+    }
+    ::memset(last, value, end - last);
+
+    asm volatile ("sfence" ::: "memory");
+    return dest;
+}
+
+void* memcpy_nt(void* dest, const void* src, size_t count) {
+    if (count < NT_MIN) return ::memcpy(dest, src, count);
+
+    uint8_t* d = static_cast<uint8_t*>(dest);
+    const uint8_t* s = static_cast<const uint8_t*>(src);
+    size_t head = ((8 - (reinterpret_cast<uint64_t>(d) & 7)) & 7);
+
+    ::memcpy(d, s, head);
+    size_t i = head;
+    for (; i + 8 <= count; i += 8) {
+        asm volatile ("movnti %1, %0" : "=m"(*reinterpret_cast<uint64_t*>(d + i)) : "r"(*(const unaligned_u64*)(s + i)));
+    }
+    ::memcpy(d + i, s + i, count - i);
+
+    asm volatile ("sfence" ::: "memory");
+    return dest;
+}
+
+#ifdef CONFIG_STRING_BENCHMARK
+#define BENCH_BUFFER (1ULL << 20)
+#define BENCH_BYTES (64ULL << 20)
+
+/* what all four used to be */
+static void legacy_copy(uint8_t* d, const uint8_t* s, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        OPAQUE(i);
+        d[i] = s[i];
+    }
+}
+
+struct bench_result {
+    uint64_t copy, move, set, compare;
+};
+
+/* enough calls to move BENCH_BYTES, within limits at either end */
+static uint64_t bench_calls(size_t size) {
+    uint64_t calls = BENCH_BYTES / size;
+    if (calls < 64) return 64;
+    if (calls > (1 << 20)) return 1 << 20;
+    return calls;
+}
+
+/* cycles per call for the strategy that's currently selected */
+static bench_result bench_bucket(uint8_t* a, uint8_t* b, size_t size) {
+    uint64_t calls = bench_calls(size);
+    volatile int sink = 0;
+    bench_result r;
+
+    uint64_t start = arch::x86_64::misc::rdtsc();
+    for (uint64_t i = 0; i < calls; i++) ::memcpy(a, b, size);
+    r.copy = (arch::x86_64::misc::rdtsc() - start) / calls;
+
+    start = arch::x86_64::misc::rdtsc();
+    for (uint64_t i = 0; i < calls; i++) ::memmove(a + 8, a, size);
+    r.move = (arch::x86_64::misc::rdtsc() - start) / calls;
+
+    start = arch::x86_64::misc::rdtsc();
+    for (uint64_t i = 0; i < calls; i++) ::memset(a, (int)i, size);
+    r.set = (arch::x86_64::misc::rdtsc() - start) / calls;
+
+    ::memcpy(b, a, size);
+    start = arch::x86_64::misc::rdtsc();
+    for (uint64_t i = 0; i < calls; i++) sink = ::memcmp(a, b, size);
+    r.compare = (arch::x86_64::misc::rdtsc() - start) / calls;
+    (void)sink;
+    return r;
+}
+
+void benchmark_string_ops() {
+    uint8_t* a = static_cast<uint8_t*>(mem::vmm::valloc((BENCH_BUFFER + 0x1000) / 0x1000));
+    uint8_t* b = static_cast<uint8_t*>(mem::vmm::valloc(BENCH_BUFFER / 0x1000));
+    if (!a || !b) {
+        Log::errf("String ops: Not enough memory for the benchmark");
+        if (a) mem::vmm::free(a, (BENCH_BUFFER + 0x1000) / 0x1000);
+        if (b) mem::vmm::free(b, BENCH_BUFFER / 0x1000);
+        return;
+    }
+
+    static const size_t sizes[] = { 16, 64, 256, 1024, 4096, 65536, BENCH_BUFFER };
+    static const char* const names[] = { "qword loops", "rep movsb/stosb", "fast short rep movsb" };
+    string_strategy selected = strategy;
+
+    for (size_t size : sizes) {
+        uint64_t calls = bench_calls(size);
+
+        uint64_t start = arch::x86_64::misc::rdtsc();
+        for (uint64_t i = 0; i < calls; i++) legacy_copy(a, b, size);
+        uint64_t legacy = (arch::x86_64::misc::rdtsc() - start) / calls;
+        Log::infof("String ops: %llu bytes: byte loop copy %llu cycles", size, legacy);
+
+        /* every strategy this CPU can run, the one picked at boot last */
+        for (int s = STRING_QWORDS; s <= selected; s++) {
+            strategy = static_cast<string_strategy>(s);
+            bench_result r = bench_bucket(a, b, size);
+            Log::infof("String ops: %llu bytes: %s: copy %llu move %llu set %llu compare %llu cycles",
+                       size, names[s], r.copy, r.move, r.set, r.compare);
+        }
+
+        if (size >= NT_MIN) {
+            start = arch::x86_64::misc::rdtsc();
+            for (uint64_t i = 0; i < calls; i++) memcpy_nt(a, b, size);
+            uint64_t copy_nt = (arch::x86_64::misc::rdtsc() - start) / calls;
+
+            start = arch::x86_64::misc::rdtsc();
+            for (uint64_t i = 0; i < calls; i++) memset_nt(a, 0, size);
+            uint64_t set_nt = (arch::x86_64::misc::rdtsc() - start) / calls;
+            Log::infof("String ops: %llu bytes: non-temporal: copy %llu set %llu cycles", size, copy_nt, set_nt);
+        }
+    }
+
+    strategy = selected;
+    mem::vmm::free(a, (BENCH_BUFFER + 0x1000) / 0x1000);
+    mem::vmm::free(b, BENCH_BUFFER / 0x1000);
+}
+#endif
+
 }
 
 #include <panic.hpp>
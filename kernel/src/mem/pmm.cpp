@@ -2,6 +2,13 @@
 #include <cstdio>
 #include <limine.h>
 #include <cstring>
+#include <arch/arch.hpp>
+#include <arch/x86_64/apic/apic.hpp>
+#include <config.hpp>
+
+extern "C" {
+#include <proc/spinlocks.h>
+}
 
 __attribute__((section(".limine_requests")))
 volatile limine_memmap_request memmap_request = {
@@ -14,19 +21,80 @@ volatile limine_memmap_request memmap_request = {
 #define MAX_SEGMENTS 8
 #define MIN_ALLOC_ADDR 0x100000
 
+/* orders 0..PMM_MAX_ORDER-1, the largest block is 2^(PMM_MAX_ORDER-1) pages (4 GiB) */
+#define PMM_MAX_ORDER 21
+
+/* per-CPU single page caches, refilled from and drained to the buddy in batches */
+#define PCP_MAX_CPUS 64
+#define PCP_CAPACITY 64
+#define PCP_BATCH 32
+
+/* frames zeroed ahead of time by the idle loop, handed out by palloc_zeroed */
+#define ZERO_POOL_CAPACITY 256
+
+/* palloc_zeroed runs from this size up are zeroed with non-temporal stores */
+#define ZERO_NT_PAGES 512
+
+/*
+ * Two-level bitmap: bit i of words[] is set when block i is free, bit j of
+ * summary[] is set when words[j] is non-zero. A search walks the summary with
+ * ctz (bsf/tzcnt) starting at the hint, so it touches a couple of cache lines
+ * instead of the whole map.
+ */
+struct summary_bitmap {
+	uint64_t* words;
+	uint64_t* summary;
+	uint64_t nwords;
+	uint64_t hint;
+};
+
 struct segment {
 	uint64_t base;
 	uint64_t length;
-	bool is_bitmap;
+	uint64_t first_pfn;
+	uint64_t end_pfn;
 	uint64_t remaining_bytes;
 
+	/* one map per order, indexed by (pfn >> order) - (first_pfn >> order) */
+	summary_bitmap free_map[PMM_MAX_ORDER];
+	uint64_t free_blocks[PMM_MAX_ORDER];
+
+	/* extra owners of each frame, 0 means the frame has a single owner */
+	uint16_t* shares;
+	/* set for each frame sitting in some CPU's page cache, which the buddy maps count as used.
+	   A byte each so CPUs caching neighbouring frames never share a read-modify-write */
+	volatile uint8_t* cached;
+
 	bool bad_seg;
 };
 
+/* only ever touched by its own CPU with interrupts off, so it needs no lock */
+struct pmm_cpu_cache {
+	uint64_t count;
+	uint64_t frames[PCP_CAPACITY];
+
+	uint64_t alloc_count;
+	uint64_t free_count;
+};
+
 static segment segments[MAX_SEGMENTS];
-static uint8_t* bitmap = nullptr;
-static uint64_t bitmap_size = 0;
+static int num_segments = 0;
 static uint64_t total_pages = 0;
+static pmm_cpu_cache cpu_caches[PCP_MAX_CPUS];
+
+static uint64_t zero_pool[ZERO_POOL_CAPACITY];
+static uint64_t zero_pool_count = 0;
+static uint64_t zero_pool_pending = 0;
+static uint64_t zero_pool_hits = 0;
+static uint64_t zero_pool_misses = 0;
+
+/* total extra owners across all segments, lets free skip the share lookup when nothing is shared */
+static uint64_t shared_frames = 0;
+
+static spinlock pmm_lock = {
+	"PMM",
+	0
+};
 
 uint64_t total_addrspace;
 uint64_t total_mem;
@@ -37,70 +105,398 @@ uint64_t failed_allocation_count;
 uint64_t free_count;
 uint64_t failed_free_count;
 
-inline void bitmap_set(uint64_t index) { bitmap[index / 8] |= (1 << (index % 8)); }
-inline void bitmap_clear(uint64_t index) { bitmap[index / 8] &= ~(1 << (index % 8)); }
-inline bool bitmap_test(uint64_t index) { return bitmap[index / 8] & (1 << (index % 8)); }
+static inline bool bitmap_test(summary_bitmap* map, uint64_t index) {
+	return map->words[index / 64] & (1ULL << (index % 64));
+}
+
+static inline void bitmap_set(summary_bitmap* map, uint64_t index) {
+	uint64_t word = index / 64;
+	map->words[word] |= 1ULL << (index % 64);
+	map->summary[word / 64] |= 1ULL << (word % 64);
+	if (word / 64 < map->hint) map->hint = word / 64;
+}
+
+static inline void bitmap_clear(summary_bitmap* map, uint64_t index) {
+	uint64_t word = index / 64;
+	map->words[word] &= ~(1ULL << (index % 64));
+	if (map->words[word] == 0)
+		map->summary[word / 64] &= ~(1ULL << (word % 64));
+}
+
+/* returns the lowest set bit, or UINT64_MAX when the map is empty */
+static uint64_t bitmap_find_first(summary_bitmap* map) {
+	uint64_t nsummary = (map->nwords + 63) / 64;
+
+	for (uint64_t s = map->hint; s < nsummary; s++) {
+		if (!map->summary[s]) continue;
+
+		map->hint = s;
+		uint64_t word = s * 64 + __builtin_ctzll(map->summary[s]);
+		return word * 64 + __builtin_ctzll(map->words[word]);
+	}
+
+	map->hint = nsummary;
+	return UINT64_MAX;
+}
+
+static inline uint64_t block_index(segment* seg, uint64_t pfn, int order) {
+	return (pfn >> order) - (seg->first_pfn >> order);
+}
+
+static inline int order_for(uint64_t npages) {
+	int order = 0;
+	while ((1ULL << order) < npages) order++;
+	return order;
+}
+
+static segment* segment_of(uint64_t pfn) {
+	for (int i = 0; i < num_segments; i++) {
+		if (pfn >= segments[i].first_pfn && pfn < segments[i].end_pfn)
+			return &segments[i];
+	}
+	return nullptr;
+}
+
+static inline bool block_is_free(segment* seg, uint64_t pfn, int order) {
+	return bitmap_test(&seg->free_map[order], block_index(seg, pfn, order));
+}
+
+static inline void mark_free(segment* seg, uint64_t pfn, int order) {
+	bitmap_set(&seg->free_map[order], block_index(seg, pfn, order));
+	seg->free_blocks[order]++;
+}
+
+static inline void mark_used(segment* seg, uint64_t pfn, int order) {
+	bitmap_clear(&seg->free_map[order], block_index(seg, pfn, order));
+	seg->free_blocks[order]--;
+}
+
+/* returns a block of 2^order pages to the free maps, merging it with its buddies */
+static void free_block_order(segment* seg, uint64_t pfn, int order) {
+	while (order < PMM_MAX_ORDER - 1) {
+		uint64_t buddy = pfn ^ (1ULL << order);
+		if (buddy < seg->first_pfn || buddy + (1ULL << order) > seg->end_pfn) break;
+		if (!block_is_free(seg, buddy, order)) break;
 
-static void prepare_bitmap(uint64_t mem) {
-	bitmap_size = mem / PAGE_SIZE / 8;
+		mark_used(seg, buddy, order);
+
+		if (buddy < pfn) pfn = buddy;
+		order++;
+	}
+
+	mark_free(seg, pfn, order);
+}
+
+/* splits an arbitrary page run into the largest naturally aligned blocks it contains */
+static void free_range(segment* seg, uint64_t pfn, uint64_t npages) {
+	while (npages > 0) {
+		int order = 0;
+		while (order < PMM_MAX_ORDER - 1 &&
+			   (pfn & ((2ULL << order) - 1)) == 0 &&
+			   (2ULL << order) <= npages) {
+			order++;
+		}
+
+		free_block_order(seg, pfn, order);
+		pfn += 1ULL << order;
+		npages -= 1ULL << order;
+	}
+}
+
+static bool is_page_free(segment* seg, uint64_t pfn) {
+	for (int order = 0; order < PMM_MAX_ORDER; order++) {
+		uint64_t head = pfn & ~((1ULL << order) - 1);
+		if (head < seg->first_pfn) break;
+		if (seg->free_blocks[order] && block_is_free(seg, head, order)) return true;
+	}
+	return false;
+}
+
+static uint64_t map_words(segment* seg, int order) {
+	if (seg->end_pfn <= seg->first_pfn) return 0;
+	uint64_t blocks = ((seg->end_pfn - 1) >> order) - (seg->first_pfn >> order) + 1;
+	return (blocks + 63) / 64;
+}
+
+static uint64_t metadata_words(segment* seg) {
+	uint64_t n = 0;
+	for (int order = 0; order < PMM_MAX_ORDER; order++) {
+		uint64_t words = map_words(seg, order);
+		n += words + (words + 63) / 64;
+	}
+	n += (seg->end_pfn - seg->first_pfn + 3) / 4;
+	n += (seg->end_pfn - seg->first_pfn + 7) / 8;
+	return n;
+}
+
+static void prepare_free_maps() {
+	uint64_t meta_words = 0;
+	for (int i = 0; i < num_segments; i++) meta_words += metadata_words(&segments[i]);
+
+	uint64_t meta_size = meta_words * sizeof(uint64_t);
+	uint64_t meta_pages = (meta_size + (PAGE_SIZE - 1)) / PAGE_SIZE;
 
 	segment* best = nullptr;
-	for (int i = 0; i < MAX_SEGMENTS; i++) {
-		if (!segments[i].is_bitmap && segments[i].length >= bitmap_size) {
+	for (int i = 0; i < num_segments; i++) {
+		if (segments[i].length / PAGE_SIZE > meta_pages) {
 			if (!best || segments[i].length < best->length)
 				best = &segments[i];
 		}
 	}
 
 	if (!best) {
-		Log::errf("PMM: No suitable segment for bitmap");
+		Log::errf("PMM: No suitable segment for the free maps");
 		return;
 	}
 
-	best->is_bitmap = true;
-	bitmap = reinterpret_cast<uint8_t*>(best->base);
-	mem::memset(bitmap, 0, bitmap_size);
+	uint64_t* meta = reinterpret_cast<uint64_t*>(mem::vmm::pa_to_va(best->base));
+	mem::memset(meta, 0, meta_pages * PAGE_SIZE);
+
+	/* the maps are carved off the front of the segment and never freed */
+	best->base += meta_pages * PAGE_SIZE;
+	best->length -= meta_pages * PAGE_SIZE;
+	best->first_pfn += meta_pages;
+	used_mem += meta_pages * PAGE_SIZE;
+	free_mem -= meta_pages * PAGE_SIZE;
+
+	for (int i = 0; i < num_segments; i++) {
+		for (int order = 0; order < PMM_MAX_ORDER; order++) {
+			summary_bitmap* map = &segments[i].free_map[order];
+			map->nwords = map_words(&segments[i], order);
+			map->words = meta;
+			meta += map->nwords;
+			map->summary = meta;
+			meta += (map->nwords + 63) / 64;
+			map->hint = 0;
+
+			segments[i].free_blocks[order] = 0;
+		}
 
-	uint64_t bitmap_pages = (bitmap_size + (PAGE_SIZE - 1)) / PAGE_SIZE;
-	uint64_t page_offset = 0;
+		segments[i].shares = reinterpret_cast<uint16_t*>(meta);
+		meta += (segments[i].end_pfn - segments[i].first_pfn + 3) / 4;
+		segments[i].cached = reinterpret_cast<uint8_t*>(meta);
+		meta += (segments[i].end_pfn - segments[i].first_pfn + 7) / 8;
+	}
+}
+
+static void* buddy_alloc(size_t npages) {
+	int order = order_for(npages);
+	if (order >= PMM_MAX_ORDER) return nullptr;
 
-	for (int i = 0; i < MAX_SEGMENTS; i++) {
-		if (&segments[i] == best) {
-			for (uint64_t j = 0; j < bitmap_pages; j++) {
-				bitmap_set(page_offset + j);
+	segment* seg = nullptr;
+	int found = order;
+	for (; found < PMM_MAX_ORDER && !seg; found++) {
+		for (int i = 0; i < num_segments; i++) {
+			if (!segments[i].bad_seg && segments[i].free_blocks[found]) {
+				seg = &segments[i];
+				break;
 			}
-			best->remaining_bytes -= bitmap_pages * PAGE_SIZE;
-			used_mem += bitmap_pages * PAGE_SIZE;
-			free_mem -= bitmap_pages * PAGE_SIZE;
-			break;
 		}
-		if (!segments[i].is_bitmap && segments[i].length > 0) {
-			page_offset += segments[i].length / PAGE_SIZE;
+	}
+	found--;
+
+	if (!seg) {
+		return nullptr;
+	}
+
+	uint64_t index = bitmap_find_first(&seg->free_map[found]);
+	uint64_t pfn = (index + (seg->first_pfn >> found)) << found;
+	mark_used(seg, pfn, found);
+
+	/* hand the upper halves back until the block is just big enough */
+	while (found > order) {
+		found--;
+		mark_free(seg, pfn + (1ULL << found), found);
+	}
+
+	/* a non power-of-two request gives its unused tail back */
+	if ((1ULL << order) > npages) {
+		free_range(seg, pfn + npages, (1ULL << order) - npages);
+	}
+
+	uint64_t alloc_bytes = npages * PAGE_SIZE;
+	used_mem += alloc_bytes;
+	free_mem -= alloc_bytes;
+	seg->remaining_bytes -= alloc_bytes;
+
+	return reinterpret_cast<void*>(pfn * PAGE_SIZE);
+}
+
+static bool buddy_free(void* ptr, size_t npages) {
+	uint64_t addr = reinterpret_cast<uint64_t>(ptr);
+
+	if (addr < MIN_ALLOC_ADDR) {
+		Log::errf("PMM: Attempt to free memory below 1 MiB (%p)", ptr);
+		return false;
+	}
+
+	uint64_t pfn = addr / PAGE_SIZE;
+	segment* seg = segment_of(pfn);
+
+	if (!seg || seg->bad_seg || pfn + npages > seg->end_pfn) {
+		Log::errf("PMM: Free failed, pointer %p outside segments", ptr);
+		return false;
+	}
+
+	if (is_page_free(seg, pfn)) {
+		Log::warnf("PMM: Attempt to free already-free page at %p", ptr);
+		return false;
+	}
+
+	free_range(seg, pfn, npages);
+
+	uint64_t freed = npages * PAGE_SIZE;
+	if (used_mem >= freed) {
+		used_mem -= freed;
+	} else {
+		used_mem = 0;
+	}
+
+	free_mem += freed;
+	seg->remaining_bytes += freed;
+	return true;
+}
+
+/* called with pmm_lock held, drops one owner from each shared frame and frees the runs nobody else holds */
+static bool release_shared(void* ptr, size_t npages) {
+	uint64_t pfn = reinterpret_cast<uint64_t>(ptr) / PAGE_SIZE;
+	segment* seg = segment_of(pfn);
+	if (!seg || !seg->shares || pfn + npages > seg->end_pfn)
+		return buddy_free(ptr, npages);
+
+	bool ok = true;
+	uint64_t run = 0;
+	for (uint64_t i = 0; i < npages; i++) {
+		uint16_t* owners = &seg->shares[pfn + i - seg->first_pfn];
+		if (*owners == 0) {
+			run++;
+			continue;
 		}
+
+		(*owners)--;
+		shared_frames--;
+		if (run) ok &= buddy_free(reinterpret_cast<void*>((pfn + i - run) * PAGE_SIZE), run);
+		run = 0;
+	}
+
+	if (run) ok &= buddy_free(reinterpret_cast<void*>((pfn + npages - run) * PAGE_SIZE), run);
+	return ok;
+}
+
+static pmm_cpu_cache* local_cache() {
+	cpu_unit* cpu = arch::x86_64::apic::get_current_cpu();
+	if (!cpu || cpu->registry_id >= PCP_MAX_CPUS) return nullptr;
+
+	if (!cpu->page_cache) cpu->page_cache = &cpu_caches[cpu->registry_id];
+	return cpu->page_cache;
+}
+
+/* sets or clears the frame's cached mark, returns what it was before */
+static bool mark_cached(segment* seg, uint64_t pfn, bool cached) {
+	if (!seg || !seg->cached) return !cached;
+
+	volatile uint8_t* mark = &seg->cached[pfn - seg->first_pfn];
+	bool was = *mark;
+	*mark = cached;
+	return was;
+}
+
+static void mark_cached(uint64_t addr, bool cached) {
+	uint64_t pfn = addr / PAGE_SIZE;
+	mark_cached(segment_of(pfn), pfn, cached);
+}
+
+static void cache_refill(pmm_cpu_cache* cache) {
+	c_acquire_spinlock(&pmm_lock);
+	while (cache->count < PCP_BATCH) {
+		void* page = buddy_alloc(1);
+		if (!page) break;
+		mark_cached(reinterpret_cast<uint64_t>(page), true);
+		cache->frames[cache->count++] = reinterpret_cast<uint64_t>(page);
+	}
+	c_release_spinlock(&pmm_lock);
+}
+
+static void cache_drain(pmm_cpu_cache* cache, uint64_t keep) {
+	c_acquire_spinlock(&pmm_lock);
+	while (cache->count > keep) {
+		uint64_t frame = cache->frames[--cache->count];
+		mark_cached(frame, false);
+		buddy_free(reinterpret_cast<void*>(frame), 1);
+	}
+	c_release_spinlock(&pmm_lock);
+}
+
+static uint64_t cached_pages() {
+	uint64_t n = 0;
+	for (int i = 0; i < PCP_MAX_CPUS; i++) n += cpu_caches[i].count;
+	return n;
+}
+
+/* zeroes a frame with non-temporal stores so the idle loop doesn't evict anything useful */
+static void zero_frame_nt(uint64_t pa) {
+	mem::memset_nt(reinterpret_cast<void*>(mem::vmm::pa_to_va(pa)), 0, PAGE_SIZE);
+}
+
+#define MAX_RECLAIMERS 4
+
+static size_t (*reclaimers[MAX_RECLAIMERS])();
+static int reclaimer_count = 0;
+static bool reclaiming = false;
+
+/* asks whoever is sitting on free frames to give them back, called without pmm_lock */
+static size_t run_reclaimers() {
+	/* one CPU at a time, the others just fail their allocation as they would have anyway */
+	if (__atomic_exchange_n(&reclaiming, true, __ATOMIC_ACQUIRE)) return 0;
+
+	size_t pages = 0;
+	for (int i = 0; i < reclaimer_count; i++) pages += reclaimers[i]();
+
+	__atomic_store_n(&reclaiming, false, __ATOMIC_RELEASE);
+	return pages;
+}
+
+/* called with pmm_lock held */
+static void zero_pool_release() {
+	while (zero_pool_count > 0) {
+		buddy_free(reinterpret_cast<void*>(zero_pool[--zero_pool_count]), 1);
 	}
 }
 
 namespace mem::pmm {
 
-uint64_t stat_free() { return free_mem; }
-uint64_t stat_used() { return used_mem; }
+uint64_t stat_free() { return free_mem + (cached_pages() + zero_pool_count) * PAGE_SIZE; }
+uint64_t stat_used() { return used_mem - (cached_pages() + zero_pool_count) * PAGE_SIZE; }
 uint64_t stat_total_mem() { return total_mem; }
 
 uint64_t stat_get_status(uint8_t type) {
+	uint64_t cache_allocs = 0, cache_frees = 0;
+	for (int i = 0; i < PCP_MAX_CPUS; i++) {
+		cache_allocs += cpu_caches[i].alloc_count;
+		cache_frees += cpu_caches[i].free_count;
+	}
+
 	switch (type) {
 		case 0: return total_mem;
-		case 1: return used_mem;
-		case 2: return free_mem;
-		case 3: return allocation_count;
+		case 1: return stat_used();
+		case 2: return stat_free();
+		case 3: return allocation_count + cache_allocs;
 		case 4: return failed_allocation_count;
-		case 5: return free_count;
+		case 5: return free_count + cache_frees;
 		case 6: return failed_free_count;
 		default: return 0xBADBADBADBADBAD0;
 	}
 }
 
 void stat_print() {
-	Log::infof("PMM: total=%llu used=%llu free=%llu", total_mem, used_mem, free_mem);
+	Log::infof("PMM: total=%llu used=%llu free=%llu cached=%llu", total_mem, stat_used(), stat_free(), cached_pages());
+	Log::infof("PMM: zeroed=%llu hits=%llu misses=%llu", zero_pool_count, zero_pool_hits, zero_pool_misses);
+	for (int order = 0; order < PMM_MAX_ORDER; order++) {
+		uint64_t blocks = 0;
+		for (int i = 0; i < num_segments; i++) blocks += segments[i].free_blocks[order];
+		if (blocks)
+			Log::infof("PMM: order %d: %llu free blocks", order, blocks);
+	}
 }
 
 void initialise() {
@@ -113,14 +509,14 @@ void initialise() {
 	allocation_count = failed_allocation_count = 0;
 	free_count = failed_free_count = 0;
 	total_addrspace = 0;
-
-	int created_segments = 0;
+	total_pages = 0;
+	num_segments = 0;
 
 	for (uint64_t i = 0; i < memmap_request.response->entry_count; i++) {
 		limine_memmap_entry* e = memmap_request.response->entries[i];
 		total_addrspace += e->length;
 
-		if (e->type != LIMINE_MEMMAP_USABLE || created_segments >= MAX_SEGMENTS)
+		if (e->type != LIMINE_MEMMAP_USABLE || num_segments >= MAX_SEGMENTS)
 			continue;
 
 		uint64_t seg_base = e->base;
@@ -147,160 +543,302 @@ void initialise() {
 
 		if (seg_len == 0) continue;
 
-		segment* s = &segments[created_segments++];
+		segment* s = &segments[num_segments++];
 		s->base = seg_base;
 		s->length = seg_len;
-		s->is_bitmap = false;
+		s->first_pfn = seg_base / PAGE_SIZE;
+		s->end_pfn = (seg_base + seg_len) / PAGE_SIZE;
+		s->free_map[0].words = nullptr;
 		s->remaining_bytes = seg_len;
+		s->bad_seg = false;
 
 		total_mem += seg_len;
+		total_pages += seg_len / PAGE_SIZE;
 	}
 
 	free_mem = total_mem;
-	prepare_bitmap(total_mem);
-	total_pages = total_mem / PAGE_SIZE;
+	prepare_free_maps();
 
-	for (int i = 0; i < created_segments; i++) {
+	for (int i = 0; i < num_segments; i++) {
 		segment* seg = &segments[i];
-
-		if (seg->base < 0x100000) {
-			//seg->bad_seg = true;
-			seg->base = 0x100000; // i think that saves memory
+		if (!seg->free_map[0].words) {
+			seg->bad_seg = true;
+			continue;
 		}
+
+		seg->remaining_bytes = seg->length;
+		free_range(seg, seg->first_pfn, seg->end_pfn - seg->first_pfn);
 	}
 }
 
+
 void* palloc(size_t npages) {
-	if (!bitmap || npages == 0) {
+	if (npages == 0) {
 		failed_allocation_count++;
 		return nullptr;
 	}
 
-	uint64_t needed = npages;
-	uint64_t page_offset = 0;
-
-	for (int segid = 0; segid < MAX_SEGMENTS; segid++) {
-		segment* seg = &segments[segid];
-		if (seg->bad_seg) continue;
-		
-		if (seg->length == 0 || seg->is_bitmap) {
-			if (!seg->is_bitmap && seg->length > 0) {
-				page_offset += seg->length / PAGE_SIZE;
+	uint64_t flags = arch::x86_64::misc::irq_save();
+
+	if (npages == 1) {
+		pmm_cpu_cache* cache = local_cache();
+		if (cache) {
+			if (cache->count == 0) cache_refill(cache);
+			if (cache->count > 0) {
+				cache->alloc_count++;
+				void* page = reinterpret_cast<void*>(cache->frames[--cache->count]);
+				mark_cached(reinterpret_cast<uint64_t>(page), false);
+				arch::x86_64::misc::irq_restore(flags);
+				return page;
 			}
-			continue;
 		}
+	}
 
-		uint64_t seg_pages = seg->length / PAGE_SIZE;
-		uint64_t found = 0;
-		uint64_t start = 0;
-
-		for (uint64_t j = 0; j < seg_pages; j++) {
-			uint64_t global_index = page_offset + j;
-
-			if (!bitmap_test(global_index)) {
-				if (found == 0) start = j;
-				found++;
-				if (found == needed) {
-					uint64_t start_global = page_offset + start;
-					for (uint64_t k = 0; k < needed; k++) {
-						bitmap_set(start_global + k);
-					}
-
-					uint64_t alloc_bytes = needed * PAGE_SIZE;
-					used_mem += alloc_bytes;
-					free_mem -= alloc_bytes;
-					seg->remaining_bytes -= alloc_bytes;
-					allocation_count++;
-
-					uint64_t phys_addr = seg->base + start * PAGE_SIZE;
-					return reinterpret_cast<void*>(phys_addr);
-				}
-			} else {
-				found = 0;
-			}
-		}
+	c_acquire_spinlock(&pmm_lock);
+	void* ptr = buddy_alloc(npages);
+	if (ptr) allocation_count++;
+	c_release_spinlock(&pmm_lock);
+
+	if (!ptr) {
+		/* frames parked in this CPU's cache or the zero pool may be what a larger run needs */
+		pmm_cpu_cache* cache = local_cache();
+		if (cache && cache->count > 0) cache_drain(cache, 0);
+
+		c_acquire_spinlock(&pmm_lock);
+		zero_pool_release();
+		ptr = buddy_alloc(npages);
+		if (ptr) allocation_count++;
+		c_release_spinlock(&pmm_lock);
+	}
 
-		page_offset += seg_pages;
+	if (!ptr && run_reclaimers() > 0) {
+		c_acquire_spinlock(&pmm_lock);
+		ptr = buddy_alloc(npages);
+		if (ptr) allocation_count++;
+		c_release_spinlock(&pmm_lock);
 	}
 
-	failed_allocation_count++;
-	return nullptr;
+	if (!ptr) failed_allocation_count++;
+
+	arch::x86_64::misc::irq_restore(flags);
+	return ptr;
 }
 
 void free(void* ptr, size_t npages) {
-	if (!bitmap || !ptr || npages == 0) {
+	if (!ptr || npages == 0) {
 		failed_free_count++;
 		return;
 	}
 
+	uint64_t flags = arch::x86_64::misc::irq_save();
+
 	uint64_t addr = reinterpret_cast<uint64_t>(ptr);
+	uint64_t pfn = addr / PAGE_SIZE;
+	segment* seg = addr >= MIN_ALLOC_ADDR ? segment_of(pfn) : nullptr;
+
+	/* only a frame someone else still shares has to go through the share counts under the lock */
+	if (npages == 1 && seg && !(seg->shares && seg->shares[pfn - seg->first_pfn])) {
+		pmm_cpu_cache* cache = local_cache();
+		if (cache) {
+			/* already in a cache, or free in the buddy maps, whose bits nobody flips for a frame we hold */
+			uint64_t frame = addr & ~(uint64_t)(PAGE_SIZE - 1);
+			bool double_free = mark_cached(seg, pfn, true);
+			if (!double_free && is_page_free(seg, pfn)) {
+				mark_cached(seg, pfn, false);
+				double_free = true;
+			}
+			if (double_free) {
+				Log::warnf("PMM: Attempt to free already-free page at %p", ptr);
+				failed_free_count++;
+				arch::x86_64::misc::irq_restore(flags);
+				return;
+			}
 
-	if (addr < MIN_ALLOC_ADDR) {
-		Log::errf("PMM: Attempt to free memory below 1 MiB (%p)", ptr);
-		failed_free_count++;
-		return;
+			if (cache->count == PCP_CAPACITY) cache_drain(cache, PCP_CAPACITY - PCP_BATCH);
+			cache->frames[cache->count++] = frame;
+			cache->free_count++;
+			arch::x86_64::misc::irq_restore(flags);
+			return;
+		}
 	}
 
-	uint64_t page_offset = 0;
-	segment* seg = nullptr;
+	c_acquire_spinlock(&pmm_lock);
+	bool ok = shared_frames > 0 ? release_shared(ptr, npages) : buddy_free(ptr, npages);
+	if (ok) free_count++;
+	else failed_free_count++;
+	c_release_spinlock(&pmm_lock);
 
-	for (int i = 0; i < MAX_SEGMENTS; i++) {
-		if (segments[i].length == 0) continue;
-		
-		uint64_t seg_start = segments[i].base;
-		uint64_t seg_end = seg_start + segments[i].length;
+	arch::x86_64::misc::irq_restore(flags);
+}
 
-		if (addr >= seg_start && addr < seg_end) {
-			if (segments[i].is_bitmap) {
-				Log::errf("PMM: Attempt to free bitmap segment");
-				failed_free_count++;
-				return;
-			}
-			seg = &segments[i];
-			break;
-		}
+bool share(void* ptr) {
+	uint64_t pfn = reinterpret_cast<uint64_t>(ptr) / PAGE_SIZE;
+	bool ok = false;
+
+	uint64_t flags = arch::x86_64::misc::irq_save();
+	c_acquire_spinlock(&pmm_lock);
 
-		if (!segments[i].is_bitmap) {
-			page_offset += segments[i].length / PAGE_SIZE;
+	segment* seg = segment_of(pfn);
+	if (seg && seg->shares) {
+		uint16_t* owners = &seg->shares[pfn - seg->first_pfn];
+		if (*owners < 0xFFFF) {
+			(*owners)++;
+			shared_frames++;
+			ok = true;
 		}
 	}
 
-	if (!seg) {
-		Log::errf("PMM: Free failed, pointer %p outside segments", ptr);
-		failed_free_count++;
-		return;
-	}
+	c_release_spinlock(&pmm_lock);
+	arch::x86_64::misc::irq_restore(flags);
+	return ok;
+}
+
+uint64_t share_count(void* ptr) {
+	uint64_t pfn = reinterpret_cast<uint64_t>(ptr) / PAGE_SIZE;
+	segment* seg = segment_of(pfn);
+	if (!seg || !seg->shares) return 0;
+	return seg->shares[pfn - seg->first_pfn];
+}
 
-	uint64_t seg_page_index = (addr - seg->base) / PAGE_SIZE;
-	uint64_t global_index = page_offset + seg_page_index;
-	uint64_t actually_freed = 0;
+void* palloc_zeroed(size_t npages) {
+	if (npages == 1) {
+		uint64_t flags = arch::x86_64::misc::irq_save();
+		c_acquire_spinlock(&pmm_lock);
 
-	for (uint64_t i = 0; i < npages; i++) {
-		uint64_t idx = global_index + i;
-		if (bitmap_test(idx)) {
-			bitmap_clear(idx);
-			actually_freed += PAGE_SIZE;
+		void* page = nullptr;
+		if (zero_pool_count > 0) {
+			page = reinterpret_cast<void*>(zero_pool[--zero_pool_count]);
+			allocation_count++;
+			zero_pool_hits++;
 		} else {
-			Log::warnf("PMM: Attempt to free already-free page at index %llu", idx);
-			failed_free_count++;
+			zero_pool_misses++;
 		}
+
+		c_release_spinlock(&pmm_lock);
+		arch::x86_64::misc::irq_restore(flags);
+
+		if (page) return page;
 	}
 
-	if (actually_freed > 0) {
-		if (used_mem >= actually_freed) {
-			used_mem -= actually_freed;
-		} else {
-			used_mem = 0;
+	void* ptr = palloc(npages);
+	if (!ptr) return nullptr;
+
+	/* runs bigger than the caches would only flush them, and the caller rarely touches all of it right away */
+	void* va = reinterpret_cast<void*>(mem::vmm::pa_to_va(reinterpret_cast<uint64_t>(ptr)));
+	if (npages >= ZERO_NT_PAGES) mem::memset_nt(va, 0, npages * PAGE_SIZE);
+	else mem::memset(va, 0, npages * PAGE_SIZE);
+	return ptr;
+}
+
+size_t refill_zero_pool(size_t max_pages) {
+	size_t zeroed = 0;
+
+	while (zeroed < max_pages) {
+		uint64_t flags = arch::x86_64::misc::irq_save();
+		c_acquire_spinlock(&pmm_lock);
+
+		/* leave the last sixteenth of memory to real allocations */
+		void* page = nullptr;
+		if (zero_pool_count + zero_pool_pending < ZERO_POOL_CAPACITY && free_mem > total_mem / 16) {
+			page = buddy_alloc(1);
+			if (page) zero_pool_pending++;
 		}
 
-		free_mem += actually_freed;
-		seg->remaining_bytes += actually_freed;
-		free_count++;
+		c_release_spinlock(&pmm_lock);
+		arch::x86_64::misc::irq_restore(flags);
+
+		if (!page) break;
+
+		/* zeroing runs with interrupts on, the frame is invisible to everyone else until it's pushed */
+		zero_frame_nt(reinterpret_cast<uint64_t>(page));
+
+		flags = arch::x86_64::misc::irq_save();
+		c_acquire_spinlock(&pmm_lock);
+		zero_pool_pending--;
+		zero_pool[zero_pool_count++] = reinterpret_cast<uint64_t>(page);
+		c_release_spinlock(&pmm_lock);
+		arch::x86_64::misc::irq_restore(flags);
+
+		zeroed++;
 	}
+
+	return zeroed;
+}
+
+void drain_cpu_cache() {
+	uint64_t flags = arch::x86_64::misc::irq_save();
+	pmm_cpu_cache* cache = local_cache();
+	if (cache) cache_drain(cache, 0);
+	arch::x86_64::misc::irq_restore(flags);
 }
 
-void* reserve_heap(size_t npages) {
-	return palloc(npages);
+void register_reclaimer(size_t (*fn)()) {
+	if (reclaimer_count < MAX_RECLAIMERS) reclaimers[reclaimer_count++] = fn;
+}
+
+#ifdef CONFIG_PMM_BENCHMARK
+#define BENCH_BITS (1ULL << 20)
+#define BENCH_ITERATIONS 64
+
+/* the scan the PMM used before the summary bitmaps, one bit test per page */
+static uint64_t legacy_find_clear(uint8_t* map, uint64_t nbits) {
+	for (uint64_t i = 0; i < nbits; i++) {
+		if (!(map[i / 8] & (1 << (i % 8)))) return i;
+	}
+	return UINT64_MAX;
+}
+
+void benchmark() {
+	uint64_t legacy_bytes = BENCH_BITS / 8;
+	uint64_t words = BENCH_BITS / 64;
+	uint64_t summary_words = (words + 63) / 64;
+	uint64_t npages = (legacy_bytes + (words + summary_words) * sizeof(uint64_t) + PAGE_SIZE - 1) / PAGE_SIZE;
+
+	void* scratch = palloc(npages);
+	if (!scratch) {
+		Log::errf("PMM: Not enough memory for the benchmark");
+		return;
+	}
+
+	uint8_t* legacy = reinterpret_cast<uint8_t*>(mem::vmm::pa_to_va(reinterpret_cast<uint64_t>(scratch)));
+	summary_bitmap map;
+	map.words = reinterpret_cast<uint64_t*>(legacy + legacy_bytes);
+	map.summary = map.words + words;
+	map.nwords = words;
+
+	/* a single free page placed at increasingly distant points in an otherwise full map */
+	static const uint64_t positions[] = { 0, BENCH_BITS / 64, BENCH_BITS / 4, BENCH_BITS / 2, BENCH_BITS - 1 };
+
+	for (uint64_t p = 0; p < sizeof(positions) / sizeof(positions[0]); p++) {
+		uint64_t pos = positions[p];
+
+		mem::memset(legacy, 0xFF, legacy_bytes);
+		legacy[pos / 8] &= ~(1 << (pos % 8));
+
+		mem::memset(map.words, 0, (words + summary_words) * sizeof(uint64_t));
+		map.hint = 0;
+		bitmap_set(&map, pos);
+
+		uint64_t found = 0;
+		uint64_t start = arch::x86_64::misc::rdtsc();
+		for (int i = 0; i < BENCH_ITERATIONS; i++) found += legacy_find_clear(legacy, BENCH_BITS);
+		uint64_t legacy_cycles = (arch::x86_64::misc::rdtsc() - start) / BENCH_ITERATIONS;
+
+		start = arch::x86_64::misc::rdtsc();
+		for (int i = 0; i < BENCH_ITERATIONS; i++) {
+			map.hint = 0;
+			found += bitmap_find_first(&map);
+		}
+		uint64_t summary_cycles = (arch::x86_64::misc::rdtsc() - start) / BENCH_ITERATIONS;
+
+		if (found != pos * BENCH_ITERATIONS * 2) Log::errf("PMM: Benchmark scans disagree at page %llu", pos);
+
+		Log::infof("PMM: bench free page at %llu/%llu: legacy %llu cycles, summary %llu cycles",
+				   pos, BENCH_BITS, legacy_cycles, summary_cycles);
+	}
+
+	free(scratch, npages);
 }
+#endif
 
 }
@@ -27,7 +27,26 @@ void initialise();
 void* palloc(size_t npages);
 void free(void* ptr, size_t npages);
 
-void* reserve_heap(size_t npages);
+// same as palloc but the frames come back zero filled, single pages are taken from the pre-zeroed pool
+void* palloc_zeroed(size_t npages);
+
+// zeroes up to max_pages frames into the pool, returns how many it did (0 once the pool is full)
+size_t refill_zero_pool(size_t max_pages);
+
+// returns every frame held in the calling CPU's page cache to the buddy allocator
+void drain_cpu_cache();
+
+// adds an owner to a frame so the next free only drops that owner, returns false for frames the pmm does not track
+bool share(void* ptr);
+
+// how many owners a frame has beyond the first
+uint64_t share_count(void* ptr);
+
+// fn is run when an allocation can't be satisfied and returns how many pages it freed
+void register_reclaimer(size_t (*fn)());
+
+// times the old bit-at-a-time scan against the summary bitmap scan, only built with CONFIG_PMM_BENCHMARK
+void benchmark();
 
 }
 
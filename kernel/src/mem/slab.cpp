@@ -0,0 +1,242 @@
+#include <mem/mem.hpp>
+#include <mem/slab.hpp>
+#include <arch/arch.hpp>
+#include <cstdio>
+
+extern "C" {
+#include <proc/spinlocks.h>
+}
+
+#define PAGE_SIZE 0x1000ULL
+
+/* a slab never holds more objects than its bitmap covers, and grows up to 16 pages to hold at least a few */
+#define SLAB_MAX_OBJECTS 256
+#define SLAB_MIN_OBJECTS 8
+#define SLAB_MAX_PAGES 16
+
+/* sits at the start of every slab, slabs are aligned to their size so an object finds it by masking */
+struct slab_page {
+    mem::slab::cache* owner;
+    slab_page* prev;
+    slab_page* next;
+    uint8_t* objects;
+    uint32_t free_count;
+    uint32_t capacity;
+    uint64_t free_map[SLAB_MAX_OBJECTS / 64]; /* set bits are free objects */
+};
+
+namespace mem::slab {
+
+struct cache {
+    char name[16];
+    size_t size; /* object stride, already rounded up to the alignment */
+    size_t offset; /* where the first object starts in a slab */
+    size_t slab_pages;
+    uint32_t capacity;
+    void (*ctor)(void*);
+
+    slab_page* partial;
+    slab_page* full;
+    slab_page* empty; /* one free slab is kept so an alloc/free pair at the boundary doesn't churn pages */
+    uint64_t nslabs;
+    uint64_t allocated;
+
+    spinlock lock;
+};
+
+/* caches are slab objects themselves, this one hands them out */
+static cache cache_cache;
+
+static void list_push(slab_page** list, slab_page* s) {
+    s->prev = nullptr;
+    s->next = *list;
+    if (*list) (*list)->prev = s;
+    *list = s;
+}
+
+static void list_remove(slab_page** list, slab_page* s) {
+    if (s->prev) s->prev->next = s->next;
+    else *list = s->next;
+    if (s->next) s->next->prev = s->prev;
+}
+
+static bool setup(cache* c, const char* name, size_t size, size_t align, void (*ctor)(void*)) {
+    if (align < 8) align = 8;
+    if (size == 0 || (align & (align - 1))) return false;
+
+    c->size = (size + align - 1) & ~(align - 1);
+    c->offset = (sizeof(slab_page) + align - 1) & ~(align - 1);
+
+    c->slab_pages = 1;
+    while (c->slab_pages < SLAB_MAX_PAGES && (c->slab_pages * PAGE_SIZE - c->offset) / c->size < SLAB_MIN_OBJECTS)
+        c->slab_pages *= 2;
+
+    uint64_t fits = (c->slab_pages * PAGE_SIZE - c->offset) / c->size;
+    if (fits == 0) return false;
+    c->capacity = fits > SLAB_MAX_OBJECTS ? SLAB_MAX_OBJECTS : fits;
+
+    int i = 0;
+    for (; i < 15 && name[i]; i++) c->name[i] = name[i];
+    c->name[i] = 0;
+
+    c->ctor = ctor;
+    c->partial = c->full = c->empty = nullptr;
+    c->nslabs = 0;
+    c->allocated = 0;
+
+    c->lock.name[0] = 'S';
+    c->lock.name[1] = 'L';
+    c->lock.name[2] = 'A';
+    c->lock.name[3] = 'B';
+    c->lock.name[4] = 0;
+    c->lock.locked = 0;
+    return true;
+}
+
+static slab_page* new_slab(cache* c) {
+    void* page = mem::pmm::palloc(c->slab_pages);
+    if (!page) return nullptr;
+
+    uint64_t bytes = c->slab_pages * PAGE_SIZE;
+    slab_page* s = reinterpret_cast<slab_page*>(mem::vmm::pa_to_va(reinterpret_cast<uint64_t>(page)));
+    if (reinterpret_cast<uint64_t>(s) & (bytes - 1)) {
+        Log::errf("Slab: %s got a misaligned slab at %p", c->name, page);
+        mem::pmm::free(page, c->slab_pages);
+        return nullptr;
+    }
+
+    s->owner = c;
+    s->objects = reinterpret_cast<uint8_t*>(s) + c->offset;
+    s->capacity = c->capacity;
+    s->free_count = c->capacity;
+
+    for (int w = 0; w < SLAB_MAX_OBJECTS / 64; w++) {
+        uint32_t first = w * 64;
+        if (first >= c->capacity) s->free_map[w] = 0;
+        else if (c->capacity - first >= 64) s->free_map[w] = ~0ULL;
+        else s->free_map[w] = (1ULL << (c->capacity - first)) - 1;
+    }
+
+    if (c->ctor) {
+        for (uint32_t i = 0; i < c->capacity; i++) c->ctor(s->objects + i * c->size);
+    }
+
+    c->nslabs++;
+    return s;
+}
+
+static void release_slab(cache* c, slab_page* s) {
+    mem::pmm::free(reinterpret_cast<void*>(mem::vmm::va_to_pa(reinterpret_cast<uint64_t>(s))), c->slab_pages);
+    c->nslabs--;
+}
+
+cache* create(const char* name, size_t size, size_t align, void (*ctor)(void*)) {
+    if (cache_cache.size == 0 && !setup(&cache_cache, "slab_cache", sizeof(cache), alignof(cache), nullptr))
+        return nullptr;
+
+    cache* c = static_cast<cache*>(alloc(&cache_cache));
+    if (!c) return nullptr;
+
+    if (!setup(c, name, size, align, ctor)) {
+        free(&cache_cache, c);
+        return nullptr;
+    }
+
+    return c;
+}
+
+void destroy(cache* c) {
+    if (!c) return;
+
+    slab_page* lists[2] = { c->partial, c->full };
+    for (slab_page* s : lists) {
+        while (s) {
+            slab_page* next = s->next;
+            release_slab(c, s);
+            s = next;
+        }
+    }
+    if (c->empty) release_slab(c, c->empty);
+
+    free(&cache_cache, c);
+}
+
+void* alloc(cache* c) {
+    uint64_t flags = arch::x86_64::misc::irq_save();
+    c_acquire_spinlock(&c->lock);
+
+    slab_page* s = c->partial;
+    if (!s) {
+        s = c->empty ? c->empty : new_slab(c);
+        c->empty = nullptr;
+        if (!s) {
+            c_release_spinlock(&c->lock);
+            arch::x86_64::misc::irq_restore(flags);
+            return nullptr;
+        }
+        list_push(&c->partial, s);
+    }
+
+    int w = 0;
+    while (!s->free_map[w]) w++;
+    uint32_t index = w * 64 + __builtin_ctzll(s->free_map[w]);
+    s->free_map[w] &= s->free_map[w] - 1;
+
+    if (--s->free_count == 0) {
+        list_remove(&c->partial, s);
+        list_push(&c->full, s);
+    }
+    c->allocated++;
+
+    c_release_spinlock(&c->lock);
+    arch::x86_64::misc::irq_restore(flags);
+    return s->objects + index * c->size;
+}
+
+void free(cache* c, void* obj) {
+    if (!obj) return;
+
+    slab_page* s = reinterpret_cast<slab_page*>(reinterpret_cast<uint64_t>(obj) & ~(c->slab_pages * PAGE_SIZE - 1));
+    uint64_t offset = static_cast<uint8_t*>(obj) - s->objects;
+    uint32_t index = offset / c->size;
+
+    if (s->owner != c || offset % c->size || index >= s->capacity) {
+        Log::errf("Slab: %p doesn't belong to cache %s", obj, c->name);
+        return;
+    }
+
+    uint64_t flags = arch::x86_64::misc::irq_save();
+    c_acquire_spinlock(&c->lock);
+
+    uint64_t bit = 1ULL << (index % 64);
+    if (s->free_map[index / 64] & bit) {
+        c_release_spinlock(&c->lock);
+        arch::x86_64::misc::irq_restore(flags);
+        Log::warnf("Slab: Attempt to free already-free object %p in %s", obj, c->name);
+        return;
+    }
+
+    s->free_map[index / 64] |= bit;
+    c->allocated--;
+
+    if (s->free_count++ == 0) {
+        list_remove(&c->full, s);
+        list_push(&c->partial, s);
+    }
+
+    if (s->free_count == s->capacity) {
+        list_remove(&c->partial, s);
+        if (!c->empty) c->empty = s;
+        else release_slab(c, s);
+    }
+
+    c_release_spinlock(&c->lock);
+    arch::x86_64::misc::irq_restore(flags);
+}
+
+void stat_print(cache* c) {
+    Log::infof("Slab: %s: %llu objects of %llu bytes live in %llu slabs of %llu pages",
+               c->name, c->allocated, c->size, c->nslabs, c->slab_pages);
+}
+
+}
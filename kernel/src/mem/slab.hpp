@@ -0,0 +1,23 @@
+#ifndef SLAB_HPP
+#define SLAB_HPP 1
+
+#include <cstdint>
+#include <cstddef>
+
+namespace mem::slab {
+
+struct cache;
+
+// objects are packed into page-backed slabs, ctor (optional) runs once per object when its slab is created
+cache* create(const char* name, size_t size, size_t align = 8, void (*ctor)(void*) = nullptr);
+// frees every slab, objects still allocated from the cache go with them
+void destroy(cache* c);
+
+void* alloc(cache* c);
+void free(cache* c, void* obj);
+
+void stat_print(cache* c);
+
+}
+
+#endif /* SLAB_HPP */
@@ -1,5 +1,11 @@
 #include <mem/mem.hpp>
 #include <cstdio>
+#include <arch/arch.hpp>
+#include <arch/x86_64/apic/apic.hpp>
+
+extern "C" {
+#include <proc/spinlocks.h>
+}
 
 uint64_t original_PML4 = 0;
 uint64_t default_PML4 = 0;
@@ -8,21 +14,397 @@ uint64_t current_PML4 = 0;
 #define PAGE_PRESENT 0x1
 #define PAGE_RW      0x2
 #define PAGE_USER    0x4
+#define PAGE_PCD     0x10
+#define PAGE_HUGE    0x80
+#define PAGE_COW     0x200 /* available bit, a read-only user page that gets copied on the first write */
+#define PAGE_NX      (1ULL << 63)
+
+/* the attribute bits a caller of mmap gets to pick, present is always set */
+#define MMAP_ATTR_MASK (PAGE_RW | PAGE_USER | PAGE_PCD | PAGE_NX)
+
+#define SIZE_4K 0x1000ULL
+#define SIZE_2M 0x200000ULL
+#define SIZE_1G 0x40000000ULL
+
+/* physical address bits of a table entry, the low 12 bits and NX are flags */
+#define ENTRY_ADDR_MASK 0x000FFFFFFFFFF000ULL
+/* flags that are carried over when a huge entry is split */
+#define ENTRY_FLAGS_MASK 0x800000000000017FULL
+
+#define KERNEL_HALF 0xFFFF800000000000ULL
+
+/* PCID 0 belongs to the boot pagetable, the rest are handed out to address spaces */
+#define PCID_SLOTS 128
+#define CR3_NOFLUSH (1ULL << 63)
+#define CR4_PCIDE (1ULL << 17)
+
+#define CR4_PGE (1ULL << 7)
+/* makes ring 0 writes honour read-only pages, copy-on-write depends on it */
+#define CR0_WP (1ULL << 16)
+
+#define IA32_EFER 0xC0000080
+#define EFER_NXE (1ULL << 11)
+
+#define INVPCID_ADDRESS 0
+#define INVPCID_CONTEXT 1
+#define INVPCID_ALL_GLOBAL 2
+
+/* past this many pages one operation flushes everything instead of using invlpg */
+#define TLB_BATCH_MAX 32
+/* tables and frames that may only be freed once no TLB can still reach them */
+#define TLB_BATCH_DEFER 64
 
 namespace mem::vmm {
 
+static bool gb_pages = false;
+static bool pcid_enabled = false;
+static bool has_invpcid = false;
+/* without EFER.NXE bit 63 is reserved, so PAGE_NX is dropped from every mapping */
+static bool nx_enabled = false;
+
+struct pcid_slot {
+    uint64_t pml4;
+    uint64_t stale_cpus; /* CPUs whose TLB may hold old translations for this PCID, they flush on next load */
+};
+
+static pcid_slot pcid_slots[PCID_SLOTS];
+static uint64_t next_victim = 1;
+/* taken with interrupts off around claiming or releasing a slot and the CR3 load that uses it, so no two PML4s share a PCID */
+static spinlock pcid_lock = {
+    "PCID",
+    0
+};
+
+struct tlb_deferred {
+    uint64_t addr;
+    uint64_t count; /* frames for a frame range, the table level for a page table */
+    bool table;
+};
+
+/* everything one mmap/munmap changed, flushed locally and on other CPUs in one go */
+struct tlb_batch {
+    uint64_t pml4;
+    uint64_t addrs[TLB_BATCH_MAX];
+    uint64_t count;
+    bool kernel;
+    bool full;
+
+    tlb_deferred deferred[TLB_BATCH_DEFER];
+    uint64_t ndeferred;
+};
+
+static volatile uint8_t shootdown_busy = 0;
+static volatile uint64_t shootdown_pending = 0;
+static tlb_batch* volatile shootdown_request = nullptr;
+
+static void free_table(uint64_t entry, int level);
+
 static inline void invlpg(uint64_t va) {
     asm volatile("invlpg (%0)" :: "r"(va) : "memory");
 }
 
+static inline void invpcid(uint64_t type, uint64_t pcid, uint64_t va) {
+    struct {
+        uint64_t pcid;
+        uint64_t addr;
+    } desc = { pcid, va };
+    asm volatile("invpcid %0, %1" :: "m"(desc), "r"(type) : "memory");
+}
+
+static inline uint64_t this_cpu_bit() {
+    cpu_unit* cpu = arch::x86_64::apic::get_current_cpu();
+    return 1ULL << ((cpu ? cpu->registry_id : 0) & 63);
+}
+
+/* the scheduler moves every CPU between address spaces on its own, current_PML4 only stands in until the CPUs are registered */
+static inline uint64_t this_pml4() {
+    cpu_unit* cpu = arch::x86_64::apic::get_current_cpu();
+    return cpu && cpu->active_pml4 ? cpu->active_pml4 : current_PML4;
+}
+
+/* loaded on some CPU right now, its PCID may not go to anyone else */
+static bool pml4_live(uint64_t pml4) {
+    if (pml4 == this_pml4()) return true;
+
+    cpu_registry* registry = arch::x86_64::apic::get_cpu_registry();
+    if (!registry) return false;
+    for (cpu_unit* cpu = registry->first_unit; cpu; cpu = cpu->next_unit) {
+        if (cpu->active_pml4 == pml4) return true;
+    }
+    return false;
+}
+
+/* call with pcid_lock held and keep it until the CR3 load, active_pml4 is what protects a slot from being recycled */
+static uint64_t pcid_of(uint64_t pml4) {
+    for (uint64_t i = 0; i < PCID_SLOTS; i++) {
+        if (pcid_slots[i].pml4 == pml4) return i;
+    }
+
+    /* no slot yet, take a free one or recycle round-robin, either way it gets flushed on load */
+    uint64_t pcid = 0;
+    for (uint64_t i = 1; i < PCID_SLOTS && !pcid; i++) {
+        if (!pcid_slots[i].pml4) pcid = i;
+    }
+    if (!pcid) {
+        do {
+            pcid = next_victim;
+            next_victim = (next_victim % (PCID_SLOTS - 1)) + 1;
+        } while (pml4_live(pcid_slots[pcid].pml4));
+    }
+
+    pcid_slots[pcid].pml4 = pml4;
+    __atomic_store_n(&pcid_slots[pcid].stale_cpus, ~0ULL, __ATOMIC_RELEASE);
+    return pcid;
+}
+
+static void batch_init(tlb_batch* b) {
+    b->pml4 = this_pml4();
+    b->count = 0;
+    b->kernel = false;
+    b->full = false;
+    b->ndeferred = 0;
+}
+
+static void batch_add(tlb_batch* b, uint64_t va) {
+    if (va >= KERNEL_HALF) b->kernel = true;
+    if (b->full) return;
+
+    if (b->count == TLB_BATCH_MAX) {
+        b->full = true;
+        return;
+    }
+    b->addrs[b->count++] = va;
+}
+
+static void reload_cr3() {
+    uint64_t flags = arch::x86_64::misc::irq_save();
+    c_acquire_spinlock(&pcid_lock);
+
+    uint64_t pml4 = this_pml4();
+    uint64_t cr3 = va_to_pa(pml4);
+    if (pcid_enabled) cr3 |= pcid_of(pml4);
+    asm volatile("mov %0, %%cr3" :: "r"(cr3) : "memory");
+
+    c_release_spinlock(&pcid_lock);
+    arch::x86_64::misc::irq_restore(flags);
+}
+
+/* does this CPU's part of a batch, runs on the initiator and in the shootdown IPI */
+static void flush_local(tlb_batch* b) {
+    if (b->full) {
+        if (!b->kernel) {
+            reload_cr3();
+            return;
+        }
+
+        if (has_invpcid) {
+            invpcid(INVPCID_ALL_GLOBAL, 0, 0);
+            return;
+        }
+
+        /* toggling PGE drops every entry of every PCID, globals included */
+        uint64_t cr4;
+        asm volatile("mov %%cr4, %0" : "=r"(cr4));
+        if (cr4 & CR4_PGE) {
+            asm volatile("mov %0, %%cr4" :: "r"(cr4 & ~CR4_PGE) : "memory");
+            asm volatile("mov %0, %%cr4" :: "r"(cr4) : "memory");
+        } else {
+            reload_cr3();
+        }
+        return;
+    }
+
+    for (uint64_t i = 0; i < b->count; i++) invlpg(b->addrs[i]);
+
+    /*
+     * The kernel half is shared by every PML4, so a kernel page that changes
+     * has to go from every PCID, invlpg only drops it from the current one.
+     */
+    if (pcid_enabled && b->kernel && has_invpcid) {
+        uint64_t loaded = this_pml4();
+        for (uint64_t p = 0; p < PCID_SLOTS; p++) {
+            if (!pcid_slots[p].pml4 || pcid_slots[p].pml4 == loaded) continue;
+
+            for (uint64_t i = 0; i < b->count; i++) {
+                if (b->addrs[i] >= KERNEL_HALF) invpcid(INVPCID_ADDRESS, p, b->addrs[i]);
+            }
+        }
+    }
+}
+
+/*
+ * PCIDs that aren't loaded anywhere right now can't be reached by invlpg, flush them on their next load instead.
+ * Every CPU marks and clears these at once, a lost mark lets a CPU keep translations to freed frames
+ */
+static void mark_stale(tlb_batch* b) {
+    if (!pcid_enabled) return;
+
+    uint64_t self = this_cpu_bit();
+    for (uint64_t p = 0; p < PCID_SLOTS; p++) {
+        if (!pcid_slots[p].pml4) continue;
+
+        if (pcid_slots[p].pml4 == b->pml4) {
+            __atomic_fetch_or(&pcid_slots[p].stale_cpus, ~self, __ATOMIC_ACQ_REL);
+        } else if (b->kernel && !has_invpcid) {
+            __atomic_store_n(&pcid_slots[p].stale_cpus, ~0ULL, __ATOMIC_RELEASE);
+        }
+    }
+}
+
+static void shootdown_service() {
+    uint64_t bit = this_cpu_bit();
+    if (!(__atomic_load_n(&shootdown_pending, __ATOMIC_ACQUIRE) & bit)) return;
+
+    flush_local(shootdown_request);
+    __atomic_fetch_and(&shootdown_pending, ~bit, __ATOMIC_RELEASE);
+}
+
+/* one IPI to every CPU that can see the batch, then wait until they all acked */
+static void shootdown(tlb_batch* b) {
+    cpu_registry* registry = arch::x86_64::apic::get_cpu_registry();
+    if (!registry) return;
+
+    cpu_unit* self = arch::x86_64::apic::get_current_cpu();
+    uint64_t targets = 0;
+    for (cpu_unit* cpu = registry->first_unit; cpu; cpu = cpu->next_unit) {
+        if (cpu == self || !cpu->online || cpu->registry_id >= 64) continue;
+        if (b->kernel || cpu->active_pml4 == b->pml4) targets |= 1ULL << cpu->registry_id;
+    }
+    if (!targets) return;
+
+    /* whoever holds the lock may be waiting on us, keep answering while we wait for it */
+    while (__atomic_exchange_n(&shootdown_busy, 1, __ATOMIC_ACQUIRE)) {
+        shootdown_service();
+        asm volatile("pause");
+    }
+
+    shootdown_request = b;
+    __atomic_store_n(&shootdown_pending, targets, __ATOMIC_RELEASE);
+
+    for (cpu_unit* cpu = registry->first_unit; cpu; cpu = cpu->next_unit) {
+        if (cpu->registry_id < 64 && (targets & (1ULL << cpu->registry_id)))
+            arch::x86_64::apic::ipi_send(cpu, TLB_SHOOTDOWN_VECTOR);
+    }
+
+    while (__atomic_load_n(&shootdown_pending, __ATOMIC_ACQUIRE))
+        asm volatile("pause");
+
+    shootdown_request = nullptr;
+    __atomic_store_n(&shootdown_busy, 0, __ATOMIC_RELEASE);
+}
+
+static void batch_finish(tlb_batch* b) {
+    if (b->count || b->full) {
+        flush_local(b);
+        mark_stale(b);
+        shootdown(b);
+    }
+
+    for (uint64_t i = 0; i < b->ndeferred; i++) {
+        tlb_deferred* d = &b->deferred[i];
+        if (d->table) free_table(d->addr, d->count);
+        else mem::pmm::free(reinterpret_cast<void*>(d->addr), d->count);
+    }
+
+    batch_init(b);
+}
+
+static void batch_defer(tlb_batch* b, uint64_t addr, uint64_t count, bool table) {
+    /* physically contiguous frames go back as one run */
+    if (!table && b->ndeferred) {
+        tlb_deferred* last = &b->deferred[b->ndeferred - 1];
+        if (!last->table && last->addr + last->count * SIZE_4K == addr) {
+            last->count += count;
+            return;
+        }
+    }
+
+    if (b->ndeferred == TLB_BATCH_DEFER) batch_finish(b);
+
+    b->deferred[b->ndeferred].addr = addr;
+    b->deferred[b->ndeferred].count = count;
+    b->deferred[b->ndeferred].table = table;
+    b->ndeferred++;
+}
+
 static inline uint64_t get_pml4_index(uint64_t va) { return (va >> 39) & 0x1FF; }
 static inline uint64_t get_pdpt_index(uint64_t va) { return (va >> 30) & 0x1FF; }
 static inline uint64_t get_pd_index(uint64_t va)   { return (va >> 21) & 0x1FF; }
 static inline uint64_t get_pt_index(uint64_t va)   { return (va >> 12) & 0x1FF; }
 
-static uint64_t* ensure_table_exists(uint64_t* parent, uint64_t index, bool user) {
+/* replaces a 1 GiB or 2 MiB entry with a table of 512 entries mapping the same range */
+static bool split_huge(uint64_t* entry, uint64_t entry_size, uint64_t va, tlb_batch* batch) {
+    uint64_t child_size = entry_size / 512;
+    uint64_t base = *entry & ENTRY_ADDR_MASK & ~(entry_size - 1);
+    uint64_t flags = *entry & ENTRY_FLAGS_MASK & ~PAGE_HUGE;
+    if (child_size > SIZE_4K) flags |= PAGE_HUGE;
+
+    void* page = mem::pmm::palloc(1);
+    if (!page) return false;
+
+    uint64_t* table = reinterpret_cast<uint64_t*>(pa_to_va(reinterpret_cast<uint64_t>(page)));
+    for (int i = 0; i < 512; i++) {
+        table[i] = (base + i * child_size) | flags;
+    }
+
+    /* like any other table the new one stays writable, the copied flags only matter in its leaves */
+    *entry = reinterpret_cast<uint64_t>(page) | PAGE_PRESENT | PAGE_RW | (*entry & PAGE_USER);
+    batch_add(batch, va & ~(entry_size - 1));
+    return true;
+}
+
+/* frees a page table and, for a page directory, the page tables under it. mapped frames are left alone */
+static void free_table(uint64_t entry, int level) {
+    uint64_t* table = reinterpret_cast<uint64_t*>(pa_to_va(entry & ENTRY_ADDR_MASK));
+
+    if (level > 1) {
+        for (int i = 0; i < 512; i++) {
+            if ((table[i] & PAGE_PRESENT) && !(table[i] & PAGE_HUGE))
+                free_table(table[i], level - 1);
+        }
+    }
+
+    mem::pmm::free(reinterpret_cast<void*>(entry & ENTRY_ADDR_MASK), 1);
+}
+
+/* points *entry at the leaf entry mapping va and returns the size it maps, or the size of the hole when nothing does */
+static uint64_t lookup(uint64_t va, uint64_t** entry) {
+    *entry = nullptr;
+
+    uint64_t* pml4 = reinterpret_cast<uint64_t*>(this_pml4());
+    uint64_t pml4_entry = pml4[get_pml4_index(va)];
+    if (!(pml4_entry & PAGE_PRESENT)) return SIZE_1G * 512;
+
+    uint64_t* pdpt = reinterpret_cast<uint64_t*>(pa_to_va(pml4_entry & ENTRY_ADDR_MASK));
+    uint64_t* pdpt_entry = &pdpt[get_pdpt_index(va)];
+    if (!(*pdpt_entry & PAGE_PRESENT)) return SIZE_1G;
+    if (*pdpt_entry & PAGE_HUGE) {
+        *entry = pdpt_entry;
+        return SIZE_1G;
+    }
+
+    uint64_t* pd = reinterpret_cast<uint64_t*>(pa_to_va(*pdpt_entry & ENTRY_ADDR_MASK));
+    uint64_t* pd_entry = &pd[get_pd_index(va)];
+    if (!(*pd_entry & PAGE_PRESENT)) return SIZE_2M;
+    if (*pd_entry & PAGE_HUGE) {
+        *entry = pd_entry;
+        return SIZE_2M;
+    }
+
+    uint64_t* pt = reinterpret_cast<uint64_t*>(pa_to_va(*pd_entry & ENTRY_ADDR_MASK));
+    uint64_t* pt_entry = &pt[get_pt_index(va)];
+    if (*pt_entry & PAGE_PRESENT) *entry = pt_entry;
+    return SIZE_4K;
+}
+
+static uint64_t* ensure_table_exists(uint64_t* parent, uint64_t index, bool user, uint64_t entry_size, uint64_t va, tlb_batch* batch) {
+    uint64_t current = __atomic_load_n(&parent[index], __ATOMIC_ACQUIRE);
+    if ((current & PAGE_PRESENT) && (current & PAGE_HUGE)) {
+        if (!split_huge(&parent[index], entry_size, va, batch)) return nullptr;
+    }
+
     if (parent[index] & PAGE_PRESENT) {
-        uint64_t* table = reinterpret_cast<uint64_t*>(pa_to_va(parent[index] & ~0xFFF));
+        uint64_t* table = reinterpret_cast<uint64_t*>(pa_to_va(parent[index] & ENTRY_ADDR_MASK));
         
         if (user && !(parent[index] & PAGE_USER)) {
             parent[index] |= PAGE_USER;
@@ -31,29 +413,93 @@ static uint64_t* ensure_table_exists(uint64_t* parent, uint64_t index, bool user
         return table;
     }
     
-    uint64_t* new_table = reinterpret_cast<uint64_t*>(valloc(1));
-    if (!new_table) {
+    void* page = mem::pmm::palloc_zeroed(1);
+    if (!page) {
         return nullptr;
     }
     
-    mem::memset(new_table, 0, 0x1000);
+    uint64_t* new_table = reinterpret_cast<uint64_t*>(pa_to_va(reinterpret_cast<uint64_t>(page)));
     
     uint64_t flags = PAGE_PRESENT | PAGE_RW;
     if (user) {
         flags |= PAGE_USER;
     }
     
-    parent[index] = va_to_pa(reinterpret_cast<uint64_t>(new_table)) | flags;
+    /*
+     * The kernel half is shared, CPUs growing their heaps may fill the same
+     * entry at once. The first table in wins, the others go back and use it
+     */
+    uint64_t fresh = va_to_pa(reinterpret_cast<uint64_t>(new_table)) | flags;
+    if (!__atomic_compare_exchange_n(&parent[index], &current, fresh, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        mem::pmm::free(page, 1);
+        return ensure_table_exists(parent, index, user, entry_size, va, batch);
+    }
     
     return new_table;
 }
 
+/* copies a user page table level, writable leaves become read-only copy-on-write in both tables */
+static uint64_t clone_table(uint64_t entry, int level, uint64_t va, tlb_batch* batch, bool* ok) {
+    void* page = mem::pmm::palloc_zeroed(1);
+    if (!page) {
+        *ok = false;
+        return 0;
+    }
+
+    uint64_t* src = reinterpret_cast<uint64_t*>(pa_to_va(entry & ENTRY_ADDR_MASK));
+    uint64_t* dst = reinterpret_cast<uint64_t*>(pa_to_va(reinterpret_cast<uint64_t>(page)));
+    uint64_t size = SIZE_4K << (9 * (level - 1));
+
+    for (int i = 0; i < 512 && *ok; i++) {
+        if (!(src[i] & PAGE_PRESENT)) continue;
+        uint64_t addr = va + i * size;
+
+        /* sharing is tracked per 4 KiB frame, so huge pages are split first */
+        if (level > 1 && (src[i] & PAGE_HUGE) && !split_huge(&src[i], size, addr, batch)) {
+            *ok = false;
+            break;
+        }
+
+        if (level > 1) {
+            dst[i] = clone_table(src[i], level - 1, addr, batch, ok);
+            continue;
+        }
+
+        /* frames the PMM does not own (device memory) stay shared and writable */
+        if (mem::pmm::share(reinterpret_cast<void*>(src[i] & ENTRY_ADDR_MASK)) && (src[i] & PAGE_RW)) {
+            src[i] = (src[i] & ~PAGE_RW) | PAGE_COW;
+            batch_add(batch, addr);
+        }
+        dst[i] = src[i];
+    }
+
+    return reinterpret_cast<uint64_t>(page) | (entry & (PAGE_PRESENT | PAGE_RW | PAGE_USER));
+}
+
+/* frees a user page table level and drops this address space's hold on every frame under it */
+static void free_user_table(uint64_t entry, int level) {
+    uint64_t* table = reinterpret_cast<uint64_t*>(pa_to_va(entry & ENTRY_ADDR_MASK));
+    uint64_t size = SIZE_4K << (9 * (level - 1));
+
+    for (int i = 0; i < 512; i++) {
+        if (!(table[i] & PAGE_PRESENT)) continue;
+
+        if (level == 1 || (table[i] & PAGE_HUGE)) {
+            uint64_t frame = table[i] & ENTRY_ADDR_MASK & ~(size - 1);
+            mem::pmm::free(reinterpret_cast<void*>(frame), size / SIZE_4K);
+        } else {
+            free_user_table(table[i], level - 1);
+        }
+    }
+
+    mem::pmm::free(reinterpret_cast<void*>(entry & ENTRY_ADDR_MASK), 1);
+}
+
 void* create_pagetable() {
-    void* page = mem::pmm::palloc(1);
+    void* page = mem::pmm::palloc_zeroed(1);
     if (!page) return nullptr;
 
     uint64_t va_page = pa_to_va(reinterpret_cast<uint64_t>(page));
-    mem::memset(reinterpret_cast<void*>(va_page), 0, 0x1000);
 
     uint64_t* new_pml4 = reinterpret_cast<uint64_t*>(va_page);
     uint64_t* orig_pml4 = reinterpret_cast<uint64_t*>(original_PML4);
@@ -66,12 +512,77 @@ void* create_pagetable() {
 }
 
 void destroy_pagetable(void* pml4_ptr) {
-    if (current_PML4 == reinterpret_cast<uint64_t>(pml4_ptr)) {
+    uint64_t* pml4 = reinterpret_cast<uint64_t*>(pa_to_va(reinterpret_cast<uint64_t>(pml4_ptr)));
+    if (this_pml4() == reinterpret_cast<uint64_t>(pml4)) {
         reset_pagetable();
     }
+
+    for (int i = 0; i < 256; i++) {
+        if (pml4[i] & PAGE_PRESENT) free_user_table(pml4[i], 3);
+    }
+
+    /* release the PCID, whoever gets it next flushes it on every CPU anyway */
+    if (pcid_enabled) {
+        uint64_t flags = arch::x86_64::misc::irq_save();
+        c_acquire_spinlock(&pcid_lock);
+        for (uint64_t i = 1; i < PCID_SLOTS; i++) {
+            if (pcid_slots[i].pml4 != reinterpret_cast<uint64_t>(pml4)) continue;
+
+            if (has_invpcid) invpcid(INVPCID_CONTEXT, i, 0);
+            pcid_slots[i].pml4 = 0;
+        }
+        c_release_spinlock(&pcid_lock);
+        arch::x86_64::misc::irq_restore(flags);
+    }
     mem::pmm::free(pml4_ptr, 1);
 }
 
+bool clone_user_space(uint64_t pml4) {
+    uint64_t* src = reinterpret_cast<uint64_t*>(this_pml4());
+    uint64_t* dst = reinterpret_cast<uint64_t*>(pml4);
+    bool ok = true;
+
+    tlb_batch batch;
+    batch_init(&batch);
+
+    for (int i = 0; i < 256 && ok; i++) {
+        if (src[i] & PAGE_PRESENT)
+            dst[i] = clone_table(src[i], 3, i * SIZE_1G * 512, &batch, &ok);
+    }
+
+    /* the parent's writable entries just went read-only */
+    batch_finish(&batch);
+    return ok;
+}
+
+bool handle_cow_fault(void* vaddr) {
+    uint64_t va = reinterpret_cast<uint64_t>(vaddr) & ~(SIZE_4K - 1);
+    uint64_t* entry;
+    if (lookup(va, &entry) != SIZE_4K || !entry || !(*entry & PAGE_COW)) return false;
+
+    uint64_t frame = *entry & ENTRY_ADDR_MASK;
+    uint64_t flags = (*entry & ENTRY_FLAGS_MASK & ~PAGE_COW) | PAGE_RW;
+
+    tlb_batch batch;
+    batch_init(&batch);
+
+    if (mem::pmm::share_count(reinterpret_cast<void*>(frame)) == 0) {
+        /* every other owner already copied or went away, take the frame over */
+        *entry = frame | flags;
+    } else {
+        void* copy = mem::pmm::palloc(1);
+        if (!copy) return false;
+
+        mem::memcpy(reinterpret_cast<void*>(pa_to_va(reinterpret_cast<uint64_t>(copy))), reinterpret_cast<void*>(pa_to_va(frame)), SIZE_4K);
+        *entry = reinterpret_cast<uint64_t>(copy) | flags;
+        batch_defer(&batch, frame, 1, false);
+    }
+
+    batch_add(&batch, va);
+    batch_finish(&batch);
+    return true;
+}
+
 uint64_t fetch_default_pagetable() {
     return default_PML4;
 }
@@ -91,6 +602,68 @@ void initialise() {
     original_PML4 = pa_to_va(cr3);
     default_PML4 = original_PML4;
     current_PML4 = original_PML4;
+
+    /*
+     * Process page tables copy the kernel half of the PML4 when they're made,
+     * so give every kernel slot a table now, anything mapped up there later
+     * (heap regions, kernel stacks) then shows up in all of them.
+     */
+    uint64_t* pml4 = reinterpret_cast<uint64_t*>(original_PML4);
+    for (int i = 256; i < 512; i++) {
+        if (pml4[i] & PAGE_PRESENT) continue;
+        void* table = mem::pmm::palloc_zeroed(1);
+        if (!table) break;
+        pml4[i] = reinterpret_cast<uint64_t>(table) | PAGE_PRESENT | PAGE_RW;
+    }
+
+    uint64_t cr0;
+    asm volatile("mov %%cr0, %0" : "=r"(cr0));
+    asm volatile("mov %0, %%cr0" :: "r"(cr0 | CR0_WP) : "memory");
+
+    arch::x86_64::misc::cpuid_ret ret = arch::x86_64::misc::cpuid(0x80000001, 0);
+    gb_pages = (ret.edx >> 26) & 1;
+    if (ret.edx & CPUID_FEAT_NX) {
+        arch::x86_64::misc::wrmsr(IA32_EFER, arch::x86_64::misc::rdmsr(IA32_EFER) | EFER_NXE);
+        nx_enabled = true;
+    }
+
+    ret = arch::x86_64::misc::cpuid(1, 0);
+    if ((ret.ecx >> 17) & 1) {
+        ret = arch::x86_64::misc::cpuid(7, 0);
+        has_invpcid = (ret.ebx >> 10) & 1;
+
+        /* CR4.PCIDE can only be set while CR3 carries PCID 0 */
+        uint64_t cr4;
+        asm volatile("mov %0, %%cr3" :: "r"(cr3 & ~0xFFFULL) : "memory");
+        asm volatile("mov %%cr4, %0" : "=r"(cr4));
+        asm volatile("mov %0, %%cr4" :: "r"(cr4 | CR4_PCIDE) : "memory");
+
+        pcid_slots[0].pml4 = original_PML4;
+        pcid_slots[0].stale_cpus = 0;
+        pcid_enabled = true;
+    }
+}
+
+void initialise_ap() {
+    /* ap_entry already moved onto the kernel's tables, load them again as PCID 0 before turning PCIDs on like the BSP did */
+    asm volatile("mov %0, %%cr3" :: "r"(va_to_pa(default_PML4)) : "memory");
+
+    uint64_t cr0;
+    asm volatile("mov %%cr0, %0" : "=r"(cr0));
+    asm volatile("mov %0, %%cr0" :: "r"(cr0 | CR0_WP) : "memory");
+
+    /* the BSP may already have NX entries in the shared kernel half */
+    if (nx_enabled)
+        arch::x86_64::misc::wrmsr(IA32_EFER, arch::x86_64::misc::rdmsr(IA32_EFER) | EFER_NXE);
+
+    if (pcid_enabled) {
+        uint64_t cr4;
+        asm volatile("mov %%cr4, %0" : "=r"(cr4));
+        asm volatile("mov %0, %%cr4" :: "r"(cr4 | CR4_PCIDE) : "memory");
+    }
+
+    cpu_unit* cpu = arch::x86_64::apic::get_current_cpu();
+    if (cpu) cpu->active_pml4 = default_PML4;
 }
 
 void print_mem() {}
@@ -108,99 +681,210 @@ void free(void* ptr, size_t npages) {
 }
 
 bool is_mapped(void* vaddr) {
+    uint64_t* entry;
+    lookup(reinterpret_cast<uint64_t>(vaddr), &entry);
+    return entry != nullptr;
+}
+
+uint64_t translate(void* vaddr) {
     uint64_t va = reinterpret_cast<uint64_t>(vaddr);
-    uint64_t* pml4 = reinterpret_cast<uint64_t*>(current_PML4);
-    
-    uint64_t pml4_entry = pml4[get_pml4_index(va)];
-    if (!(pml4_entry & PAGE_PRESENT)) return false;
-    
-    uint64_t* pdpt = reinterpret_cast<uint64_t*>(pa_to_va(pml4_entry & ~0xFFF));
-    uint64_t pdpt_entry = pdpt[get_pdpt_index(va)];
-    if (!(pdpt_entry & PAGE_PRESENT)) return false;
-    
-    uint64_t* pd = reinterpret_cast<uint64_t*>(pa_to_va(pdpt_entry & ~0xFFF));
-    uint64_t pd_entry = pd[get_pd_index(va)];
-    if (!(pd_entry & PAGE_PRESENT)) return false;
-    
-    uint64_t* pt = reinterpret_cast<uint64_t*>(pa_to_va(pd_entry & ~0xFFF));
-    return (pt[get_pt_index(va)] & PAGE_PRESENT) != 0;
+    uint64_t* entry;
+    uint64_t size = lookup(va, &entry);
+    if (!entry) return 0;
+
+    return ((*entry & ENTRY_ADDR_MASK) & ~(size - 1)) + (va & (size - 1));
 }
 
+/*
+ * Uses a 1 GiB or 2 MiB entry whenever both addresses are aligned to it and
+ * the rest of the range covers it, 4 KiB pages otherwise. Tables that a huge
+ * entry replaces are freed, huge entries that a smaller mapping lands in are
+ * split first.
+ */
 uint64_t mmap(void* paddr, void* vaddr, size_t npages, uint64_t attributes) {
     if (npages == 0) return 0;
     
     uint64_t va = reinterpret_cast<uint64_t>(vaddr);
     uint64_t pa = reinterpret_cast<uint64_t>(paddr);
+    uint64_t end = va + npages * SIZE_4K;
     uint64_t first_entry = 0;
 
-    bool is_user = (va < 0x0000800000000000ULL);
+    uint64_t flags = PAGE_PRESENT | (attributes & MMAP_ATTR_MASK);
+    if (!nx_enabled) flags &= ~PAGE_NX;
+
+    /* the tables above stay writable and executable, the leaf entry alone decides */
+    bool is_user = (flags & PAGE_USER) != 0;
+
+    tlb_batch batch;
+    batch_init(&batch);
 
-    for (size_t i = 0; i < npages; i++, va += 0x1000, pa += 0x1000) {
-        uint64_t* pml4 = reinterpret_cast<uint64_t*>(current_PML4);
-        uint64_t pml4_idx = get_pml4_index(va);
+    while (va < end) {
+        uint64_t* pml4 = reinterpret_cast<uint64_t*>(this_pml4());
+        uint64_t remaining = end - va;
+        uint64_t size;
+        uint64_t* entry;
+        uint64_t old;
 
-        uint64_t* pdpt = ensure_table_exists(pml4, pml4_idx, is_user);
+        uint64_t* pdpt = ensure_table_exists(pml4, get_pml4_index(va), is_user, SIZE_1G * 512, va, &batch);
         if (!pdpt) {
             printf("Failed to allocate PDPT for VA %p\n\r", (void*)va);
+            batch_finish(&batch);
             return 0;
         }
-        
-        uint64_t* pd = ensure_table_exists(pdpt, get_pdpt_index(va), is_user);
-        if (!pd) {
-            printf("Failed to allocate PD for VA %p\n\r", (void*)va);
-            return 0;
-        }
-        
-        uint64_t* pt = ensure_table_exists(pd, get_pd_index(va), is_user);
-        if (!pt) {
-            printf("Failed to allocate PT for VA %p\n\r", (void*)va);
-            return 0;
+
+        if (gb_pages && ((va | pa) & (SIZE_1G - 1)) == 0 && remaining >= SIZE_1G) {
+            entry = &pdpt[get_pdpt_index(va)];
+            old = *entry;
+            if ((old & PAGE_PRESENT) && !(old & PAGE_HUGE)) batch_defer(&batch, old, 2, true);
+            *entry = pa | flags | PAGE_HUGE;
+            size = SIZE_1G;
+        } else {
+            uint64_t* pd = ensure_table_exists(pdpt, get_pdpt_index(va), is_user, SIZE_1G, va, &batch);
+            if (!pd) {
+                printf("Failed to allocate PD for VA %p\n\r", (void*)va);
+                batch_finish(&batch);
+                return 0;
+            }
+
+            if (((va | pa) & (SIZE_2M - 1)) == 0 && remaining >= SIZE_2M) {
+                entry = &pd[get_pd_index(va)];
+                old = *entry;
+                if ((old & PAGE_PRESENT) && !(old & PAGE_HUGE)) batch_defer(&batch, old, 1, true);
+                *entry = pa | flags | PAGE_HUGE;
+                size = SIZE_2M;
+            } else {
+                uint64_t* pt = ensure_table_exists(pd, get_pd_index(va), is_user, SIZE_2M, va, &batch);
+                if (!pt) {
+                    printf("Failed to allocate PT for VA %p\n\r", (void*)va);
+                    batch_finish(&batch);
+                    return 0;
+                }
+
+                entry = &pt[get_pt_index(va)];
+                old = *entry;
+                *entry = (pa & ~0xFFF) | flags;
+                size = SIZE_4K;
+            }
         }
 
-        uint64_t flags = PAGE_PRESENT | PAGE_RW;
-        if (is_user) {
-            flags |= PAGE_USER;
+        if (!first_entry) {
+            first_entry = *entry;
         }
 
-        pt[get_pt_index(va)] = (pa & ~0xFFF) | flags;
+        /* a TLB never caches a non-present entry, only replaced mappings need flushing */
+        if (old & PAGE_PRESENT) batch_add(&batch, va);
+        va += size;
+        pa += size;
+    }
+
+    batch_finish(&batch);
+    return first_entry;
+}
+
+static void unmap_range(uint64_t va, uint64_t end, bool free_frames) {
+    tlb_batch batch;
+    batch_init(&batch);
 
-        if (i == 0) {
-            first_entry = pt[get_pt_index(va)];
+    while (va < end) {
+        uint64_t* entry;
+        uint64_t size = lookup(va, &entry);
+        uint64_t next = (va & ~(size - 1)) + size;
+
+        if (!entry) {
+            va = next;
+            continue;
         }
 
-        invlpg(va);
+        /* only part of a huge page goes away, split it and look again */
+        if (size > SIZE_4K && ((va & (size - 1)) || next > end)) {
+            if (!split_huge(entry, size, va, &batch)) {
+                printf("Failed to split huge page at VA %p\n\r", (void*)va);
+                break;
+            }
+            continue;
+        }
+
+        if (free_frames) batch_defer(&batch, (*entry & ENTRY_ADDR_MASK) & ~(size - 1), size / SIZE_4K, false);
+        *entry = 0;
+        batch_add(&batch, va);
+        va = next;
     }
 
-    return first_entry;
+    batch_finish(&batch);
 }
 
 void munmap(void* vaddr, size_t npages) {
     uint64_t va = reinterpret_cast<uint64_t>(vaddr);
+    unmap_range(va, va + npages * SIZE_4K, false);
+}
 
-    for (size_t i = 0; i < npages; i++, va += 0x1000) {
-        uint64_t* pml4 = reinterpret_cast<uint64_t*>(current_PML4);
-        uint64_t pml4_entry = pml4[get_pml4_index(va)];
-        if (!(pml4_entry & PAGE_PRESENT)) continue;
+uint64_t mmap_anonymous(void* vaddr, size_t npages, uint64_t attributes) {
+    uint64_t va = reinterpret_cast<uint64_t>(vaddr);
+    uint64_t end = va + npages * SIZE_4K;
+    uint64_t first_entry = 0;
 
-        uint64_t* pdpt = reinterpret_cast<uint64_t*>(pa_to_va(pml4_entry & ~0xFFF));
-        uint64_t pdpt_entry = pdpt[get_pdpt_index(va)];
-        if (!(pdpt_entry & PAGE_PRESENT)) continue;
+    while (va < end) {
+        uint64_t remaining = end - va;
+        size_t chunk = 1;
+        void* frames = nullptr;
 
-        uint64_t* pd = reinterpret_cast<uint64_t*>(pa_to_va(pdpt_entry & ~0xFFF));
-        uint64_t pd_entry = pd[get_pd_index(va)];
-        if (!(pd_entry & PAGE_PRESENT)) continue;
+        /* buddy blocks are naturally aligned, so a 512 or 262144 page run can back a huge entry */
+        if (gb_pages && (va & (SIZE_1G - 1)) == 0 && remaining >= SIZE_1G) {
+            frames = mem::pmm::palloc_zeroed(SIZE_1G / SIZE_4K);
+            if (frames) chunk = SIZE_1G / SIZE_4K;
+        }
+        if (!frames && (va & (SIZE_2M - 1)) == 0 && remaining >= SIZE_2M) {
+            frames = mem::pmm::palloc_zeroed(SIZE_2M / SIZE_4K);
+            if (frames) chunk = SIZE_2M / SIZE_4K;
+        }
+        if (!frames) frames = mem::pmm::palloc_zeroed(1);
 
-        uint64_t* pt = reinterpret_cast<uint64_t*>(pa_to_va(pd_entry & ~0xFFF));
-        pt[get_pt_index(va)] = 0;
-        
-        invlpg(va);
+        uint64_t entry = frames ? mmap(frames, reinterpret_cast<void*>(va), chunk, attributes) : 0;
+        if (!entry) {
+            if (frames) mem::pmm::free(frames, chunk);
+            munmap_anonymous(vaddr, (va - reinterpret_cast<uint64_t>(vaddr)) / SIZE_4K);
+            return 0;
+        }
+
+        if (!first_entry) first_entry = entry;
+        va += chunk * SIZE_4K;
     }
+
+    return first_entry;
+}
+
+void munmap_anonymous(void* vaddr, size_t npages) {
+    uint64_t va = reinterpret_cast<uint64_t>(vaddr);
+    unmap_range(va, va + npages * SIZE_4K, true);
+}
+
+__attribute__((interrupt))
+void tlb_shootdown_handler(void*) {
+    shootdown_service();
+    arch::x86_64::cpu::idt::send_eoi(0);
 }
 
 void switch_pagetable(uint64_t ptr) {
     uint64_t phys = va_to_pa(ptr);
+    uint64_t flags = arch::x86_64::misc::irq_save();
+    c_acquire_spinlock(&pcid_lock);
+
+    if (pcid_enabled) {
+        uint64_t pcid = pcid_of(ptr);
+        uint64_t bit = this_cpu_bit();
+        phys |= pcid;
+        /* test and clear in one go, a mark landing in between is either seen now or kept for the next load */
+        if (!(__atomic_fetch_and(&pcid_slots[pcid].stale_cpus, ~bit, __ATOMIC_ACQ_REL) & bit)) phys |= CR3_NOFLUSH;
+    }
+
     asm volatile("mov %0, %%cr3" :: "r"(phys) : "memory");
     current_PML4 = ptr;
+
+    cpu_unit* cpu = arch::x86_64::apic::get_current_cpu();
+    if (cpu) cpu->active_pml4 = ptr;
+
+    c_release_spinlock(&pcid_lock);
+    arch::x86_64::misc::irq_restore(flags);
 }
 
 void reset_pagetable() {
@@ -208,7 +892,7 @@ void reset_pagetable() {
 }
 
 uint64_t get_cr3() {
-	return current_PML4;
+	return this_pml4();
 }
 
 }
@@ -17,16 +17,35 @@ uint64_t pa_to_va(uint64_t pa);
 uint64_t va_to_pa(uint64_t va);
 		
 void initialise();
+// gives an AP the same paging setup the BSP got from initialise
+void initialise_ap();
 void print_mem();
 void* valloc(size_t npages);
 void free(void* ptr, size_t npages);
 uint64_t mmap(void* paddr, void* vaddr, size_t npages, uint64_t attributes);
 void munmap(void* vaddr, size_t npages);
 
+// maps npages of fresh zeroed frames at vaddr, huge pages are used where vaddr allows it
+uint64_t mmap_anonymous(void* vaddr, size_t npages, uint64_t attributes);
+// unmaps a range and gives its frames back to the PMM
+void munmap_anonymous(void* vaddr, size_t npages);
+
+// physical address vaddr is mapped to, 0 if it isn't
+uint64_t translate(void* vaddr);
+
 bool is_mapped(void* vaddr);
 
+// copies the current user half into pml4, writable pages end up shared copy-on-write by both
+bool clone_user_space(uint64_t pml4);
+// gives a write fault on a copy-on-write page its own frame, false if vaddr isn't one
+bool handle_cow_fault(void* vaddr);
+
 uint64_t get_cr3();
 
+// flushes this CPU's part of a TLB shootdown, installed on TLB_SHOOTDOWN_VECTOR
+__attribute__((interrupt))
+void tlb_shootdown_handler(void*);
+
 }
 
 #endif /* VMM_HPP */
@@ -41,6 +41,8 @@ uint32_t total_devices = 0;
 pcie_device* first_device = nullptr;
 uint64_t num_devs = 0;
 
+static mem::slab::cache* device_cache = nullptr;
+
 void install_pcie_device(pcie_device* dev) {
     dev->next = first_device;
     first_device = dev;
@@ -92,7 +94,8 @@ void enumerate_devices() {
                         continue;
                     }
                     
-                    pcie_device* dev = (pcie_device*)mem::heap::malloc(sizeof(pcie_device));
+                    if (!device_cache) device_cache = mem::slab::create("pcie_device", sizeof(pcie_device));
+                    pcie_device* dev = (pcie_device*)mem::slab::alloc(device_cache);
                     dev->segment = segment;
                     dev->bus = bus;
                     dev->device = device;
@@ -167,7 +170,7 @@ void cleanup() {
     pcie_device* curr = first_device;
     while (curr) {
         pcie_device* next = curr->next;
-        mem::heap::free(curr);
+        mem::slab::free(device_cache, curr);
         curr = next;
     }
     first_device = nullptr;
@@ -3,6 +3,21 @@
 #include <ramfs/ramfs.hpp>
 #include <cstring>
 #include <arch/arch.hpp>
+#include <error.hpp>
+#include <arch/x86_64/syscall/syscall.hpp>
+
+extern "C" {
+#include <proc/spinlocks.h>
+}
+
+#define PAGE_SIZE 0x1000ULL
+
+/* the selectors sysretq and execute_ring3 leave user code with */
+#define USER_CS 0x23
+#define USER_SS 0x1B
+
+/* argv and envp strings together may take at most this much of a new stack */
+#define EXEC_ARGS_MAX (USER_STACK_PAGES * PAGE_SIZE / 4)
 
 namespace proc {
 
@@ -10,32 +25,84 @@ static Process proc_table[PROC_MAX];
 static Process* current_proc = nullptr;
 static pid_t next_pid = 1;
 
+/* covers claiming slots in proc_table and handing out pids */
+static spinlock proc_lock = {
+    "PROC",
+    0
+};
+
+/* only reserves the range, pages are faulted in through the stack's area */
+static void* new_user_stack(Process* p) {
+    if (!vma_insert(p, USER_STACK_TOP - USER_STACK_PAGES * PAGE_SIZE, USER_STACK_TOP, VMA_READ | VMA_WRITE, VMA_STACK))
+        return nullptr;
+
+    return reinterpret_cast<void*>(USER_STACK_TOP);
+}
+
+/* unmaps everything but the stack from the current address space, which has to be p's own */
+static void release_user_memory(Process* p) {
+    vma* v = vma_first(p);
+    while (v) {
+        vma* next = vma_next(v);
+        if (v->kind != VMA_STACK) vma_remove(p, v);
+        v = next;
+    }
+
+    p->heap_size = 0;
+}
+
+/* tearing the page table down frees every frame it maps, so the areas only need forgetting */
+static void destroy_address_space(Process* p) {
+    vma_drop_all(p);
+
+    if (p->pagetable && !p->borrowed)
+        mem::vmm::destroy_pagetable(reinterpret_cast<void*>(mem::vmm::va_to_pa(p->pagetable)));
+
+    p->pagetable = 0;
+    p->borrowed = false;
+    p->stack_top = nullptr;
+    p->stack = nullptr;
+    p->heap_size = 0;
+}
+
 void initialise() {
     // Clear process table
     for (int i = 0; i < PROC_MAX; i++) {
         proc_table[i].pid = 0;
         proc_table[i].state = PROC_UNUSED;
         proc_table[i].stack = nullptr;
+        proc_table[i].stack_top = nullptr;
         proc_table[i].heap_base = nullptr;
         proc_table[i].heap_size = 0;
         proc_table[i].entry_point = nullptr;
         proc_table[i].user = false;
+        proc_table[i].vmas = nullptr;
+        proc_table[i].pagetable = 0;
+        proc_table[i].borrowed = false;
+        proc_table[i].threads = nullptr;
     }
 
     Process* first = &proc_table[0];
     first->pid = 1;
     first->state = PROC_READY;
-    first->stack = stack_manager_get_new_stack(2);
-    first->heap_base = mem::vmm::valloc(1);
-    first->heap_size = 0x1000;
+
+    void* pml4 = mem::vmm::create_pagetable();
+    if (pml4) first->pagetable = mem::vmm::pa_to_va(reinterpret_cast<uint64_t>(pml4));
+
+    first->stack_top = new_user_stack(first);
+    first->stack = first->stack_top;
+    first->heap_base = reinterpret_cast<void*>(USER_BRK_BASE);
+    first->heap_size = 0;
     first->entry_point = nullptr;
     first->user = true;
 
     current_proc = first;
 }
 
+/* current_proc only stands in until the scheduler has adopted pid 1 */
 Process* get_current() {
-    return current_proc;
+    Thread* t = sched::current();
+    return t ? t->proc : current_proc;
 }
 
 Process* get_process(uint64_t pid) {
@@ -47,44 +114,102 @@ Process* get_process(uint64_t pid) {
 }
 
 static Process* allocate_process() {
+    Process* p = nullptr;
+    bool reap = false;
+
+    uint64_t flags = arch::x86_64::misc::irq_save();
+    c_acquire_spinlock(&proc_lock);
     for (int i = 0; i < PROC_MAX; i++) {
-        if (proc_table[i].state == PROC_UNUSED) {
-            proc_table[i].pid = next_pid++;
-            proc_table[i].state = PROC_READY;
-            return &proc_table[i];
+        /* a terminated process may still be sitting on its stack until someone reuses the slot */
+        reap = proc_table[i].state == PROC_TERMINATED && !__atomic_load_n(&proc_table[i].threads, __ATOMIC_ACQUIRE);
+
+        if (reap || proc_table[i].state == PROC_UNUSED) {
+            p = &proc_table[i];
+            p->pid = next_pid++;
+            p->state = PROC_READY;
+            break;
         }
     }
-    return nullptr;
-}
+    c_release_spinlock(&proc_lock);
+    arch::x86_64::misc::irq_restore(flags);
 
-static void copy_stack(void* dst, void* src, size_t size) {
-    mem::memcpy(dst, src, size);
+    /* the slot is ours now, the old address space can go without the lock held */
+    if (reap) destroy_address_space(p);
+    return p;
 }
 
-static void copy_heap(Process* dst, Process* src) {
-    if (src->heap_base && src->heap_size > 0) {
-        dst->heap_base = mem::heap::malloc(src->heap_size);
-        if (dst->heap_base) {
-            mem::memcpy(dst->heap_base, src->heap_base, src->heap_size);
-            dst->heap_size = src->heap_size;
-        }
-    }
+/* the child's only thread comes back from the parent's syscall with 0 in rax */
+static bool start_child(Process* child) {
+    Thread* self = sched::current();
+    if (!self || !self->syscall) return false;
+
+    syscall_regs* regs = self->syscall;
+    ThreadContext context = {};
+    context.rbx = regs->rbx;
+    context.rbp = regs->rbp;
+    context.r12 = regs->r12;
+    context.r13 = regs->r13;
+    context.r14 = regs->r14;
+    context.r15 = regs->r15;
+    context.rdi = regs->rdi;
+    context.rsi = regs->rsi;
+    context.rdx = regs->rdx;
+    context.r10 = regs->r10;
+    context.r8 = regs->r8;
+    context.r9 = regs->r9;
+    context.rax = 0;
+
+    context.rip = regs->rcx;
+    context.cs = USER_CS;
+    context.rflags = regs->r11;
+    context.rsp = reinterpret_cast<uint64_t>(regs + 1);
+    context.ss = USER_SS;
+
+    return sched::create_user_thread(child, &context) != nullptr;
 }
 
+/*
+ * The child gets its own page table sharing every frame with the parent,
+ * writable pages go read-only in both and are copied by whichever side
+ * writes first.
+ */
 pid_t fork() {
     Process* parent = get_current();
+
+    void* pml4 = mem::vmm::create_pagetable();
+    if (!pml4) return -1;
+
     Process* child = allocate_process();
-    if (!child) return -1;
+    if (!child) {
+        mem::vmm::destroy_pagetable(pml4);
+        return -1;
+    }
 
+    pid_t pid = child->pid;
     *child = *parent;
-    child->pid = next_pid++;
-
-    child->stack = stack_manager_get_new_stack(2, parent->user);
-    if (child->stack) {
-        copy_stack(child->stack, parent->stack, 2 * 4096);
+    child->pid = pid;
+    child->state = PROC_READY;
+    child->vmas = nullptr;
+    child->borrowed = false;
+    child->threads = nullptr;
+    child->pagetable = mem::vmm::pa_to_va(reinterpret_cast<uint64_t>(pml4));
+
+    /* the clone reads whatever address space is loaded */
+    if (parent->pagetable) mem::vmm::switch_pagetable(parent->pagetable);
+
+    if (!vma_clone(child, parent) || !mem::vmm::clone_user_space(child->pagetable)) {
+        destroy_address_space(child);
+        child->state = PROC_UNUSED;
+        child->pid = 0;
+        return -1;
     }
 
-    copy_heap(child, parent);
+    if (!start_child(child)) {
+        destroy_address_space(child);
+        child->state = PROC_UNUSED;
+        child->pid = 0;
+        return -1;
+    }
 
     return child->pid;
 }
@@ -94,16 +219,139 @@ pid_t vfork() {
     Process* child = allocate_process();
     if (!child) return -1;
 
+    pid_t pid = child->pid;
     *child = *parent;
-    child->pid = next_pid++;
+    child->pid = pid;
+    child->state = PROC_READY;
+    child->threads = nullptr;
 
     child->stack = parent->stack;
     child->heap_base = parent->heap_base;
     child->heap_size = parent->heap_size;
+    /* the child borrows the parent's memory, it must not tear it down */
+    child->vmas = nullptr;
+    child->borrowed = true;
 
     return child->pid;
 }
 
+/* the new image and the arguments for it, kept in kernel memory while the old image is torn down */
+struct exec_args {
+    void* image;
+    size_t size;
+    int argc;
+    int envc;
+    size_t bytes; /* of all the strings, terminators included */
+    char** argv;
+    char** envp;
+};
+
+static exec_args* copy_exec_args(int argc, char** argv, char** envp) {
+    if (!argv || argc < 0) argc = 0;
+    int envc = 0;
+    while (envp && envp[envc]) envc++;
+
+    size_t bytes = 0;
+    for (int i = 0; i < argc; i++) bytes += strlen(argv[i]) + 1;
+    for (int i = 0; i < envc; i++) bytes += strlen(envp[i]) + 1;
+
+    size_t vectors = (argc + envc + 2) * sizeof(char*);
+    if (bytes + vectors > EXEC_ARGS_MAX) return nullptr;
+
+    exec_args* args = (exec_args*)mem::heap::malloc(sizeof(exec_args) + vectors + bytes);
+    if (!args) return nullptr;
+
+    args->argc = argc;
+    args->envc = envc;
+    args->bytes = bytes;
+    args->argv = reinterpret_cast<char**>(args + 1);
+    args->envp = args->argv + argc + 1;
+
+    char* out = reinterpret_cast<char*>(args->envp + envc + 1);
+    for (int i = 0; i < argc; i++) {
+        size_t n = strlen(argv[i]) + 1;
+        mem::memcpy(out, argv[i], n);
+        args->argv[i] = out;
+        out += n;
+    }
+    args->argv[argc] = nullptr;
+
+    for (int i = 0; i < envc; i++) {
+        size_t n = strlen(envp[i]) + 1;
+        mem::memcpy(out, envp[i], n);
+        args->envp[i] = out;
+        out += n;
+    }
+    args->envp[envc] = nullptr;
+
+    return args;
+}
+
+/*
+ * Lays the strings and the NULL terminated argv and envp vectors out under
+ * top, then the argc, argv and envp words the image finds on its stack.
+ */
+static uint64_t build_user_stack(uint64_t top, exec_args* args) {
+    uint64_t sp = (top - args->bytes) & ~7ULL;
+    char* out = reinterpret_cast<char*>(sp);
+
+    sp -= (args->argc + args->envc + 2) * sizeof(char*);
+    char** argv = reinterpret_cast<char**>(sp);
+    char** envp = argv + args->argc + 1;
+
+    for (int i = 0; i < args->argc; i++) {
+        size_t n = strlen(args->argv[i]) + 1;
+        mem::memcpy(out, args->argv[i], n);
+        argv[i] = out;
+        out += n;
+    }
+    argv[args->argc] = nullptr;
+
+    for (int i = 0; i < args->envc; i++) {
+        size_t n = strlen(args->envp[i]) + 1;
+        mem::memcpy(out, args->envp[i], n);
+        envp[i] = out;
+        out += n;
+    }
+    envp[args->envc] = nullptr;
+
+    sp &= ~15ULL;
+    sp -= 8;
+    *(uint64_t*)sp = (uint64_t)args->argc;
+    sp -= 8;
+    *(uint64_t*)sp = (uint64_t)argv;
+    sp -= 8;
+    *(uint64_t*)sp = (uint64_t)envp;
+    return sp;
+}
+
+/* drops the old image, stack included, and enters the new one on a freshly reserved stack */
+[[noreturn]] static void finish_execve(exec_args* args) {
+    Process* proc = get_current();
+
+    vma_remove_all(proc);
+    proc->heap_base = reinterpret_cast<void*>(USER_BRK_BASE);
+    proc->heap_size = 0;
+
+    proc->stack_top = new_user_stack(proc);
+    if (!proc->stack_top) {
+        mem::heap::free(args->image);
+        mem::heap::free(args);
+        exit(-1);
+    }
+
+    /* the pages are faulted in through the new stack's area as they're written */
+    proc->stack = reinterpret_cast<void*>(build_user_stack(reinterpret_cast<uint64_t>(proc->stack_top), args));
+    proc->entry_point = get_elf_entry_point_user(args->image, args->size, proc->stack, &proc->stack);
+
+    mem::heap::free(args->image);
+    mem::heap::free(args);
+    if (!proc->entry_point) exit(-1);
+
+    arch::x86_64::ringctl::execute_ring3((void(*)())proc->entry_point, proc->stack);
+    __builtin_unreachable();
+}
+
 int execve(const char* path, int argc, char** argv, char** envp) {
     Process* proc = get_current();
     void* buf = nullptr;
@@ -132,55 +380,54 @@ int execve(const char* path, int argc, char** argv, char** envp) {
     }
     ramfs::close(fd);
 
-    if (proc->stack) destroy_stack(proc->stack);
-    if (proc->heap_base) mem::heap::free(proc->heap_base);
+    if (proc->pagetable) mem::vmm::switch_pagetable(proc->pagetable);
 
-    proc->stack = stack_manager_get_new_stack(2, true);
-    proc->heap_base = nullptr;
-    proc->heap_size = 0;
+    /* everything still needed from the old image is copied out before any of it goes away */
+    exec_args* args = copy_exec_args(argc, argv, envp);
+    if (!args) {
+        mem::heap::free(buf);
+        return -1;
+    }
+    args->image = buf;
+    args->size = size;
+
+    /* syscalls run on the caller's stack, which is torn down with the rest, so finish on the kernel stack */
+    Thread* self = sched::current();
+    uint64_t rsp;
+    asm volatile("mov %%rsp, %0" : "=r"(rsp));
+    if (self && self->rsp0 && rsp < USER_STACK_TOP) {
+        asm volatile(
+            "mov %0, %%rsp\n"
+            "call *%1"
+            :
+            : "r"(self->rsp0), "r"(&finish_execve), "D"(args)
+            : "memory"
+        );
+        __builtin_unreachable();
+    }
 
-	proc->stack -= 8;
-	*(uint64_t*)proc->stack = (uint64_t)argc;
-	proc->stack -= 8;
-	*(uint64_t*)proc->stack = (uint64_t)argv;
-	proc->stack -= 8;
-	*(uint64_t*)proc->stack = (uint64_t)envp;
-
-    proc->entry_point = get_elf_entry_point_user(buf, size, proc->stack, &proc->stack);
-	
-	arch::x86_64::ringctl::execute_ring3((void(*)())proc->entry_point, proc->stack);
-    
-    return 0;
+    finish_execve(args);
 }
 
 void exit(int status) {
     Process* proc = get_current();
     proc->state = PROC_TERMINATED;
 
-    if (proc->stack) {
-        destroy_stack(proc->stack);
-        proc->stack = nullptr;
-    }
-    if (proc->heap_base) {
-        mem::heap::free(proc->heap_base);
-        proc->heap_base = nullptr;
-        proc->heap_size = 0;
-    }
+    /* we're still running on the stack, allocate_process frees it when the slot is reused */
+    release_user_memory(proc);
 
-    schedule();
+    sched::exit_thread();
 }
 
 void schedule() {
-    for (int i = 0; i < PROC_MAX; i++) {
-        if (proc_table[i].state == PROC_READY) {
-            current_proc = &proc_table[i];
-            current_proc->state = PROC_RUNNING;
-            return;
-        }
-    }
-    while (true) asm volatile("hlt");
+    sched::yield();
 }
 
+/*
+ * The break lives at USER_BRK_BASE and only moves the end of its area,
+ * pages are backed on first touch and freed when the break shrinks.
+ * addr is the new absolute break, anything below the base is refused.
+ */
 int brk(void* addr) {
     Process* proc = get_current();
     if (!proc) return -1;
@@ -188,25 +435,21 @@ int brk(void* addr) {
     uintptr_t heap_start = (uintptr_t)proc->heap_base;
     uintptr_t new_end = (uintptr_t)addr;
 
-    if (!proc->heap_base) {
-        if (new_end == 0) return 0;
-        size_t size = new_end;
-        proc->heap_base = mem::heap::malloc(size);
-        if (!proc->heap_base) return -1;
-        proc->heap_size = size;
-        return 0;
-    }
-
-    if (new_end < heap_start) {
+    if (new_end == 0) return 0;
+    if (new_end < heap_start) return -1;
+    if (new_end > heap_start + USER_BRK_SPAN) return -1;
+
+    vma* area = vma_find(proc, heap_start);
+    if (!area) {
+        if (new_end == heap_start) return 0;
+        if (!vma_insert(proc, heap_start, new_end, VMA_READ | VMA_WRITE, VMA_BRK)) return -1;
+    } else if (new_end == heap_start) {
+        vma_remove(proc, area);
+    } else if (!vma_resize(proc, area, new_end)) {
         return -1;
     }
 
-    size_t new_size = new_end - heap_start;
-    void* new_heap = mem::heap::realloc(proc->heap_base, new_size);
-    if (!new_heap && new_size > 0) return -1;
-
-    proc->heap_base = new_heap;
-    proc->heap_size = new_size;
+    proc->heap_size = new_end - heap_start;
     return 0;
 }
 
@@ -223,4 +466,48 @@ void* sbrk(ssize_t n) {
     return (void*)current_end;
 }
 
+/*
+ * Only anonymous mappings exist so far, they're reserved here and backed
+ * page by page from the fault handler, which maps them with the area's
+ * PROT bits. MAP_SHARED is accepted but behaves like MAP_PRIVATE across fork.
+ */
+void* mmap(void* addr, size_t len, int prot, int flags, fd_t fd, off_t off) {
+    (void)fd; (void)off;
+
+    Process* proc = get_current();
+    if (!proc || len == 0) return (void*)-EINVAL;
+    if (!(flags & MAP_ANONYMOUS)) return (void*)-ENODEV;
+
+    uint64_t hint = reinterpret_cast<uint64_t>(addr);
+    uint64_t size = (len + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+    uint64_t limit = USER_STACK_TOP - USER_STACK_PAGES * PAGE_SIZE;
+
+    if (flags & MAP_FIXED) {
+        if ((hint & (PAGE_SIZE - 1)) || hint + size > limit || hint + size < hint) return (void*)-EINVAL;
+        vma_unmap(proc, hint, hint + size);
+    } else {
+        /* take the hint if it's free, otherwise the first gap above USER_MMAP_BASE */
+        hint &= ~(PAGE_SIZE - 1);
+        if (hint < USER_MMAP_BASE || hint + size > limit || vma_first_overlap(proc, hint, hint + size)) {
+            hint = USER_MMAP_BASE;
+            vma* v;
+            while (hint + size <= limit && (v = vma_first_overlap(proc, hint, hint + size)))
+                hint = (v->end + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+            if (hint + size > limit) return (void*)-ENOMEM;
+        }
+    }
+
+    if (!vma_insert(proc, hint, hint + size, prot & (VMA_READ | VMA_WRITE | VMA_EXEC), VMA_ANON)) return (void*)-ENOMEM;
+    return reinterpret_cast<void*>(hint);
+}
+
+int munmap(void* addr, size_t len) {
+    Process* proc = get_current();
+    uint64_t start = reinterpret_cast<uint64_t>(addr);
+    if (!proc || len == 0 || (start & (PAGE_SIZE - 1))) return -EINVAL;
+
+    uint64_t end = start + ((len + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1));
+    return vma_unmap(proc, start, end) ? 0 : -ENOMEM;
+}
+
 }
@@ -5,9 +5,22 @@
 #include <cstddef>
 #include <exec/elf.hpp>
 #include <types.hpp>
+#include <proc/vma.hpp>
+#include <proc/sched.hpp>
 
 #define PROC_MAX 64
 
+/* every process has its own address space, so the stack and brk sit at the same place in all of them */
+#define USER_STACK_TOP 0x00007FFFFFFFF000ULL
+/* user stacks are reserved this big but only backed as they're touched */
+#define USER_STACK_PAGES 64
+
+#define USER_BRK_BASE 0x0000100000000000ULL
+#define USER_BRK_SPAN 0x40000000ULL
+
+/* mmap places areas from here up when it isn't given a usable address */
+#define USER_MMAP_BASE 0x0000200000000000ULL
+
 enum ProcessState {
     PROC_UNUSED,
     PROC_READY,
@@ -20,10 +33,15 @@ struct Process {
     pid_t pid;
     ProcessState state;
     void* stack;
+    void* stack_top;
     void* heap_base;
     size_t heap_size;
     void* entry_point;
     bool user;
+    vma* vmas;
+    uint64_t pagetable;
+    bool borrowed; /* a vfork child running in its parent's address space */
+    Thread* threads; /* the slot can't be reused until the last of these is gone */
 };
 
 namespace proc {
@@ -42,6 +60,9 @@ Process* get_process(uint64_t pid);
 int brk(void* addr);
 void* sbrk(ssize_t n);
 
+void* mmap(void* addr, size_t len, int prot, int flags, fd_t fd, off_t off);
+int munmap(void* addr, size_t len);
+
 }
 
 #endif
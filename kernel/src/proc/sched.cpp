@@ -0,0 +1,611 @@
+#include "sched.hpp"
+#include "proc.hpp"
+#include <mem/mem.hpp>
+#include <arch/arch.hpp>
+#include <arch/x86_64/apic/apic.hpp>
+#include <exec/elf.hpp>
+#include <cstdio>
+
+extern "C" {
+#include <proc/spinlocks.h>
+}
+
+#if CONFIG_SCHED_QUANTUM_MS == 0
+#	error "CONFIG_SCHED_QUANTUM_MS cannot be 0"
+#endif
+
+#define KERNEL_CS 0x08
+#define KERNEL_SS 0x10
+#define RFLAGS_IF 0x202
+
+extern "C" void sched_yield_interrupt_handler();
+
+/* one per CPU, taken with interrupts off. The owner takes from the head and puts preempted threads back at the tail,
+   so the head is whatever has waited longest, the coldest in cache and the first to be stolen */
+struct sched_queue {
+    spinlock lock;
+    Thread* head;
+    Thread* tail;
+    volatile uint32_t length; /* read without the lock to choose where to place and steal from */
+    uint64_t steals;          /* threads this CPU took from other queues */
+};
+
+namespace proc::sched {
+
+static Thread thread_table[THREAD_MAX];
+static tid_t next_tid = 1;
+
+/* covers the thread table, only taken with interrupts off and never with a queue lock nested inside it */
+static spinlock table_lock = {
+    "SCHED",
+    0
+};
+
+static sched_queue* new_queue() {
+    /* a cache line each, so one CPU's queue lock doesn't bounce another's */
+    sched_queue* q = (sched_queue*)mem::heap::malloc_aligned(sizeof(sched_queue), 64);
+    if (!q) return nullptr;
+
+    mem::memset(q, 0, sizeof(sched_queue));
+    mem::memcpy(q->lock.name, "RUNQ", 5);
+    return q;
+}
+
+static void push_tail(sched_queue* q, Thread* t) {
+    t->next = nullptr;
+    if (q->tail) q->tail->next = t;
+    else q->head = t;
+    q->tail = t;
+    q->length = q->length + 1;
+}
+
+static Thread* pop_head(sched_queue* q) {
+    Thread* t = q->head;
+    if (!t) return nullptr;
+
+    q->head = t->next;
+    if (!q->head) q->tail = nullptr;
+    t->next = nullptr;
+    q->length = q->length - 1;
+    return t;
+}
+
+/* a free slot for p, set up as far as it can be without leaving the lock */
+static Thread* claim_slot(Process* p) {
+    for (int i = 0; i < THREAD_MAX; i++) {
+        Thread* t = &thread_table[i];
+        if (t->state != THREAD_UNUSED || t->on_cpu) continue;
+
+        t->tid = next_tid++;
+        t->state = THREAD_BLOCKED;
+        t->proc = p;
+        t->context = nullptr;
+        t->syscall = nullptr;
+        t->quantum = CONFIG_SCHED_QUANTUM_MS;
+        t->cpu = nullptr;
+        t->idle = false;
+        t->pinned = false;
+        t->next = nullptr;
+        t->next_in_proc = nullptr;
+        t->waiting_on = nullptr;
+        t->next_waiter = nullptr;
+        t->wait_armed = false;
+        t->woken = false;
+        t->sleep_list = nullptr;
+        t->next_sleeper = nullptr;
+        if (p) {
+            t->next_in_proc = p->threads;
+            p->threads = t;
+        }
+        return t;
+    }
+    return nullptr;
+}
+
+/* the slot keeps its kernel stack, whoever gets it next reuses that */
+static void release_slot(Thread* t) {
+    if (t->proc) {
+        Thread** link = &t->proc->threads;
+        while (*link && *link != t) link = &(*link)->next_in_proc;
+        if (*link) *link = t->next_in_proc;
+    }
+
+    t->proc = nullptr;
+    t->context = nullptr;
+    t->next_in_proc = nullptr;
+    t->state = THREAD_UNUSED;
+}
+
+/* a thread of p with its own kernel stack and a zeroed frame at the top of it, not queued yet */
+static Thread* new_thread(Process* p) {
+    uint64_t flags = arch::x86_64::misc::irq_save();
+    c_acquire_spinlock(&table_lock);
+    Thread* t = claim_slot(p);
+    c_release_spinlock(&table_lock);
+    arch::x86_64::misc::irq_restore(flags);
+    if (!t) return nullptr;
+
+    /* mapping a stack may shoot down TLBs, which can't be done with the lock held */
+    if (!t->stack_top) t->stack_top = stack_manager_get_new_stack(THREAD_STACK_PAGES, false);
+    if (!t->stack_top) {
+        flags = arch::x86_64::misc::irq_save();
+        c_acquire_spinlock(&table_lock);
+        release_slot(t);
+        c_release_spinlock(&table_lock);
+        arch::x86_64::misc::irq_restore(flags);
+        return nullptr;
+    }
+
+    t->rsp0 = (uint64_t)t->stack_top;
+    t->context = (ThreadContext*)((uint64_t)t->stack_top - sizeof(ThreadContext));
+    mem::memset(t->context, 0, sizeof(ThreadContext));
+    t->context->frame = (uint64_t)&t->context->rip;
+    return t;
+}
+
+/* turns whatever is running on cpu into a thread, it keeps the stack it's on */
+static Thread* adopt(cpu_unit* cpu, Process* p, bool idle) {
+    uint64_t flags = arch::x86_64::misc::irq_save();
+    c_acquire_spinlock(&table_lock);
+    Thread* t = claim_slot(p);
+    c_release_spinlock(&table_lock);
+
+    if (t) {
+        t->state = THREAD_RUNNING;
+        t->idle = idle;
+        t->on_cpu = true;
+        t->rsp0 = arch::x86_64::cpu::gdt::get_stack();
+        t->cpu = cpu;
+        cpu->current_thread = t;
+        cpu->current_thread_id = t->tid;
+        if (idle) cpu->idle_thread = t;
+    }
+
+    arch::x86_64::misc::irq_restore(flags);
+    return t;
+}
+
+[[noreturn]] static void thread_start(void (*entry)(void*), void* arg) {
+    entry(arg);
+    exit_thread();
+}
+
+static void idle_entry(void*) {
+    idle();
+}
+
+/* a frame that iretq's into thread_start(entry, arg) in ring 0 */
+static void start_in_kernel(Thread* t, void (*entry)(void*), void* arg) {
+    ThreadContext* c = t->context;
+    c->rip = (uint64_t)thread_start;
+    c->cs = KERNEL_CS;
+    c->ss = KERNEL_SS;
+    c->rflags = RFLAGS_IF;
+    c->rsp = (uint64_t)c - 8; /* as if thread_start had been called */
+    c->rdi = (uint64_t)entry;
+    c->rsi = (uint64_t)arg;
+}
+
+static void drop(Thread* t) {
+    if (t->on_cpu) return;
+
+    c_acquire_spinlock(&table_lock);
+    release_slot(t);
+    c_release_spinlock(&table_lock);
+}
+
+/* the next thread worth running on q, dead ones are dropped on the way, call with q's lock held */
+static Thread* pick_next(sched_queue* q) {
+    Thread* t;
+    while ((t = pop_head(q)) && t->state == THREAD_DEAD) drop(t);
+    return t;
+}
+
+/* what's queued on cpu plus what it's running, idle threads don't count */
+static uint32_t load(cpu_unit* cpu) {
+    Thread* running = cpu->current_thread;
+    return cpu->run_queue->length + (running && !running->idle ? 1 : 0);
+}
+
+/* where a thread that's become ready should run */
+static cpu_unit* place(Thread* t) {
+    cpu_unit* here = arch::x86_64::apic::get_current_cpu();
+    if (here && !here->run_queue) here = nullptr;
+
+    /* back where it last ran, its working set may still be in that CPU's caches, unless that
+       CPU is clearly busier than this one and it would wait longer than a refill costs */
+    cpu_unit* last = t->cpu;
+    if (t->pinned) return last && last->run_queue ? last : nullptr;
+    if (last && last->run_queue) {
+        if (!here || load(last) <= load(here) + 1) return last;
+        return here;
+    }
+
+    /* nothing of it is cached anywhere, so the least loaded CPU, this one on a tie */
+    cpu_unit* best = here;
+    uint32_t lightest = here ? load(here) : 0;
+    cpu_registry* registry = arch::x86_64::apic::get_cpu_registry();
+    for (cpu_unit* cpu = registry ? registry->first_unit : nullptr; cpu; cpu = cpu->next_unit) {
+        if (!cpu->online || !cpu->run_queue) continue;
+
+        uint32_t l = load(cpu);
+        if (!best || l < lightest) {
+            best = cpu;
+            lightest = l;
+        }
+    }
+    return best;
+}
+
+/* the other CPU with the most threads waiting, nullptr when every other queue is empty */
+static cpu_unit* busiest(cpu_unit* self) {
+    cpu_unit* victim = nullptr;
+    uint32_t longest = 0;
+    cpu_registry* registry = arch::x86_64::apic::get_cpu_registry();
+    for (cpu_unit* cpu = registry ? registry->first_unit : nullptr; cpu; cpu = cpu->next_unit) {
+        if (cpu == self || !cpu->run_queue) continue;
+
+        uint32_t length = cpu->run_queue->length;
+        if (length > longest) {
+            victim = cpu;
+            longest = length;
+        }
+    }
+    return victim;
+}
+
+/* takes the older half of the busiest queue, returns one to run and queues the rest on cpu */
+static Thread* steal(cpu_unit* cpu) {
+    cpu_unit* victim = busiest(cpu);
+    if (!victim) return nullptr;
+
+    sched_queue* q = victim->run_queue;
+    Thread* batch = nullptr;
+    Thread** link = &batch;
+    uint32_t taken = 0;
+
+    /* the two queue locks are never held together, so two CPUs stealing from each other can't deadlock */
+    c_acquire_spinlock(&q->lock);
+    uint32_t half = (q->length + 1) / 2;
+    Thread** from = &q->head;
+    Thread* kept = nullptr;
+    while (*from && taken < half) {
+        Thread* t = *from;
+        if (t->pinned) {
+            kept = t;
+            from = &t->next;
+            continue;
+        }
+
+        *from = t->next;
+        t->next = nullptr;
+        q->length = q->length - 1;
+        if (t->state == THREAD_DEAD) {
+            drop(t);
+            continue;
+        }
+
+        *link = t;
+        link = &t->next;
+        taken++;
+    }
+    /* only the last thread can have been the tail, whatever was kept before it is now */
+    if (!*from) q->tail = kept;
+    c_release_spinlock(&q->lock);
+
+    Thread* next = batch;
+    if (!next) return nullptr;
+    batch = next->next;
+    next->next = nullptr;
+
+    sched_queue* own = cpu->run_queue;
+    c_acquire_spinlock(&own->lock);
+    while (batch) {
+        Thread* t = batch;
+        batch = t->next;
+        push_tail(own, t);
+    }
+    own->steals += taken;
+    c_release_spinlock(&own->lock);
+
+    return next;
+}
+
+/* hands cpu to next, returns the frame the stub resumes */
+static uint64_t switch_to(cpu_unit* cpu, Thread* prev, Thread* next) {
+    /* next may have been queued by a CPU that hasn't left its stack yet */
+    while (__atomic_load_n(&next->on_cpu, __ATOMIC_ACQUIRE)) asm volatile ("pause");
+
+    next->on_cpu = true;
+    next->state = THREAD_RUNNING;
+    next->quantum = CONFIG_SCHED_QUANTUM_MS;
+    next->cpu = cpu;
+    cpu->current_thread = next;
+    cpu->current_thread_id = next->tid;
+    cpu->prev_thread = prev;
+
+    prev->rsp0 = arch::x86_64::cpu::gdt::get_stack();
+    if (next->rsp0) arch::x86_64::cpu::gdt::update_stack(next->rsp0);
+
+    /* kernel threads go back to the kernel's tables, whatever they were on may be torn down */
+    uint64_t pml4 = next->proc && next->proc->pagetable ? next->proc->pagetable : mem::vmm::fetch_default_pagetable();
+    if (cpu->active_pml4 != pml4) mem::vmm::switch_pagetable(pml4);
+
+    /* the stub reloads CR3 when it differs, the one switch_pagetable chose carries the right PCID */
+    uint64_t cr3;
+    asm volatile ("mov %%cr3, %0" : "=r"(cr3));
+    next->context->cr3 = cr3;
+
+    return (uint64_t)next->context;
+}
+
+/* called with interrupts off from the timer and from yield, context is the frame the stub just pushed */
+static uint64_t reschedule(cpu_unit* cpu, ThreadContext* context) {
+    Thread* prev = cpu->current_thread;
+    prev->context = context;
+
+    sched_queue* q = cpu->run_queue;
+    if (!q) return 0;
+
+    c_acquire_spinlock(&q->lock);
+    Thread* next = pick_next(q);
+    c_release_spinlock(&q->lock);
+
+    /* only a CPU that would otherwise go idle steals, a busy one keeps what it's running */
+    bool keep = prev->state == THREAD_RUNNING && !prev->idle;
+    if (!next && !keep) next = steal(cpu);
+
+    if (!next) {
+        if (prev->state == THREAD_RUNNING) {
+            prev->quantum = CONFIG_SCHED_QUANTUM_MS;
+            return 0;
+        }
+        next = cpu->idle_thread;
+    }
+
+    /* a thread that blocked and was readied again before it got off the CPU just carries on */
+    if (next == prev) {
+        prev->state = THREAD_RUNNING;
+        prev->quantum = CONFIG_SCHED_QUANTUM_MS;
+        return 0;
+    }
+
+    if (prev->state == THREAD_RUNNING) {
+        c_acquire_spinlock(&q->lock);
+        prev->state = THREAD_READY;
+        if (!prev->idle) push_tail(q, prev);
+        c_release_spinlock(&q->lock);
+    }
+
+    return switch_to(cpu, prev, next);
+}
+
+/* gives the calling CPU its run queue, others may start placing threads on it from here on */
+static void attach_queue(cpu_unit* cpu) {
+    sched_queue* q = new_queue();
+    if (!q) {
+        Log::errf("SCHED: Couldn't allocate a run queue for CPU %u", cpu->registry_id);
+        return;
+    }
+    __atomic_store_n(&cpu->run_queue, q, __ATOMIC_RELEASE);
+}
+
+void initialise() {
+    arch::x86_64::cpu::idt::set_descriptor(SCHED_YIELD_VECTOR, (uint64_t)sched_yield_interrupt_handler, 0x8E, 0);
+
+    cpu_unit* cpu = arch::x86_64::apic::get_current_cpu();
+    if (!cpu) return;
+    attach_queue(cpu);
+
+    /* the BSP's boot stack goes to ring 3 as pid 1, so its idle thread needs a stack of its own */
+    Thread* idle_thread = new_thread(nullptr);
+    if (idle_thread) {
+        start_in_kernel(idle_thread, idle_entry, nullptr);
+        idle_thread->idle = true;
+        idle_thread->state = THREAD_READY;
+        cpu->idle_thread = idle_thread;
+    } else {
+        Log::errf("SCHED: Couldn't create the BSP's idle thread");
+    }
+
+    adopt(cpu, proc::get_current(), false);
+}
+
+void initialise_ap() {
+    cpu_unit* cpu = arch::x86_64::apic::get_current_cpu();
+    if (!cpu) return;
+
+    attach_queue(cpu);
+    adopt(cpu, nullptr, true);
+}
+
+void idle() {
+    for (;;) {
+        /* zero frames while there's nothing else to do, the next tick looks for work again */
+        if (mem::pmm::refill_zero_pool(16) == 0) asm volatile ("hlt");
+    }
+}
+
+Thread* current() {
+    uint64_t flags = arch::x86_64::misc::irq_save();
+    cpu_unit* cpu = arch::x86_64::apic::get_current_cpu();
+    Thread* t = cpu ? cpu->current_thread : nullptr;
+    arch::x86_64::misc::irq_restore(flags);
+    return t;
+}
+
+Thread* create_kernel_thread(void (*entry)(void*), void* arg, cpu_unit* cpu) {
+    Thread* t = new_thread(nullptr);
+    if (!t) return nullptr;
+
+    start_in_kernel(t, entry, arg);
+    if (cpu) {
+        t->cpu = cpu;
+        t->pinned = true;
+    }
+    ready(t);
+    return t;
+}
+
+Thread* create_user_thread(Process* p, const ThreadContext* context) {
+    Thread* t = new_thread(p);
+    if (!t) return nullptr;
+
+    *t->context = *context;
+    t->context->frame = (uint64_t)&t->context->rip;
+
+    ready(t);
+    return t;
+}
+
+void ready(Thread* t) {
+    uint64_t flags = arch::x86_64::misc::irq_save();
+    cpu_unit* cpu = place(t);
+    if (cpu) {
+        /* a halted CPU finds it on its next tick */
+        sched_queue* q = cpu->run_queue;
+        c_acquire_spinlock(&q->lock);
+        t->state = THREAD_READY;
+        push_tail(q, t);
+        c_release_spinlock(&q->lock);
+    }
+    arch::x86_64::misc::irq_restore(flags);
+}
+
+void yield() {
+    asm volatile ("int %0" :: "i"(SCHED_YIELD_VECTOR) : "memory");
+}
+
+void block() {
+    Thread* t = current();
+    if (!t) return;
+
+    /* a ready() that got here first left it READY and queued, then this only gives up the CPU */
+    ThreadState running = THREAD_RUNNING;
+    __atomic_compare_exchange_n(&t->state, &running, THREAD_BLOCKED, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+    yield();
+}
+
+void exit_thread() {
+    /* stays off, nothing may run this thread again once it's marked */
+    arch::x86_64::misc::irq_save();
+
+    Thread* t = current();
+    if (t) t->state = THREAD_DEAD;
+    yield();
+
+    for (;;) asm volatile ("hlt");
+}
+
+uint64_t timer_tick(cpu_unit* cpu, ThreadContext* context) {
+    if (!cpu || !cpu->current_thread) return 0;
+
+    Thread* t = cpu->current_thread;
+    if (t->idle) {
+        if (!cpu->run_queue || (cpu->run_queue->length == 0 && !busiest(cpu))) return 0;
+    } else if (--t->quantum > 0) {
+        return 0;
+    }
+
+    return reschedule(cpu, context);
+}
+
+#ifdef CONFIG_SCHED_BENCHMARK
+#define BENCH_STEPS (1ULL << 28)
+#define BENCH_MAX_THREADS 8
+
+struct bench_share {
+    uint64_t steps;
+    uint64_t seed;
+};
+
+static bench_share bench_shares[BENCH_MAX_THREADS];
+static uint32_t bench_done = 0;
+static uint64_t bench_sink = 0;
+
+/* pure ALU work on registers, nothing shared until the end, so only the CPUs it gets limit it */
+static void bench_worker(void* arg) {
+    bench_share* share = (bench_share*)arg;
+    uint64_t x = share->seed;
+    for (uint64_t i = 0; i < share->steps; i++) {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+    }
+
+    __atomic_add_fetch(&bench_sink, x, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&bench_done, 1, __ATOMIC_RELEASE);
+}
+
+static uint64_t total_steals() {
+    uint64_t steals = 0;
+    cpu_registry* registry = arch::x86_64::apic::get_cpu_registry();
+    for (cpu_unit* cpu = registry ? registry->first_unit : nullptr; cpu; cpu = cpu->next_unit) {
+        if (cpu->run_queue) steals += __atomic_load_n(&cpu->run_queue->steals, __ATOMIC_RELAXED);
+    }
+    return steals;
+}
+
+void benchmark() {
+    uint32_t online = 0;
+    cpu_registry* registry = arch::x86_64::apic::get_cpu_registry();
+    for (cpu_unit* cpu = registry ? registry->first_unit : nullptr; cpu; cpu = cpu->next_unit) {
+        if (cpu->online) online++;
+    }
+
+    uint64_t baseline = 0;
+    for (uint32_t n = 1; n <= BENCH_MAX_THREADS; n *= 2) {
+        /* the same total every round, split evenly, so perfect scaling halves the time each doubling */
+        for (uint32_t i = 0; i < n; i++) bench_shares[i] = {BENCH_STEPS / n, 0x9E3779B97F4A7C15ULL ^ i};
+        __atomic_store_n(&bench_done, 0, __ATOMIC_RELAXED);
+
+        uint64_t steals = total_steals();
+        uint64_t start = arch::x86_64::misc::rdtsc();
+        uint32_t started = 0;
+        for (uint32_t i = 0; i < n; i++) {
+            if (create_kernel_thread(bench_worker, &bench_shares[i])) started++;
+        }
+
+        /* hand the CPU to whatever was placed here until every worker has finished */
+        while (__atomic_load_n(&bench_done, __ATOMIC_ACQUIRE) < started) {
+            yield();
+            asm volatile ("pause");
+        }
+        uint64_t cycles = arch::x86_64::misc::rdtsc() - start;
+
+        if (started != n) {
+            Log::errf("Sched benchmark: only %u of %u threads started", started, n);
+            return;
+        }
+        if (n == 1) baseline = cycles;
+
+        uint64_t speedup = cycles ? baseline * 100 / cycles : 0;
+        Log::infof("Sched benchmark: %u threads on %u CPUs: %llu Mcycles, %llu.%02llux the 1 thread throughput, %llu steals",
+                   n, online, cycles / 1000000, speedup / 100, speedup % 100, total_steals() - steals);
+    }
+}
+#endif
+
+}
+
+extern "C" uint64_t sched_c_yield_handler(ThreadContext* context) {
+    cpu_unit* cpu = arch::x86_64::apic::get_current_cpu();
+    if (!cpu || !cpu->current_thread) return 0;
+
+    return proc::sched::reschedule(cpu, context);
+}
+
+/* runs on the new thread's stack, only now can the previous one be resumed elsewhere or freed */
+extern "C" void sched_c_finish_switch() {
+    cpu_unit* cpu = arch::x86_64::apic::get_current_cpu();
+    Thread* prev = cpu ? cpu->prev_thread : nullptr;
+    if (!prev) return;
+    cpu->prev_thread = nullptr;
+
+    if (prev->state == THREAD_DEAD) {
+        c_acquire_spinlock(&proc::sched::table_lock);
+        proc::sched::release_slot(prev);
+        c_release_spinlock(&proc::sched::table_lock);
+    }
+    __atomic_store_n(&prev->on_cpu, false, __ATOMIC_RELEASE);
+}
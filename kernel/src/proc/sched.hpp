@@ -0,0 +1,100 @@
+#ifndef SCHED_HPP
+#define SCHED_HPP 1
+
+#include <cstdint>
+#include <cstddef>
+#include <types.hpp>
+#include <config.hpp>
+
+/* how many 1 ms timer ticks a thread runs before the next one in line gets the CPU */
+#ifndef CONFIG_SCHED_QUANTUM_MS
+#define CONFIG_SCHED_QUANTUM_MS 10
+#endif
+
+#define THREAD_MAX 256
+#define THREAD_STACK_PAGES 4
+
+struct Process;
+struct cpu_unit;
+struct syscall_regs;
+struct wait_queue;
+struct sleeper_list;
+
+/* what apic_timer_interrupt_handler and sched_yield_interrupt_handler push, lowest address first */
+struct ThreadContext {
+    uint64_t rbp;
+    uint64_t cr3;
+    uint64_t r15, r14, r13, r12, r11, r10, r9, r8;
+    uint64_t rdi, rsi, rdx, rcx, rbx, rax;
+    uint64_t frame; /* address of rip, the stubs pop it into rsp before iretq */
+    uint64_t rip, cs, rflags, rsp, ss;
+};
+
+enum ThreadState {
+    THREAD_UNUSED,
+    THREAD_READY,
+    THREAD_RUNNING,
+    THREAD_BLOCKED,
+    THREAD_DEAD
+};
+
+struct Thread {
+    tid_t tid;
+    ThreadState state;
+    Process* proc;          /* nullptr for kernel threads, they run on the kernel's page table */
+    ThreadContext* context; /* where its frame was left while it isn't running */
+    void* stack_top;        /* its own kernel stack, nullptr for a context that was adopted */
+    uint64_t rsp0;          /* the TSS rsp0 it runs with */
+    uint32_t quantum;       /* ticks left before it's preempted */
+    cpu_unit* cpu;          /* the CPU it last ran on, its caches may still hold its working set */
+    bool idle;
+    bool pinned;            /* only ever runs on cpu, never stolen */
+    volatile bool on_cpu;   /* still on its stack, nobody else may resume it until this clears */
+    syscall_regs* syscall;  /* what its current syscall pushed on entry, fork resumes the child from it */
+    Thread* next;           /* the run queue it's on */
+    Thread* next_in_proc;
+
+    /* see proc/waitqueue.hpp */
+    wait_queue* waiting_on;   /* the wait queue it's on, between prepare() and the end of sleep() */
+    Thread* next_waiter;
+    volatile bool wait_armed; /* it may be woken, whoever clears this is the one who readies it */
+    bool woken;               /* taken off the wait queue by a waker rather than timing out */
+    uint64_t wake_at;         /* when a timed sleep runs out, in ms of the BSP's timer */
+    sleeper_list* sleep_list; /* the CPU's timed sleepers it armed its timeout on */
+    Thread* next_sleeper;
+};
+
+namespace proc::sched {
+
+// makes the running boot context pid 1's thread and gives the BSP an idle thread, call after proc::initialise
+void initialise();
+// makes the calling AP's running context its idle thread, follow with idle()
+void initialise_ap();
+[[noreturn]] void idle();
+
+Thread* current();
+
+// starts entry(arg) in ring 0 on a stack of its own, the thread exits when entry returns.
+// Given a cpu it's pinned there, otherwise it goes wherever there's room
+Thread* create_kernel_thread(void (*entry)(void*), void* arg, cpu_unit* cpu = nullptr);
+// a thread of p that resumes from context, which is copied onto its new kernel stack
+Thread* create_user_thread(Process* p, const ThreadContext* context);
+
+void ready(Thread* t);
+void yield();
+// takes the current thread off the CPU until someone calls ready() on it. Call it with interrupts
+// off, right after making the thread findable by its waker, a ready() that lands first isn't lost
+void block();
+[[noreturn]] void exit_thread();
+
+// the timer's share of the work, returns the frame to resume or 0 to stay on the current one
+uint64_t timer_tick(cpu_unit* cpu, ThreadContext* context);
+
+#ifdef CONFIG_SCHED_BENCHMARK
+// times the same CPU-bound work split across 1, 2, 4 and 8 threads, only built with CONFIG_SCHED_BENCHMARK
+void benchmark();
+#endif
+
+}
+
+#endif
@@ -0,0 +1,463 @@
+#include "vma.hpp"
+#include "proc.hpp"
+#include <mem/mem.hpp>
+#include <config.hpp>
+#include <cstdio>
+
+#define PAGE_SIZE 0x1000ULL
+
+#define PF_PRESENT 0x1
+#define PF_WRITE   0x2
+#define PF_USER    0x4
+#define PF_INSTR   0x10
+
+namespace proc {
+
+static mem::slab::cache* vma_cache = nullptr;
+
+static vma* new_vma() {
+    if (!vma_cache) vma_cache = mem::slab::create("vma", sizeof(vma), alignof(vma));
+    return vma_cache ? (vma*)mem::slab::alloc(vma_cache) : nullptr;
+}
+
+static inline bool is_red(vma* v) { return v && v->red; }
+static inline uint64_t subtree_end(vma* v) { return v ? v->max_end : 0; }
+
+static void update_max(vma* v) {
+    uint64_t m = v->end;
+    if (subtree_end(v->left) > m) m = subtree_end(v->left);
+    if (subtree_end(v->right) > m) m = subtree_end(v->right);
+    v->max_end = m;
+}
+
+static void update_path(vma* v) {
+    for (; v; v = v->parent) update_max(v);
+}
+
+static void replace_child(vma** root, vma* parent, vma* old, vma* node) {
+    if (!parent) *root = node;
+    else if (parent->left == old) parent->left = node;
+    else parent->right = node;
+}
+
+static void rotate_left(vma** root, vma* x) {
+    vma* y = x->right;
+    x->right = y->left;
+    if (y->left) y->left->parent = x;
+
+    y->parent = x->parent;
+    replace_child(root, x->parent, x, y);
+    y->left = x;
+    x->parent = y;
+
+    update_max(x);
+    update_max(y);
+}
+
+static void rotate_right(vma** root, vma* x) {
+    vma* y = x->left;
+    x->left = y->right;
+    if (y->right) y->right->parent = x;
+
+    y->parent = x->parent;
+    replace_child(root, x->parent, x, y);
+    y->right = x;
+    x->parent = y;
+
+    update_max(x);
+    update_max(y);
+}
+
+static void insert_node(vma** root, vma* z) {
+    vma* parent = nullptr;
+    vma** link = root;
+    while (*link) {
+        parent = *link;
+        link = (z->start < parent->start) ? &parent->left : &parent->right;
+    }
+
+    z->left = z->right = nullptr;
+    z->parent = parent;
+    z->red = true;
+    z->max_end = z->end;
+    *link = z;
+    update_path(parent);
+
+    while (is_red(z->parent)) {
+        vma* g = z->parent->parent;
+        if (z->parent == g->left) {
+            vma* u = g->right;
+            if (is_red(u)) {
+                z->parent->red = false;
+                u->red = false;
+                g->red = true;
+                z = g;
+                continue;
+            }
+            if (z == z->parent->right) {
+                z = z->parent;
+                rotate_left(root, z);
+            }
+            z->parent->red = false;
+            g->red = true;
+            rotate_right(root, g);
+        } else {
+            vma* u = g->left;
+            if (is_red(u)) {
+                z->parent->red = false;
+                u->red = false;
+                g->red = true;
+                z = g;
+                continue;
+            }
+            if (z == z->parent->left) {
+                z = z->parent;
+                rotate_right(root, z);
+            }
+            z->parent->red = false;
+            g->red = true;
+            rotate_left(root, g);
+        }
+    }
+
+    (*root)->red = false;
+}
+
+/* x took the place of a removed black node and may be null, so its parent is passed along */
+static void erase_fixup(vma** root, vma* x, vma* parent) {
+    while (x != *root && !is_red(x)) {
+        if (x == parent->left) {
+            vma* w = parent->right;
+            if (is_red(w)) {
+                w->red = false;
+                parent->red = true;
+                rotate_left(root, parent);
+                w = parent->right;
+            }
+            if (!is_red(w->left) && !is_red(w->right)) {
+                w->red = true;
+                x = parent;
+                parent = x->parent;
+                continue;
+            }
+            if (!is_red(w->right)) {
+                w->left->red = false;
+                w->red = true;
+                rotate_right(root, w);
+                w = parent->right;
+            }
+            w->red = parent->red;
+            parent->red = false;
+            w->right->red = false;
+            rotate_left(root, parent);
+        } else {
+            vma* w = parent->left;
+            if (is_red(w)) {
+                w->red = false;
+                parent->red = true;
+                rotate_right(root, parent);
+                w = parent->left;
+            }
+            if (!is_red(w->left) && !is_red(w->right)) {
+                w->red = true;
+                x = parent;
+                parent = x->parent;
+                continue;
+            }
+            if (!is_red(w->left)) {
+                w->right->red = false;
+                w->red = true;
+                rotate_left(root, w);
+                w = parent->left;
+            }
+            w->red = parent->red;
+            parent->red = false;
+            w->left->red = false;
+            rotate_right(root, parent);
+        }
+        x = *root;
+    }
+
+    if (x) x->red = false;
+}
+
+static void erase_node(vma** root, vma* z) {
+    vma* x;
+    vma* x_parent;
+    bool removed_red = z->red;
+
+    if (!z->left || !z->right) {
+        x = z->left ? z->left : z->right;
+        x_parent = z->parent;
+        if (x) x->parent = x_parent;
+        replace_child(root, z->parent, z, x);
+    } else {
+        /* z's successor takes its place in the tree */
+        vma* y = z->right;
+        while (y->left) y = y->left;
+
+        removed_red = y->red;
+        x = y->right;
+
+        if (y->parent == z) {
+            x_parent = y;
+        } else {
+            x_parent = y->parent;
+            x_parent->left = x;
+            if (x) x->parent = x_parent;
+            y->right = z->right;
+            y->right->parent = y;
+        }
+
+        y->parent = z->parent;
+        replace_child(root, z->parent, z, y);
+        y->left = z->left;
+        y->left->parent = y;
+        y->red = z->red;
+    }
+
+    update_path(x_parent);
+    if (!removed_red) erase_fixup(root, x, x_parent);
+}
+
+vma* vma_first_overlap(Process* p, uint64_t start, uint64_t end) {
+    vma* v = p->vmas;
+    while (v) {
+        /* anything in the left subtree starts lower, so it wins if it reaches past start */
+        if (v->left && v->left->max_end > start) v = v->left;
+        else if (v->start < end && v->end > start) return v;
+        else if (v->start >= end) return nullptr;
+        else v = v->right;
+    }
+    return nullptr;
+}
+
+vma* vma_find(Process* p, uint64_t addr) {
+    return vma_first_overlap(p, addr, addr + 1);
+}
+
+vma* vma_first(Process* p) {
+    vma* v = p->vmas;
+    while (v && v->left) v = v->left;
+    return v;
+}
+
+vma* vma_next(vma* area) {
+    if (area->right) {
+        vma* v = area->right;
+        while (v->left) v = v->left;
+        return v;
+    }
+
+    while (area->parent && area == area->parent->right) area = area->parent;
+    return area->parent;
+}
+
+vma* vma_insert(Process* p, uint64_t start, uint64_t end, uint32_t prot, VmaKind kind) {
+    if (start >= end) return nullptr;
+
+    /* areas never overlap */
+    if (vma_first_overlap(p, start, end)) return nullptr;
+
+    vma* v = new_vma();
+    if (!v) return nullptr;
+
+    v->start = start;
+    v->end = end;
+    v->prot = prot;
+    v->kind = kind;
+    insert_node(&p->vmas, v);
+
+    return v;
+}
+
+/* moves the end of an area, whatever falls off the end is unmapped and freed */
+bool vma_resize(Process* p, vma* area, uint64_t new_end) {
+    if (new_end < area->start) return false;
+    (void)p;
+
+    if (new_end > area->end) {
+        vma* next = vma_next(area);
+        if (next && next->start < new_end) return false;
+    } else {
+        uint64_t first = (new_end + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+        if (first < area->end)
+            mem::vmm::munmap_anonymous(reinterpret_cast<void*>(first), (area->end - first + PAGE_SIZE - 1) / PAGE_SIZE);
+    }
+
+    area->end = new_end;
+    update_path(area);
+    return true;
+}
+
+void vma_remove(Process* p, vma* area) {
+    erase_node(&p->vmas, area);
+
+    uint64_t start = area->start & ~(PAGE_SIZE - 1);
+    uint64_t end = (area->end + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+    mem::vmm::munmap_anonymous(reinterpret_cast<void*>(start), (end - start) / PAGE_SIZE);
+
+    mem::slab::free(vma_cache, area);
+}
+
+void vma_remove_all(Process* p) {
+    while (p->vmas) vma_remove(p, p->vmas);
+}
+
+bool vma_unmap(Process* p, uint64_t start, uint64_t end) {
+    vma* v;
+    while ((v = vma_first_overlap(p, start, end))) {
+        if (v->start >= start && v->end <= end) {
+            vma_remove(p, v);
+        } else if (v->start < start && v->end > end) {
+            /* punching a hole, the part above it becomes its own area */
+            uint64_t old_end = v->end;
+            mem::vmm::munmap_anonymous(reinterpret_cast<void*>(start), (end - start) / PAGE_SIZE);
+            v->end = start;
+            update_path(v);
+
+            if (!vma_insert(p, end, old_end, v->prot, v->kind)) {
+                mem::vmm::munmap_anonymous(reinterpret_cast<void*>(end), (old_end - end + PAGE_SIZE - 1) / PAGE_SIZE);
+                return false;
+            }
+            return true;
+        } else if (v->start < start) {
+            vma_resize(p, v, start);
+        } else {
+            /* the order doesn't change, so the start can move in place */
+            mem::vmm::munmap_anonymous(reinterpret_cast<void*>(v->start), (end - v->start) / PAGE_SIZE);
+            v->start = end;
+        }
+    }
+    return true;
+}
+
+static vma* clone_subtree(vma* src, vma* parent, bool* ok) {
+    if (!src || !*ok) return nullptr;
+
+    vma* v = new_vma();
+    if (!v) {
+        *ok = false;
+        return nullptr;
+    }
+
+    *v = *src;
+    v->parent = parent;
+    v->left = clone_subtree(src->left, v, ok);
+    v->right = clone_subtree(src->right, v, ok);
+    return v;
+}
+
+bool vma_clone(Process* dst, Process* src) {
+    bool ok = true;
+    dst->vmas = clone_subtree(src->vmas, nullptr, &ok);
+    return ok;
+}
+
+static void drop_subtree(vma* v) {
+    if (!v) return;
+    drop_subtree(v->left);
+    drop_subtree(v->right);
+    mem::slab::free(vma_cache, v);
+}
+
+void vma_drop_all(Process* p) {
+    drop_subtree(p->vmas);
+    p->vmas = nullptr;
+}
+
+/* x86 has no write-only or execute-only pages, any PROT bit makes the page readable */
+static uint64_t prot_to_flags(uint32_t prot) {
+    uint64_t flags = PAGE_PRESENT | PAGE_USER;
+    if (prot & VMA_WRITE) flags |= PAGE_RW;
+    if (!(prot & VMA_EXEC)) flags |= PAGE_NX;
+    return flags;
+}
+
+bool handle_page_fault(uint64_t addr, uint64_t error_code) {
+    Process* p = get_current();
+    if (!p) return false;
+
+    /* a write to a page shared since fork, only pages that were writable get marked */
+    if ((error_code & PF_PRESENT) && (error_code & PF_WRITE))
+        return mem::vmm::handle_cow_fault(reinterpret_cast<void*>(addr));
+
+    /* any other present fault is a protection violation, there's nothing to back */
+    if (error_code & PF_PRESENT) return false;
+
+    vma* v = vma_find(p, addr);
+    if (!v) return false;
+    /* a PROT_NONE area is only a reservation, nothing in it ever gets backed */
+    if (!(v->prot & (VMA_READ | VMA_WRITE | VMA_EXEC))) return false;
+    if ((error_code & PF_WRITE) && !(v->prot & VMA_WRITE)) return false;
+    if ((error_code & PF_INSTR) && !(v->prot & VMA_EXEC)) return false;
+
+    void* frame = mem::pmm::palloc_zeroed(1);
+    if (!frame) return false;
+
+    uint64_t page = addr & ~(PAGE_SIZE - 1);
+    if (!mem::vmm::mmap(frame, reinterpret_cast<void*>(page), 1, prot_to_flags(v->prot))) {
+        mem::pmm::free(frame, 1);
+        return false;
+    }
+
+    return true;
+}
+
+#ifdef CONFIG_VMA_SELFTEST
+/* stores 1 to p and returns 0, or returns 1 if the store faulted and probe_fixup sent it to vma_probe_fault */
+extern "C" int vma_probe_write(volatile uint8_t* p);
+extern "C" char vma_probe_fault[];
+
+asm(
+    ".pushsection .text\n"
+    ".global vma_probe_write\n"
+    "vma_probe_write:\n"
+    "    movb $1, (%rdi)\n"
+    "    xor %eax, %eax\n"
+    "    ret\n"
+    ".global vma_probe_fault\n"
+    "vma_probe_fault:\n"
+    "    mov $1, %eax\n"
+    "    ret\n"
+    ".popsection\n"
+);
+
+bool probe_fixup(uint64_t* rip) {
+    if (*rip != reinterpret_cast<uint64_t>(&vma_probe_write)) return false;
+    *rip = reinterpret_cast<uint64_t>(vma_probe_fault);
+    return true;
+}
+
+bool selftest() {
+    Process* p = get_current();
+    if (!p || !p->pagetable) return false;
+
+    uint64_t saved = mem::vmm::get_cr3();
+    mem::vmm::switch_pagetable(p->pagetable);
+
+    uint64_t base = USER_MMAP_BASE;
+    volatile uint8_t* ro = reinterpret_cast<volatile uint8_t*>(base);
+    volatile uint8_t* rw = ro + PAGE_SIZE;
+
+    bool ok = vma_insert(p, base, base + PAGE_SIZE, VMA_READ, VMA_ANON)
+        && vma_insert(p, base + PAGE_SIZE, base + 2 * PAGE_SIZE, VMA_READ | VMA_WRITE, VMA_ANON);
+
+    if (ok) {
+        /* the read backs the page, the write after it has to hit a present read-only entry */
+        bool read_zero = *ro == 0;
+        bool ro_faulted = vma_probe_write(ro) == 1;
+        bool rw_stored = vma_probe_write(rw) == 0 && *rw == 1;
+        ok = read_zero && ro_faulted && rw_stored && *ro == 0;
+
+        printf("VMA selftest: read-only write %s, writable write %s\n\r",
+               ro_faulted ? "faulted" : "went through", rw_stored ? "stored" : "failed");
+    }
+
+    vma_unmap(p, base, base + 2 * PAGE_SIZE);
+    mem::vmm::switch_pagetable(saved);
+    return ok;
+}
+#endif
+
+}
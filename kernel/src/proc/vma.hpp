@@ -0,0 +1,77 @@
+#ifndef VMA_HPP
+#define VMA_HPP 1
+
+#include <cstdint>
+#include <cstddef>
+
+struct Process;
+
+#define PROT_NONE  0x0
+#define PROT_READ  0x1
+#define PROT_WRITE 0x2
+#define PROT_EXEC  0x4
+
+#define MAP_SHARED    0x01
+#define MAP_PRIVATE   0x02
+#define MAP_FIXED     0x10
+#define MAP_ANONYMOUS 0x20
+
+// same bits as PROT_*, so mmap can pass its prot straight through
+enum VmaProt {
+    VMA_READ = PROT_READ,
+    VMA_WRITE = PROT_WRITE,
+    VMA_EXEC = PROT_EXEC,
+};
+
+// what backs the pages of an area
+enum VmaKind {
+    VMA_ANON,
+    VMA_STACK,
+    VMA_BRK,
+};
+
+// a reserved range of user address space, pages in it are only backed once touched
+struct vma {
+    uint64_t start;
+    uint64_t end;
+    uint32_t prot;
+    VmaKind kind;
+
+    // red-black tree keyed by start, max_end is the largest end in this subtree
+    vma* left;
+    vma* right;
+    vma* parent;
+    uint64_t max_end;
+    bool red;
+};
+
+namespace proc {
+
+vma* vma_find(Process* p, uint64_t addr);
+// the lowest area overlapping [start, end), if any
+vma* vma_first_overlap(Process* p, uint64_t start, uint64_t end);
+vma* vma_first(Process* p);
+vma* vma_next(vma* area);
+
+vma* vma_insert(Process* p, uint64_t start, uint64_t end, uint32_t prot, VmaKind kind);
+bool vma_resize(Process* p, vma* area, uint64_t new_end);
+void vma_remove(Process* p, vma* area);
+void vma_remove_all(Process* p);
+// unmaps [start, end), trimming or splitting whatever areas it cuts through
+bool vma_unmap(Process* p, uint64_t start, uint64_t end);
+// copies src's areas into dst without touching any mappings
+bool vma_clone(Process* dst, Process* src);
+// frees the areas only, for when the whole page table is going away anyway
+void vma_drop_all(Process* p);
+
+// backs the page at addr if it lies in one of the current process' areas or copies a copy-on-write page, false if the fault isn't ours
+bool handle_page_fault(uint64_t addr, uint64_t error_code);
+
+// writes to a read-only area and a writable one at boot and checks only the first faults
+bool selftest();
+// moves a faulting selftest store on to its recovery path, false if rip isn't that store
+bool probe_fixup(uint64_t* rip);
+
+}
+
+#endif
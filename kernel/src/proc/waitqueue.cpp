@@ -0,0 +1,216 @@
+#include "waitqueue.hpp"
+#include "sched.hpp"
+#include <mem/mem.hpp>
+#include <arch/arch.hpp>
+#include <arch/x86_64/apic/apic.hpp>
+
+/* one per CPU plus the BSP's, so each CPU's own timer times out whoever slept on it */
+#define SLEEPER_LISTS 65
+
+/* timed sleepers, soonest first, only taken with interrupts off */
+struct sleeper_list {
+    spinlock lock;
+    Thread* head;
+};
+
+static sleeper_list sleepers[SLEEPER_LISTS];
+
+/* milliseconds since the APIC timer started, 0 before that */
+static volatile uint64_t ticks_ms = 0;
+
+namespace proc::wait {
+
+/* whoever clears wait_armed readies the thread, so it's readied exactly once per prepare() */
+static void wake(Thread* t) {
+    if (__atomic_exchange_n(&t->wait_armed, false, __ATOMIC_ACQ_REL)) sched::ready(t);
+}
+
+static void unlink(wait_queue* wq, Thread* t) {
+    Thread* prev = nullptr;
+    for (Thread* w = wq->head; w; prev = w, w = w->next_waiter) {
+        if (w != t) continue;
+
+        if (prev) prev->next_waiter = t->next_waiter;
+        else wq->head = t->next_waiter;
+        if (wq->tail == t) wq->tail = prev;
+        t->next_waiter = nullptr;
+        return;
+    }
+}
+
+/* CPUs past the end share the BSP's list, its timer times them out */
+static sleeper_list* sleepers_of(cpu_unit* cpu) {
+    if (!cpu || cpu->is_bsp || cpu->registry_id >= SLEEPER_LISTS - 1) return &sleepers[0];
+    return &sleepers[cpu->registry_id + 1];
+}
+
+static void arm_timer(Thread* t, uint64_t wake_at) {
+    sleeper_list* list = sleepers_of(arch::x86_64::apic::get_current_cpu());
+    t->wake_at = wake_at;
+    t->sleep_list = list;
+
+    c_acquire_spinlock(&list->lock);
+    Thread** link = &list->head;
+    while (*link && (*link)->wake_at <= wake_at) link = &(*link)->next_sleeper;
+    t->next_sleeper = *link;
+    *link = t;
+    c_release_spinlock(&list->lock);
+}
+
+/* the list it armed on, it may have been readied onto another CPU since */
+static void disarm_timer(Thread* t) {
+    sleeper_list* list = t->sleep_list;
+
+    c_acquire_spinlock(&list->lock);
+    Thread** link = &list->head;
+    while (*link && *link != t) link = &(*link)->next_sleeper;
+    if (*link) *link = t->next_sleeper;
+    t->next_sleeper = nullptr;
+    t->sleep_list = nullptr;
+    c_release_spinlock(&list->lock);
+}
+
+void initialise(wait_queue* wq, const char* name) {
+    mem::memset(wq, 0, sizeof(wait_queue));
+
+    size_t n = 0;
+    while (name[n] && n < sizeof(wq->lock.name) - 1) n++;
+    mem::memcpy(wq->lock.name, name, n);
+}
+
+void prepare(wait_queue* wq) {
+    Thread* t = sched::current();
+    uint64_t flags = arch::x86_64::misc::irq_save();
+    c_acquire_spinlock(&wq->lock);
+
+    t->woken = false;
+    t->waiting_on = wq;
+    t->next_waiter = nullptr;
+    if (wq->tail) wq->tail->next_waiter = t;
+    else wq->head = t;
+    wq->tail = t;
+    __atomic_store_n(&t->wait_armed, true, __ATOMIC_RELEASE);
+
+    c_release_spinlock(&wq->lock);
+    arch::x86_64::misc::irq_restore(flags);
+}
+
+bool sleep(wait_queue* wq, uint64_t timeout_ms) {
+    Thread* t = sched::current();
+    uint64_t flags = arch::x86_64::misc::irq_save();
+
+    if (timeout_ms != WAIT_FOREVER) arm_timer(t, ticks_ms + timeout_ms);
+    sched::block();
+    if (timeout_ms != WAIT_FOREVER) disarm_timer(t);
+
+    /* whoever readied it already took it off wq, a timeout included */
+    c_acquire_spinlock(&wq->lock);
+    bool woken = t->woken;
+    t->waiting_on = nullptr;
+    c_release_spinlock(&wq->lock);
+
+    arch::x86_64::misc::irq_restore(flags);
+    return woken;
+}
+
+void cancel(wait_queue* wq) {
+    Thread* t = sched::current();
+    uint64_t flags = arch::x86_64::misc::irq_save();
+
+    /* disarm and unlink in one go, otherwise a wake_one in between picks it and wakes nobody */
+    c_acquire_spinlock(&wq->lock);
+    bool armed = __atomic_exchange_n(&t->wait_armed, false, __ATOMIC_ACQ_REL);
+    if (armed) unlink(wq, t);
+    t->waiting_on = nullptr;
+    c_release_spinlock(&wq->lock);
+
+    /* a waker already took it off and readied it, block to use up that ready */
+    if (!armed) sched::block();
+
+    arch::x86_64::misc::irq_restore(flags);
+}
+
+void wake_one(wait_queue* wq) {
+    uint64_t flags = arch::x86_64::misc::irq_save();
+    c_acquire_spinlock(&wq->lock);
+
+    Thread* t = wq->head;
+    if (t) {
+        wq->head = t->next_waiter;
+        if (!wq->head) wq->tail = nullptr;
+        t->next_waiter = nullptr;
+        t->woken = true;
+        wake(t);
+    }
+
+    c_release_spinlock(&wq->lock);
+    arch::x86_64::misc::irq_restore(flags);
+}
+
+void wake_all(wait_queue* wq) {
+    uint64_t flags = arch::x86_64::misc::irq_save();
+    c_acquire_spinlock(&wq->lock);
+
+    Thread* t = wq->head;
+    wq->head = wq->tail = nullptr;
+    while (t) {
+        Thread* next = t->next_waiter;
+        t->next_waiter = nullptr;
+        t->woken = true;
+        wake(t);
+        t = next;
+    }
+
+    c_release_spinlock(&wq->lock);
+    arch::x86_64::misc::irq_restore(flags);
+}
+
+void sleep_ms(uint64_t ms) {
+    if (ms == 0) return;
+
+    wait_queue wq;
+    initialise(&wq, "SLEEP");
+    wait_until(&wq, [] { return false; }, ms);
+}
+
+bool can_block() {
+    Thread* t = sched::current();
+    return t && !t->idle && __atomic_load_n(&ticks_ms, __ATOMIC_RELAXED) != 0;
+}
+
+uint64_t now_ms() {
+    return __atomic_load_n(&ticks_ms, __ATOMIC_RELAXED);
+}
+
+void clock_tick(uint64_t now) {
+    __atomic_store_n(&ticks_ms, now, __ATOMIC_RELAXED);
+}
+
+void timer_tick(cpu_unit* cpu) {
+    sleeper_list* list = sleepers_of(cpu);
+    if (!__atomic_load_n(&list->head, __ATOMIC_RELAXED)) return;
+
+    uint64_t now = now_ms();
+    c_acquire_spinlock(&list->lock);
+    while (list->head && list->head->wake_at <= now) {
+        Thread* t = list->head;
+        list->head = t->next_sleeper;
+        t->next_sleeper = nullptr;
+
+        /*
+         * it's still queued on waiting_on, take it off under that lock so wake_one can't pick it
+         * and lose the wakeup. waiting_on outlives this, the sleeper can't get past disarm_timer
+         * until list->lock drops
+         */
+        wait_queue* wq = t->waiting_on;
+        c_acquire_spinlock(&wq->lock);
+        if (__atomic_exchange_n(&t->wait_armed, false, __ATOMIC_ACQ_REL)) {
+            unlink(wq, t);
+            sched::ready(t);
+        }
+        c_release_spinlock(&wq->lock);
+    }
+    c_release_spinlock(&list->lock);
+}
+
+}
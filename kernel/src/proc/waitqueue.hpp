@@ -0,0 +1,83 @@
+#ifndef WAITQUEUE_HPP
+#define WAITQUEUE_HPP 1
+
+#include <cstdint>
+
+extern "C" {
+#include <proc/spinlocks.h>
+}
+
+struct Thread;
+struct cpu_unit;
+
+/* threads blocked until whatever they wait for happens, woken in the order they arrived */
+struct wait_queue {
+    spinlock lock;
+    Thread* head;
+    Thread* tail;
+};
+
+#define WAIT_FOREVER 0
+
+namespace proc::wait {
+
+void initialise(wait_queue* wq, const char* name);
+
+// puts the current thread on wq, a wakeup from here on isn't lost even if it lands before sleep()
+void prepare(wait_queue* wq);
+// blocks until woken or timeout_ms passes, WAIT_FOREVER never times out. False on a timeout
+bool sleep(wait_queue* wq, uint64_t timeout_ms);
+// takes the current thread back off wq without sleeping, for when it already has what it waited for
+void cancel(wait_queue* wq);
+
+void wake_one(wait_queue* wq);
+void wake_all(wait_queue* wq);
+
+// blocks for ms with nothing but the timer to wake it
+void sleep_ms(uint64_t ms);
+
+// false until there's a thread to block and a timer to time it out, until then waits spin
+bool can_block();
+uint64_t now_ms();
+// the BSP's timer calls this every tick to keep time for now_ms
+void clock_tick(uint64_t now);
+// every CPU's timer calls this every tick, it wakes the timed sleepers that slept on it whose time is up
+void timer_tick(cpu_unit* cpu);
+
+// sleeps until cond() holds, checked again after every wakeup. cond may take what it waited
+// for, a true return means it did. False if timeout_ms passed first
+template <typename Cond>
+bool wait_until(wait_queue* wq, Cond cond, uint64_t timeout_ms) {
+    uint64_t deadline = timeout_ms == WAIT_FOREVER ? 0 : now_ms() + timeout_ms;
+
+    if (!can_block()) {
+        while (!cond()) {
+            if (deadline && now_ms() >= deadline) return false;
+            asm volatile ("pause");
+        }
+        return true;
+    }
+
+    for (;;) {
+        prepare(wq);
+        if (cond()) {
+            cancel(wq);
+            return true;
+        }
+
+        uint64_t left = WAIT_FOREVER;
+        if (deadline) {
+            uint64_t now = now_ms();
+            if (now >= deadline) {
+                cancel(wq);
+                return false;
+            }
+            left = deadline - now;
+        }
+        sleep(wq, left);
+    }
+}
+
+}
+
+#endif
@@ -0,0 +1,115 @@
+#include "workqueue.hpp"
+#include "sched.hpp"
+#include <mem/mem.hpp>
+#include <arch/arch.hpp>
+#include <arch/x86_64/apic/apic.hpp>
+#include <cstdio>
+
+extern "C" {
+#include <proc/spinlocks.h>
+}
+
+/* one per CPU, only taken with interrupts off since interrupt handlers queue onto it */
+struct workqueue {
+    spinlock lock;
+    work_item* head;
+    work_item* tail;
+    Thread* worker;
+    bool sleeping; /* the worker found nothing to do and blocked, the next schedule readies it */
+};
+
+namespace proc::work {
+
+static void worker(void* arg) {
+    workqueue* q = (workqueue*)arg;
+
+    for (;;) {
+        uint64_t flags = arch::x86_64::misc::irq_save();
+        c_acquire_spinlock(&q->lock);
+
+        work_item* item = q->head;
+        if (!item) {
+            q->sleeping = true;
+            c_release_spinlock(&q->lock);
+            sched::block();
+            arch::x86_64::misc::irq_restore(flags);
+            continue;
+        }
+
+        q->head = item->next;
+        if (!q->head) q->tail = nullptr;
+        item->next = nullptr;
+        __atomic_store_n(&item->queued, false, __ATOMIC_RELEASE);
+
+        c_release_spinlock(&q->lock);
+        arch::x86_64::misc::irq_restore(flags);
+
+        item->fn(item->arg);
+    }
+}
+
+uint32_t initialise() {
+    uint32_t workers = 0;
+    cpu_registry* registry = arch::x86_64::apic::get_cpu_registry();
+    for (cpu_unit* cpu = registry ? registry->first_unit : nullptr; cpu; cpu = cpu->next_unit) {
+        if (!cpu->online) continue;
+
+        workqueue* q = (workqueue*)mem::heap::malloc_aligned(sizeof(workqueue), 64);
+        if (!q) {
+            Log::errf("WORKQUEUE: Couldn't allocate a work queue for CPU %u", cpu->registry_id);
+            continue;
+        }
+        mem::memset(q, 0, sizeof(workqueue));
+        mem::memcpy(q->lock.name, "WORKQ", 6);
+
+        /* blocks as soon as it first runs, until then schedule() only has to queue */
+        q->worker = sched::create_kernel_thread(worker, q, cpu);
+        if (!q->worker) {
+            Log::errf("WORKQUEUE: Couldn't start a worker on CPU %u", cpu->registry_id);
+            mem::heap::free(q);
+            continue;
+        }
+
+        __atomic_store_n(&cpu->work_queue, q, __ATOMIC_RELEASE);
+        workers++;
+    }
+    return workers;
+}
+
+bool schedule(work_item* item) {
+    uint64_t flags = arch::x86_64::misc::irq_save();
+    bool queued = schedule_on(arch::x86_64::apic::get_current_cpu(), item);
+    arch::x86_64::misc::irq_restore(flags);
+    return queued;
+}
+
+bool schedule_on(cpu_unit* cpu, work_item* item) {
+    if (__atomic_exchange_n(&item->queued, true, __ATOMIC_ACQ_REL)) return false;
+
+    workqueue* q = cpu ? __atomic_load_n(&cpu->work_queue, __ATOMIC_ACQUIRE) : nullptr;
+    if (!q) {
+        __atomic_store_n(&item->queued, false, __ATOMIC_RELEASE);
+        item->fn(item->arg);
+        return true;
+    }
+
+    uint64_t flags = arch::x86_64::misc::irq_save();
+    c_acquire_spinlock(&q->lock);
+
+    item->next = nullptr;
+    if (q->tail) q->tail->next = item;
+    else q->head = item;
+    q->tail = item;
+
+    /* readied under the lock, so it can't be woken twice for the one time it blocked */
+    if (q->sleeping) {
+        q->sleeping = false;
+        sched::ready(q->worker);
+    }
+
+    c_release_spinlock(&q->lock);
+    arch::x86_64::misc::irq_restore(flags);
+    return true;
+}
+
+}
@@ -0,0 +1,28 @@
+#ifndef WORKQUEUE_HPP
+#define WORKQUEUE_HPP 1
+
+#include <cstdint>
+
+struct cpu_unit;
+
+/* owned by whoever schedules it, so queueing never allocates and works from interrupt handlers */
+struct work_item {
+    void (*fn)(void*);
+    void* arg;
+    work_item* next;
+    volatile bool queued; /* cleared just before fn runs, so fn may queue it again */
+};
+
+namespace proc::work {
+
+// a worker thread pinned to every online CPU, call after sched::initialise
+uint32_t initialise();
+
+// queues item on the calling CPU's worker, false if it's already queued.
+// Until the workers are up it runs on the spot instead
+bool schedule(work_item* item);
+bool schedule_on(cpu_unit* cpu, work_item* item);
+
+}
+
+#endif
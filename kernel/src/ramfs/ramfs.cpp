@@ -37,6 +37,7 @@ static Inode inode_table[MAX_INODES];
 static FileDescriptor fd_table[MAX_FDS];
 static uint64_t next_ino = 1;
 static char current_dir[PATH_MAX];
+static mem::slab::cache* dir_cache = nullptr;
 
 static Inode* allocate_inode() {
     for (int i = 0; i < MAX_INODES; i++) {
@@ -566,7 +567,8 @@ DIR* opendir(const char* name) {
         return nullptr;
     }
     
-    DIR* dir = (DIR*)mem::heap::malloc(sizeof(DIR));
+    if (!dir_cache) dir_cache = mem::slab::create("DIR", sizeof(DIR));
+    DIR* dir = dir_cache ? (DIR*)mem::slab::alloc(dir_cache) : nullptr;
     if (!dir) return nullptr;
     
     dir->internal = inode->first_child;
@@ -597,7 +599,7 @@ struct dirent* readdir(DIR* dirp) {
 
 int closedir(DIR* dirp) {
     if (!dirp) return -1;
-    mem::heap::free(dirp);
+    mem::slab::free(dir_cache, dirp);
     return 0;
 }
 
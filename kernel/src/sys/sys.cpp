@@ -27,6 +27,8 @@ void initialise_syscalls() {
     register_syscall(SYS_stat,      (void*)sys_stat,      2, "sys_stat",      "int sys_stat(const char* filename, stat* statbuf)");
     register_syscall(SYS_fstat,     (void*)sys_fstat,     2, "sys_fstat",     "int sys_fstat(fd_t fd, stat* statbuf)");
     register_syscall(SYS_lstat,     (void*)sys_lstat,     2, "sys_lstat",     "int sys_lstat(const char* filename, stat* statbuf)");
+    register_syscall(SYS_mmap,      (void*)sys_mmap,      6, "sys_mmap",      "void* sys_mmap(void* addr, size_t length, int prot, int flags, fd_t fd, off_t offset)");
+    register_syscall(SYS_munmap,    (void*)sys_munmap,    2, "sys_munmap",    "int sys_munmap(void* addr, size_t length)");
     register_syscall(SYS_brk,       (void*)sys_brk,       1, "sys_brk",       "int sys_brk(uint32_t brk)");
     register_syscall(SYS_dup,       (void*)sys_dup,       1, "sys_dup",       "int sys_dup(fd_t fildes)");
     register_syscall(SYS_dup2,      (void*)sys_dup2,      2, "sys_dup2",      "int sys_dup2(fd_t oldfd, fd_t newfd)");
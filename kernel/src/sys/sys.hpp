@@ -23,6 +23,8 @@ int sys_stat(const char* filename, stat* statbuf);
 int sys_fstat(fd_t fd, stat* statbuf);
 int sys_lstat(const char* filename, stat* statbuf);
 off_t sys_lseek(fd_t fd, off_t offset, unsigned int whence);
+void* sys_mmap(void* addr, size_t length, int prot, int flags, fd_t fd, off_t offset);
+int sys_munmap(void* addr, size_t length);
 int sys_brk(void* addr);
 int sys_dup(fd_t fildes);
 int sys_dup2(fd_t oldfd, fd_t newfd);
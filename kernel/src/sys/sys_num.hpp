@@ -11,6 +11,8 @@ neu(close,3)
 neu(stat,4)
 neu(fstat,5)
 neu(lstat,6)
+neu(mmap,9)
+neu(munmap,11)
 neu(brk,12)
 neu(dup,32)
 neu(dup2,33)
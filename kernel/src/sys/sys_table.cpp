@@ -49,6 +49,14 @@ off_t sys_lseek(fd_t fd, off_t offset, unsigned int whence) {
     return ramfs::lseek(fd, offset, whence);
 }
 
+void* sys_mmap(void* addr, size_t length, int prot, int flags, fd_t fd, off_t offset) {
+    return proc::mmap(addr, length, prot, flags, fd, offset);
+}
+
+int sys_munmap(void* addr, size_t length) {
+    return proc::munmap(addr, length);
+}
+
 int sys_brk(void* addr) {
     return proc::brk(addr);
 }